@@ -22,10 +22,36 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+#endif
+#if defined(HAVE_GETRUSAGE) && defined(HAVE_SYS_RESOURCE_H)
+#  include <sys/resource.h>
+#  define USE_GETRUSAGE 1
+#endif
+#include <time.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  define USE_MMAP 1
+#endif
 
 /* don't use new HDF5 1.8 API (which isn't even fully documented yet, grrr) */
 #define H5_USE_16_API 1
 
+#ifdef HAVE_MPI
+#  include <mpi.h>
+#endif
 #include <hdf5.h>
 
 #include "arrayh5.h"
@@ -47,6 +73,304 @@
      H5Eset_auto(xxxxx_err_func, xxxxx_err_func_data); \
 }
 
+/***********************************************************************/
+/* MPI.  Programs that call arrayh5_mpi_init divide their work among
+   the processes of an MPI job, if there is more than one: each process
+   reads the input files independently through MPI-IO, while the files
+   that are written are opened by all of the processes together, each
+   of which writes its own rows of the datasets (collectively). */
+
+static int mpi_rank = 0, mpi_size = 1;
+
+#ifdef HAVE_MPI
+static void mpi_finalize(void)
+{
+     int finalized;
+     MPI_Finalized(&finalized);
+     if (!finalized)
+	  MPI_Finalize();
+}
+#endif
+
+void arrayh5_mpi_init(int *argc, char ***argv)
+{
+#ifdef HAVE_MPI
+     int initialized;
+     MPI_Initialized(&initialized);
+     if (!initialized) {
+	  MPI_Init(argc, argv);
+	  atexit(mpi_finalize);
+     }
+     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+     MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+#else
+     (void) argc;
+     (void) argv;
+#endif
+}
+
+int arrayh5_mpi_rank(void)
+{
+     return mpi_rank;
+}
+
+int arrayh5_mpi_size(void)
+{
+     return mpi_size;
+}
+
+void arrayh5_mpi_range(double *min, double *max)
+{
+#ifdef HAVE_MPI
+     if (mpi_size > 1) {
+	  double mm[2], *r, mn = HUGE_VAL, mx = -HUGE_VAL, nan_val = 0.0;
+	  int i;
+
+	  CHK_MALLOC(r, double, 2 * mpi_size);
+	  mm[0] = *min;
+	  mm[1] = *max;
+	  MPI_Allgather(mm, 2, MPI_DOUBLE, r, 2, MPI_DOUBLE, MPI_COMM_WORLD);
+	  for (i = 0; i < mpi_size; ++i)
+	       if (r[2*i] <= r[2*i+1]) {
+		    mn = r[2*i] < mn ? r[2*i] : mn;
+		    mx = r[2*i+1] > mx ? r[2*i+1] : mx;
+	       }
+	       else if (r[2*i] != r[2*i]) /* all NaN */
+		    nan_val = r[2*i];
+	  if (mn > mx) /* as in arrayh5_range */
+	       mn = mx = nan_val;
+	  *min = mn;
+	  *max = mx;
+	  free(r);
+     }
+#else
+     (void) min;
+     (void) max;
+#endif
+}
+
+/* The file access property list for reading a file (independently) or,
+   if shared, for writing a file shared by all of the processes. */
+static hid_t mpi_fapl(int shared)
+{
+#ifdef HAVE_MPI
+     if (mpi_size > 1) {
+	  hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+	  CHECK(fapl >= 0
+		&& H5Pset_fapl_mpio(fapl, shared ? MPI_COMM_WORLD
+				    : MPI_COMM_SELF, MPI_INFO_NULL) >= 0,
+		"error setting up MPI-IO file access");
+	  return fapl;
+     }
+#endif
+     (void) shared;
+     return H5P_DEFAULT;
+}
+
+/* The transfer property list for writing, collectively with MPI. */
+static hid_t mpi_dxpl(void)
+{
+#ifdef HAVE_MPI
+     if (mpi_size > 1) {
+	  hid_t dxpl = H5Pcreate(H5P_DATASET_XFER);
+	  CHECK(dxpl >= 0
+		&& H5Pset_dxpl_mpio(dxpl, H5FD_MPIO_COLLECTIVE) >= 0,
+		"error setting up MPI-IO transfers");
+	  return dxpl;
+     }
+#endif
+     return H5P_DEFAULT;
+}
+
+static void close_plist(hid_t plist)
+{
+     if (plist != H5P_DEFAULT)
+	  H5Pclose(plist);
+}
+
+/***********************************************************************/
+/* Instrumentation.  The counters are updated atomically, since the
+   tools call arrayh5 from several threads. */
+
+#define STATS_ENV "H5UTILS_STATS"
+
+int arrayh5_stats_enabled = 0;
+
+static const char *stage_names[ARRAYH5_NUM_STAGES] = {
+     "read", "range", "transpose", "convert", "encode", "write"
+};
+
+static struct {
+     const char *prog;
+     int json;
+     char *fname; /* file to append the summary to, or NULL for stderr */
+     double t_start;
+     double time[ARRAYH5_NUM_STAGES], bytes[ARRAYH5_NUM_STAGES];
+     double opens, reads, maps, writes, bytes_read, bytes_written;
+} stats;
+
+static void stats_add(double *x, double y)
+{
+#ifdef _OPENMP
+#    pragma omp atomic
+#endif
+     *x += y;
+}
+
+static double wall_time(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+     struct timeval tv;
+     gettimeofday(&tv, NULL);
+     return tv.tv_sec + 1e-6 * tv.tv_usec;
+#else
+     return (double) time(NULL);
+#endif
+}
+
+/* peak resident memory in bytes, or 0 if unknown */
+static double peak_memory(void)
+{
+#ifdef USE_GETRUSAGE
+     struct rusage ru;
+     if (getrusage(RUSAGE_SELF, &ru) == 0)
+#  ifdef __APPLE__
+	  return (double) ru.ru_maxrss; /* bytes */
+#  else
+	  return ru.ru_maxrss * 1024.0; /* kilobytes */
+#  endif
+#endif
+     return 0;
+}
+
+static void stats_print(void)
+{
+     FILE *f = stderr;
+     double wall = wall_time() - stats.t_start;
+     int i;
+
+     if (stats.fname && !(f = fopen(stats.fname, "a")))
+	  f = stderr;
+     if (stats.json) {
+	  fprintf(f, "{\"program\": \"%s\", ", stats.prog);
+	  if (mpi_size > 1)
+	       fprintf(f, "\"rank\": %d, \"processes\": %d, ",
+		       mpi_rank, mpi_size);
+	  fprintf(f, "\"wall_time\": %g, "
+		  "\"peak_memory\": %.0f, \"hdf5\": {\"opens\": %.0f, "
+		  "\"reads\": %.0f, \"maps\": %.0f, \"bytes_read\": %.0f, "
+		  "\"writes\": %.0f, \"bytes_written\": %.0f}, \"stages\": {",
+		  wall, peak_memory(), stats.opens, stats.reads,
+		  stats.maps, stats.bytes_read, stats.writes,
+		  stats.bytes_written);
+	  for (i = 0; i < ARRAYH5_NUM_STAGES; ++i)
+	       fprintf(f, "%s\"%s\": {\"time\": %g, \"bytes\": %.0f}",
+		       i ? ", " : "", stage_names[i],
+		       stats.time[i], stats.bytes[i]);
+	  fprintf(f, "}}\n");
+     }
+     else {
+	  fprintf(f, "%s", stats.prog);
+	  if (mpi_size > 1)
+	       fprintf(f, " (process %d of %d)", mpi_rank, mpi_size);
+	  fprintf(f, ": %g s wall time, %g MB peak memory\n",
+		  wall, peak_memory() / 1048576);
+	  fprintf(f, "  HDF5: %.0f opens, %.0f reads (%.0f mapped) of %g MB, "
+		  "%.0f writes of %g MB\n", stats.opens, stats.reads,
+		  stats.maps, stats.bytes_read / 1048576, stats.writes,
+		  stats.bytes_written / 1048576);
+	  for (i = 0; i < ARRAYH5_NUM_STAGES; ++i)
+	       if (stats.time[i] > 0)
+		    fprintf(f, "  %-9s %10.4f s %10.2f MB %10.1f MB/s\n",
+			    stage_names[i], stats.time[i],
+			    stats.bytes[i] / 1048576,
+			    stats.bytes[i] / (1048576 * stats.time[i]));
+	       else if (stats.bytes[i] > 0)
+		    fprintf(f, "  %-9s %12s %10.2f MB\n", stage_names[i],
+			    "", stats.bytes[i] / 1048576);
+	  fprintf(f, "  (the stage times are summed over threads)\n");
+     }
+     if (f != stderr)
+	  fclose(f);
+}
+
+/* Enable the instrumentation if verbose or if H5UTILS_STATS is set.
+   H5UTILS_STATS may be "json" for a machine-readable (one-line JSON)
+   summary, or anything else for text, optionally followed by
+   ":<file>" to append the summary to <file> instead of stderr. */
+void arrayh5_stats_init(const char *prog, int verbose)
+{
+     const char *env = getenv(STATS_ENV), *colon;
+
+     if (arrayh5_stats_enabled)
+	  return;
+     if (env && (!*env || !strcmp(env, "0")))
+	  env = NULL;
+     if (!env && !verbose)
+	  return;
+     stats.prog = prog;
+     if (env) {
+	  colon = strchr(env, ':');
+	  stats.json = !strncmp(env, "json", 4)
+	       && (env[4] == ':' || !env[4]);
+	  if (colon && colon[1]) {
+	       CHK_MALLOC(stats.fname, char, strlen(colon + 1) + 1);
+	       strcpy(stats.fname, colon + 1);
+	  }
+     }
+     stats.t_start = wall_time();
+     arrayh5_stats_enabled = 1;
+     atexit(stats_print);
+}
+
+/* the start time of a stage, for arrayh5_stats_stop */
+double arrayh5_stats_start(void)
+{
+     return arrayh5_stats_enabled ? wall_time() : 0;
+}
+
+void arrayh5_stats_add(arrayh5_stage stage, double seconds, double bytes)
+{
+     if (!arrayh5_stats_enabled)
+	  return;
+     stats_add(&stats.time[stage], seconds);
+     stats_add(&stats.bytes[stage], bytes);
+}
+
+void arrayh5_stats_stop(arrayh5_stage stage, double t0, double bytes)
+{
+     if (arrayh5_stats_enabled)
+	  arrayh5_stats_add(stage, wall_time() - t0, bytes);
+}
+
+/* count an HDF5 read (or write) of the given number of bytes, which
+   took the time since t0 */
+static void stats_read(double t0, double bytes)
+{
+     if (!arrayh5_stats_enabled)
+	  return;
+     stats_add(&stats.reads, 1);
+     stats_add(&stats.bytes_read, bytes);
+     arrayh5_stats_stop(ARRAYH5_STAGE_READ, t0, bytes);
+}
+
+static void stats_write(double t0, double bytes)
+{
+     if (!arrayh5_stats_enabled)
+	  return;
+     stats_add(&stats.writes, 1);
+     stats_add(&stats.bytes_written, bytes);
+     arrayh5_stats_stop(ARRAYH5_STAGE_WRITE, t0, bytes);
+}
+
+static void stats_count(double *counter)
+{
+     if (arrayh5_stats_enabled)
+	  stats_add(counter, 1);
+}
+
+/***********************************************************************/
+
 arrayh5 arrayh5_create_withdata(int rank, const int *dims, double *data)
 {
      arrayh5 a;
@@ -68,6 +392,9 @@ arrayh5 arrayh5_create_withdata(int rank, const int *dims, double *data)
      else {
 	  CHK_MALLOC(a.data, double, a.N);
      }
+     a.map = NULL;
+     a.map_size = 0;
+     a.have_range = 0;
      return a;
 }
 
@@ -83,10 +410,24 @@ arrayh5 arrayh5_clone(arrayh5 a)
      return b;
 }
 
+/* free (or unmap) the data of a */
+static void free_data(arrayh5 *a)
+{
+#ifdef USE_MMAP
+     if (a->map)
+	  munmap(a->map, a->map_size);
+     else
+#endif
+	  free(a->data);
+     a->data = NULL;
+     a->map = NULL;
+     a->map_size = 0;
+}
+
 void arrayh5_destroy(arrayh5 a)
 {
      free(a.dims);
-     free(a.data);
+     free_data(&a);
 }
 
 int arrayh5_conformant(arrayh5 a, arrayh5 b)
@@ -101,67 +442,349 @@ int arrayh5_conformant(arrayh5 a, arrayh5 b)
      return 1;
 }
 
-static void rtranspose(int curdim, int rank, const int *dims,
-		       int curindex, int curindex_t,
-		       const double *data, double *data_t)
+/* Transposing (reversing the order of the dimensions of) an array is
+   done as a sequence of 2d transposes between the first and last
+   dimensions, one for each index in the "middle" dimensions, with each
+   2d transpose blocked into TRANSPOSE_BLOCK x TRANSPOSE_BLOCK tiles so
+   that the strided accesses on either side stay in cache.  Routines
+   that transpose while reading or writing a file do so in slabs of
+   about TRANSPOSE_SLAB_BYTES, so that no second copy of the whole array
+   is needed. */
+
+#define TRANSPOSE_BLOCK 32
+#define TRANSPOSE_SLAB_BYTES (16 * 1024 * 1024)
+
+/* dst[j*dst_stride + i] = src[i*src_stride + j] for i < n0, j < n1 */
+static void transpose2d(const double *src, int src_stride,
+			double *dst, int dst_stride, int n0, int n1)
 {
-     int prod_before = 1, prod_after = 1;
-     int i;
-
-     if (rank == 0) {
-	  *data_t = *data;
-	  return;
+     int i0, j0, i, j;
+
+     for (i0 = 0; i0 < n0; i0 += TRANSPOSE_BLOCK) {
+	  int i1 = i0 + TRANSPOSE_BLOCK < n0 ? i0 + TRANSPOSE_BLOCK : n0;
+	  for (j0 = 0; j0 < n1; j0 += TRANSPOSE_BLOCK) {
+	       int j1 = j0 + TRANSPOSE_BLOCK < n1 ? j0 + TRANSPOSE_BLOCK : n1;
+	       for (i = i0; i < i1; ++i)
+		    for (j = j0; j < j1; ++j)
+			 dst[j * dst_stride + i] = src[i * src_stride + j];
+	  }
      }
+}
 
-     for (i = 0; i < curdim; ++i)
-	  prod_before *= dims[i];
-     for (i = curdim + 1; i < rank; ++i)
-	  prod_after *= dims[i];
-
-     if (curdim == rank - 1) {
-	  for (i = 0; i < dims[curdim]; ++i)
-	       data_t[curindex_t + i * prod_before] = data[curindex + i];
+/* Transpose part of a rank >= 2 array with dimensions dims: n0 indices
+   of the first dimension by n1 indices of the last.  src points to the
+   first source element, with the array's usual strides, and dst to
+   where it goes, with the strides of the transposed array; so, src may
+   be a buffer holding only the n0 rows being transposed, and dst may
+   be a buffer holding only the n1 rows of the transposed array. */
+static void transpose_slab(const double *src, double *dst,
+			   int rank, const int *dims, int n0, int n1)
+{
+     int i, nlast = dims[rank - 1], nmid = 1, nblocks, t;
+     int src_stride, dst_stride;
+     double t0 = arrayh5_stats_start();
+
+     for (i = 1; i < rank - 1; ++i)
+	  nmid *= dims[i];
+     src_stride = nmid * nlast;
+     dst_stride = nmid * dims[0];
+     nblocks = (n1 + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+
+#ifdef _OPENMP
+#    pragma omp parallel for schedule(static) if (nmid * nblocks > 1)
+#endif
+     for (t = 0; t < nmid * nblocks; ++t) {
+	  int m = t / nblocks, j0 = (t % nblocks) * TRANSPOSE_BLOCK;
+	  int k, mrem = m, moff = 0, prod_before = dst_stride;
+
+	  /* offset of middle index m in the transposed array: */
+	  for (k = rank - 2; k >= 1; --k) {
+	       prod_before /= dims[k];
+	       moff += (mrem % dims[k]) * prod_before;
+	       mrem /= dims[k];
+	  }
+	  transpose2d(src + m * nlast + j0, src_stride,
+		      dst + moff + j0 * dst_stride, dst_stride,
+		      n0, j0 + TRANSPOSE_BLOCK < n1 ? TRANSPOSE_BLOCK : n1 - j0);
      }
-     else {
-	  for (i = 0; i < dims[curdim]; ++i)
-	       rtranspose(curdim + 1, rank, dims,
-			  curindex + i * prod_after,
-			  curindex_t + i * prod_before,
-			  data, data_t);
+     arrayh5_stats_stop(ARRAYH5_STAGE_TRANSPOSE, t0,
+			sizeof(double) * n0 * n1 * (double) nmid);
+}
+
+static void reverse_dims(int rank, int *dims)
+{
+     int i;
+     for (i = 0; i < rank - 1 - i; ++i) {
+	  int dummy = dims[i];
+	  dims[i] = dims[rank - 1 - i];
+	  dims[rank - 1 - i] = dummy;
      }
 }
 
 void arrayh5_transpose(arrayh5 *a)
 {
      double *data_t;
-     int i;
 
+     if (a->rank < 2)
+	  return; /* nothing to do */
      CHK_MALLOC(data_t, double, a->N);
-     rtranspose(0, a->rank, a->dims, 0, 0, a->data, data_t);
-     free(a->data);
+     transpose_slab(a->data, data_t, a->rank, a->dims,
+		    a->dims[0], a->dims[a->rank - 1]);
+     free_data(a);
      a->data = data_t;
+     reverse_dims(a->rank, a->dims);
+}
+
+/* The range is computed with RANGE_LANES independent min/max
+   accumulators, in a form (x < min ? x : min, which also skips NaNs)
+   that compilers turn into SIMD min/max instructions, and in parallel
+   (over blocks of RANGE_BLOCK elements) for arrays of at least
+   RANGE_PARALLEL_MIN elements. */
+#define RANGE_LANES 8
+#define RANGE_BLOCK 65536
+#define RANGE_PARALLEL_MIN (4 * RANGE_BLOCK)
+
+static void range_block(const double *data, int n, double *min, double *max)
+{
+     double mn[RANGE_LANES], mx[RANGE_LANES], x;
+     int i, k;
+
+     for (k = 0; k < RANGE_LANES; ++k) {
+	  mn[k] = HUGE_VAL;
+	  mx[k] = -HUGE_VAL;
+     }
+     for (i = 0; i + RANGE_LANES <= n; i += RANGE_LANES)
+	  for (k = 0; k < RANGE_LANES; ++k) {
+	       x = data[i + k];
+	       mn[k] = x < mn[k] ? x : mn[k];
+	       mx[k] = x > mx[k] ? x : mx[k];
+	  }
+     for (; i < n; ++i) {
+	  x = data[i];
+	  mn[0] = x < mn[0] ? x : mn[0];
+	  mx[0] = x > mx[0] ? x : mx[0];
+     }
+     for (k = 0; k < RANGE_LANES; ++k) {
+	  *min = mn[k] < *min ? mn[k] : *min;
+	  *max = mx[k] > *max ? mx[k] : *max;
+     }
+}
+
+/* Set *min and *max to the range of the n values in data, ignoring
+   NaNs (both are NaN if there are no other values), using up to
+   nthreads threads. */
+void arrayh5_range(const double *data, int n, int nthreads,
+		   double *min, double *max)
+{
+     double mn = HUGE_VAL, mx = -HUGE_VAL, t0 = arrayh5_stats_start();
+
+#ifdef _OPENMP
+     if (nthreads > 1 && n >= RANGE_PARALLEL_MIN) {
+	  int b, nb = (n + RANGE_BLOCK - 1) / RANGE_BLOCK;
+#    pragma omp parallel num_threads(nthreads)
+	  {
+	       double tmn = HUGE_VAL, tmx = -HUGE_VAL;
+#    pragma omp for schedule(static)
+	       for (b = 0; b < nb; ++b)
+		    range_block(data + b * RANGE_BLOCK,
+				b < nb - 1 ? RANGE_BLOCK
+				: n - b * RANGE_BLOCK, &tmn, &tmx);
+#    pragma omp critical (arrayh5_range)
+	       {
+		    mn = tmn < mn ? tmn : mn;
+		    mx = tmx > mx ? tmx : mx;
+	       }
+	  }
+     }
+     else
+#endif
+	  range_block(data, n, &mn, &mx);
+     (void) nthreads;
+     arrayh5_stats_stop(ARRAYH5_STAGE_RANGE, t0, sizeof(double) * n);
+
+     if (mn > mx) /* all NaN (or n == 0) */
+	  mn = mx = n > 0 ? data[0] : 0.0;
+     *min = mn;
+     *max = mx;
+}
 
-     for (i = 0; i < a->rank - 1 - i; ++i) {
-	  int dummy = a->dims[i];
-	  a->dims[i] = a->dims[a->rank - 1 - i];
-	  a->dims[a->rank - 1 - i] = dummy;
+/* Get the range of a, as by arrayh5_range, unless it is already known
+   (have_range, e.g. from a range attribute written along with the
+   dataset). */
+void arrayh5_getrange_threads(arrayh5 a, int nthreads,
+			      double *min, double *max)
+{
+     CHECK(a.N > 0, "no elements in array");
+     if (a.have_range) {
+	  *min = a.range_min;
+	  *max = a.range_max;
      }
+     else
+	  arrayh5_range(a.data, a.N, nthreads, min, max);
 }
 
 void arrayh5_getrange(arrayh5 a, double *min, double *max)
+{
+     arrayh5_getrange_threads(a, 1, min, max);
+}
+
+/***********************************************************************/
+/* arrays that keep their data in a non-double element type */
+
+size_t arrayh5_type_size(arrayh5_type type)
+{
+     switch (type) {
+	 case ARRAYH5_FLOAT: return sizeof(float);
+	 case ARRAYH5_INT8: case ARRAYH5_UINT8: return 1;
+	 case ARRAYH5_INT16: case ARRAYH5_UINT16: return 2;
+	 case ARRAYH5_INT32: case ARRAYH5_UINT32: return 4;
+	 case ARRAYH5_INT64: case ARRAYH5_UINT64: return 8;
+	 default: return sizeof(double);
+     }
+}
+
+arrayh5_typed arrayh5_typed_create(int rank, const int *dims,
+				   arrayh5_type type)
+{
+     arrayh5_typed a;
+     int i;
+
+     CHECK(rank >= 0, "non-positive rank");
+     CHECK(type != ARRAYH5_NATIVE, "no element type given for array");
+     a.rank = rank;
+     a.type = type;
+
+     CHK_MALLOC(a.dims, int, rank);
+
+     a.N = 1;
+     for (i = 0; i < rank; ++i) {
+	  a.dims[i] = dims[i];
+	  a.N *= dims[i];
+     }
+
+     CHECK(a.data = malloc(arrayh5_type_size(type) * a.N), "out of memory");
+     return a;
+}
+
+void arrayh5_typed_destroy(arrayh5_typed a)
+{
+     free(a.dims);
+     free(a.data);
+}
+
+double arrayh5_typed_value(arrayh5_typed a, int i)
+{
+     switch (a.type) {
+	 case ARRAYH5_FLOAT: return ((const float *) a.data)[i];
+	 case ARRAYH5_INT8: return ((const signed char *) a.data)[i];
+	 case ARRAYH5_UINT8: return ((const unsigned char *) a.data)[i];
+	 case ARRAYH5_INT16: return ((const short *) a.data)[i];
+	 case ARRAYH5_UINT16: return ((const unsigned short *) a.data)[i];
+	 case ARRAYH5_INT32: return ((const int *) a.data)[i];
+	 case ARRAYH5_UINT32: return ((const unsigned int *) a.data)[i];
+	 case ARRAYH5_INT64: return ((const long long *) a.data)[i];
+	 case ARRAYH5_UINT64: return ((const unsigned long long *) a.data)[i];
+	 default: return ((const double *) a.data)[i];
+     }
+}
+
+/* min/max loop over the data, specialized for each element type so
+   that we don't do a type switch per element, ignoring NaNs as in
+   arrayh5_range */
+#define TYPED_RANGE(T) { \
+     const T *d = (const T *) a.data; \
+     double dmin = HUGE_VAL, dmax = -HUGE_VAL; \
+     for (i = 0; i < a.N; ++i) { \
+	  double x = d[i]; \
+	  dmin = x < dmin ? x : dmin; \
+	  dmax = x > dmax ? x : dmax; \
+     } \
+     if (dmin > dmax) /* all NaN */ \
+	  dmin = dmax = d[0]; \
+     *min = dmin; *max = dmax; \
+     break; \
+}
+
+void arrayh5_typed_getrange(arrayh5_typed a, double *min, double *max)
 {
      int i;
+     double t0 = arrayh5_stats_start();
 
      CHECK(a.N > 0, "no elements in array");
-     *min = *max = a.data[0];
-     for (i = 1; i < a.N; ++i) {
-	  if (a.data[i] < *min)
-	       *min = a.data[i];
-	  if (a.data[i] > *max)
-	       *max = a.data[i];
+     switch (a.type) {
+	 case ARRAYH5_FLOAT: TYPED_RANGE(float)
+	 case ARRAYH5_INT8: TYPED_RANGE(signed char)
+	 case ARRAYH5_UINT8: TYPED_RANGE(unsigned char)
+	 case ARRAYH5_INT16: TYPED_RANGE(short)
+	 case ARRAYH5_UINT16: TYPED_RANGE(unsigned short)
+	 case ARRAYH5_INT32: TYPED_RANGE(int)
+	 case ARRAYH5_UINT32: TYPED_RANGE(unsigned int)
+	 case ARRAYH5_INT64: TYPED_RANGE(long long)
+	 case ARRAYH5_UINT64: TYPED_RANGE(unsigned long long)
+	 default: TYPED_RANGE(double)
+     }
+     arrayh5_stats_stop(ARRAYH5_STAGE_RANGE, t0,
+			arrayh5_type_size(a.type) * (double) a.N);
+}
+
+/* x[j] = element i0 + j of a, for j < n */
+#define TYPED_COPY(T) { \
+     const T *d = (const T *) a->data + i0; \
+     for (j = 0; j < n; ++j) \
+	  x[j] = d[j]; \
+     break; \
+}
+
+static void typed_to_double(const arrayh5_typed *a, int i0, int n, double *x)
+{
+     int j;
+
+     switch (a->type) {
+	 case ARRAYH5_FLOAT: TYPED_COPY(float)
+	 case ARRAYH5_INT8: TYPED_COPY(signed char)
+	 case ARRAYH5_UINT8: TYPED_COPY(unsigned char)
+	 case ARRAYH5_INT16: TYPED_COPY(short)
+	 case ARRAYH5_UINT16: TYPED_COPY(unsigned short)
+	 case ARRAYH5_INT32: TYPED_COPY(int)
+	 case ARRAYH5_UINT32: TYPED_COPY(unsigned int)
+	 case ARRAYH5_INT64: TYPED_COPY(long long)
+	 case ARRAYH5_UINT64: TYPED_COPY(unsigned long long)
+	 default: TYPED_COPY(double)
+     }
+}
+
+/* Convert rows row0..row0+nrows-1 of the transpose of a (i.e. indices
+   of the last dimension of a) to doubles in data, in transposed order,
+   as for arrayh5_read_transposed_rows; so, an array can be kept in its
+   own type and widened to double only a slab at a time. */
+void arrayh5_typed_transposed_rows(arrayh5_typed a, int row0, int nrows,
+				   double *data)
+{
+     int i, m, nlast, *dims;
+     double *buf;
+
+     CHECK(row0 >= 0 && nrows >= 0
+	   && row0 + nrows <= (a.rank > 0 ? a.dims[a.rank - 1] : 1),
+	   "invalid rows of typed array");
+     if (a.rank < 2) {
+	  typed_to_double(&a, row0, nrows, data);
+	  return;
      }
+     nlast = a.dims[a.rank - 1];
+     m = a.N / nlast;
+     CHK_MALLOC(buf, double, m * nrows);
+     for (i = 0; i < m; ++i)
+	  typed_to_double(&a, i * nlast + row0, nrows, buf + i * nrows);
+     CHK_MALLOC(dims, int, a.rank);
+     memcpy(dims, a.dims, sizeof(int) * a.rank);
+     dims[a.rank - 1] = nrows;
+     transpose_slab(buf, data, a.rank, dims, dims[0], nrows);
+     free(dims);
+     free(buf);
 }
 
+/***********************************************************************/
+
 static herr_t find_dataset(hid_t group_id, const char *name, void *d)
 {
      char **dname = (char **) d;
@@ -176,6 +799,120 @@ static herr_t find_dataset(hid_t group_id, const char *name, void *d)
      return 0;
 }
 
+/***********************************************************************/
+/* Files opened for reading are shared by all of the open handles of
+   their datasets, and can be kept open between reads (and handles) by
+   arrayh5_hold_file, so that e.g. the many components of a field
+   stored in one file are read with a single open of the file. */
+
+typedef struct {
+     char *fname;
+     hid_t file_id;
+     int refs; /* the number of open handles in the file */
+     int held; /* whether the file is held open by arrayh5_hold_file */
+} open_file;
+
+static open_file *open_files = NULL;
+static int nopen_files = 0;
+
+/* the index of fname in open_files, or -1 if it isn't open */
+static int find_open_file(const char *fname)
+{
+     int i;
+     for (i = 0; i < nopen_files; ++i)
+	  if (!strcmp(open_files[i].fname, fname))
+	       return i;
+     return -1;
+}
+
+static void remove_open_file(int i)
+{
+     H5Fclose(open_files[i].file_id);
+     free(open_files[i].fname);
+     open_files[i] = open_files[--nopen_files];
+     if (!nopen_files) {
+	  free(open_files);
+	  open_files = NULL;
+     }
+}
+
+/* Open fname read-only, sharing its id if it is already open; hold is
+   whether to hold it open rather than to count a new handle.  Returns
+   the file id, or a negative number on failure. */
+static hid_t file_open(const char *fname, int hold)
+{
+     hid_t file_id;
+     int i;
+
+#ifdef _OPENMP
+#    pragma omp critical (arrayh5_files)
+#endif
+     {
+	  i = find_open_file(fname);
+	  if (i < 0) {
+	       hid_t fapl = mpi_fapl(0);
+	       file_id = H5Fopen(fname, H5F_ACC_RDONLY, fapl);
+	       close_plist(fapl);
+	  }
+	  if (i < 0 && file_id >= 0) {
+	       open_file *f;
+	       stats_count(&stats.opens);
+	       f = (open_file *) realloc(open_files, sizeof(open_file)
+					 * (nopen_files + 1));
+	       CHECK(f, "out of memory");
+	       open_files = f;
+	       i = nopen_files++;
+	       CHK_MALLOC(f[i].fname, char, strlen(fname) + 1);
+	       strcpy(f[i].fname, fname);
+	       f[i].file_id = file_id;
+	       f[i].refs = f[i].held = 0;
+	  }
+	  if (i >= 0) {
+	       file_id = open_files[i].file_id;
+	       if (hold)
+		    open_files[i].held = 1;
+	       else
+		    ++open_files[i].refs;
+	  }
+     }
+     return file_id;
+}
+
+/* Close a file_id returned by file_open (or any other file id). */
+static void file_close(hid_t file_id)
+{
+#ifdef _OPENMP
+#    pragma omp critical (arrayh5_files)
+#endif
+     {
+	  int i;
+	  for (i = 0; i < nopen_files && open_files[i].file_id != file_id;
+	       ++i)
+	       ;
+	  if (i == nopen_files)
+	       H5Fclose(file_id);
+	  else if (--open_files[i].refs == 0 && !open_files[i].held)
+	       remove_open_file(i);
+     }
+}
+
+/* Before fname is opened for writing, a read-only id of it must be
+   closed; this only closes held files, as a read-only handle of the
+   same file would prevent it from being written in any case. */
+static void file_forget(const char *fname)
+{
+#ifdef _OPENMP
+#    pragma omp critical (arrayh5_files)
+#endif
+     {
+	  int i = find_open_file(fname);
+	  if (i >= 0 && open_files[i].refs == 0)
+	       remove_open_file(i);
+     }
+}
+
+/***********************************************************************/
+
 typedef enum { NO_ERROR = 0, OPEN_FAILED, NO_DATA, READ_FAILED, SLICE_FAILED,
 	     INVALID_SLICE, INVALID_RANK, OPEN_DATA_FAILED } arrayh5_err;
 
@@ -190,170 +927,1394 @@ const char arrayh5_read_strerror[][100] = {
      "error opening data set in HDF file",
 };
 
-int arrayh5_read(arrayh5 *a, const char *fname, const char *datapath,
-		 char **dataname,
-		 int nslicedims_, const int *slicedim_, const int *islice_,
-		 const int *center_slice)
+/* Open the dataset datapath in the file fname (or the first dataset
+   in the file, if datapath is NULL or empty), returning the file and
+   dataset ids and a newly-allocated copy of the dataset name.  Returns
+   an arrayh5_err code; on failure, any ids that were opened are left in
+   *file_id and *data_id (or -1) for the caller to close. */
+static int open_data(const char *fname, const char *datapath,
+		     hid_t *file_id, hid_t *data_id, char **dname)
 {
-     hid_t file_id = -1, data_id = -1, space_id = -1;
-     char *dname = NULL;
-     int err = NO_ERROR;
-     hsize_t i, rank, *dims_copy, *maxdims, *slicedim = 0;
-     int *islice = 0;
-     int *dims = 0;
-     hsize_t nslicedims = (hsize_t) nslicedims_;
+     *data_id = -1;
+     *dname = NULL;
 
-     CHECK(a, "NULL array passed to arrayh5_read");
-     a->dims = NULL;
-     a->data = NULL;
-
-     file_id = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
-     if (file_id < 0) {
-	  err = OPEN_FAILED;
-	  goto done;
-     }
+     *file_id = file_open(fname, 0);
+     if (*file_id < 0)
+	  return OPEN_FAILED;
 
      if (datapath && datapath[0]) {
-	  CHK_MALLOC(dname, char, strlen(datapath) + 1);
-	  strcpy(dname, datapath);
+	  CHK_MALLOC(*dname, char, strlen(datapath) + 1);
+	  strcpy(*dname, datapath);
      }
      else {
-	  if (H5Giterate(file_id, "/", NULL, find_dataset, &dname) <= 0) {
-	       err = NO_DATA;
-	       goto done;
-	  }
+	  if (H5Giterate(*file_id, "/", NULL, find_dataset, dname) <= 0)
+	       return NO_DATA;
      }
 
-     data_id = H5Dopen(file_id, dname);
-     if (data_id < 0) {
-	  err = OPEN_DATA_FAILED;
-	  goto done;
-     }
-
-     space_id = H5Dget_space(data_id);
-     rank = H5Sget_simple_extent_ndims(space_id);
-     if (rank <= 0) {
-	  err = INVALID_RANK;
-	  goto done;
-     }
-
-     CHK_MALLOC(dims, int, rank);
-     CHK_MALLOC(dims_copy, hsize_t, rank);
-     CHK_MALLOC(maxdims, hsize_t, rank);
-
-     H5Sget_simple_extent_dims(space_id, dims_copy, maxdims);
-     for (i = 0; i < rank; ++i)
-	  dims[i] = dims_copy[i];
-
-     free(maxdims);
-     free(dims_copy);
+     *data_id = H5Dopen(*file_id, *dname);
+     if (*data_id < 0)
+	  return OPEN_DATA_FAILED;
 
-     for (i = 0; i < nslicedims && slicedim_[i] == NO_SLICE_DIM; ++i)
-	  ;
+     return NO_ERROR;
+}
 
-     if (i == nslicedims) { /* no slices */
-	  *a = arrayh5_create(rank, dims);
+int arrayh5_hold_file(const char *fname)
+{
+     return file_open(fname, 1) < 0 ? OPEN_FAILED : NO_ERROR;
+}
 
-	  if (H5Dread(data_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
-		      H5P_DEFAULT, (void *) a->data) < 0) {
-	       err = READ_FAILED;
-	       goto done;
+void arrayh5_release_file(const char *fname)
+{
+#ifdef _OPENMP
+#    pragma omp critical (arrayh5_files)
+#endif
+     {
+	  int i = find_open_file(fname);
+	  if (i >= 0) {
+	       open_files[i].held = 0;
+	       if (open_files[i].refs == 0)
+		    remove_open_file(i);
 	  }
      }
-     else if (nslicedims > 0) {
-	  int j, rank2 = rank;
-	  hsize_t *start;
-	  hsize_t *count;
-	  hid_t mem_space_id;
-	  herr_t readerr;
-
-	  CHK_MALLOC(slicedim, hsize_t, nslicedims);
-	  CHK_MALLOC(islice, int, nslicedims);
-
-	  for (i = j = 0; i < nslicedims; ++i)
-	       if (slicedim_[i] != NO_SLICE_DIM) {
-		    if (slicedim_[i] == LAST_SLICE_DIM)
-			 slicedim[j] = rank - 1;
-		    else
-			 slicedim[j] = (hsize_t) slicedim_[i];
-		    if (slicedim[j] >= rank) {
-			 err = INVALID_SLICE;
-			 goto done;
-		    }
-		    islice[j] = islice_[i];
-		    if (center_slice[i])
-			 islice[j] += dims[slicedim[j]] / 2;
-		    if (islice[j] < 0 || islice[j] >= dims[slicedim[j]]) {
-			 err = INVALID_SLICE;
-			 goto done;
-		    }
-		    j++;
-	       }
-	  nslicedims = j;
-
-	  CHK_MALLOC(start, hsize_t, rank);
-	  CHK_MALLOC(count, hsize_t, rank);
+}
 
-	  for (i = 0; i < rank; ++i) {
-	       count[i] = dims[i];
-	       start[i] = 0;
-	  }
-	  for (i = 0; i < nslicedims; ++i) {
-	       start[slicedim[i]] = islice[i];
-	       count[slicedim[i]] = 1;
+/* Whether the dataset path s matches the glob pattern pat: "*"
+   matches any characters other than "/", "?" any one character other
+   than "/", and "[...]" (or "[!...]") any one character in (or not in)
+   the set, which may include ranges like "a-z". */
+static int glob_match(const char *pat, const char *s)
+{
+     for (; *pat; ++pat, ++s)
+	  switch (*pat) {
+	      case '*':
+		   for (;; ++s) {
+			if (glob_match(pat + 1, s))
+			     return 1;
+			if (!*s || *s == '/')
+			     return 0;
+		   }
+	      case '?':
+		   if (!*s || *s == '/')
+			return 0;
+		   break;
+	      case '[': {
+		   const char *p = pat + 1;
+		   int negate = *p == '!', found = 0;
+
+		   p += negate;
+		   if (*p == ']') { /* a leading ] is part of the set */
+			found = *s == ']';
+			++p;
+		   }
+		   while (*p && *p != ']') {
+			if (p[1] == '-' && p[2] && p[2] != ']') {
+			     found = found || (*s >= p[0] && *s <= p[2]);
+			     p += 3;
+			}
+			else
+			     found = found || *s == *p++;
+		   }
+		   if (!*p) { /* no closing ]: match [ literally */
+			if (*s != '[')
+			     return 0;
+			break;
+		   }
+		   if (!*s || *s == '/' || found == negate)
+			return 0;
+		   pat = p;
+		   break;
+	      }
+	      default:
+		   if (*pat != *s)
+			return 0;
 	  }
+     return !*s;
+}
 
-	  H5Sselect_hyperslab(space_id, H5S_SELECT_SET,
-			      start, NULL, count, NULL);
+typedef struct {
+     const char *pattern;
+     const char *path; /* path of the group being searched, plus "/" */
+     int depth; /* how many more levels of subgroups to search */
+     char **names;
+     int n;
+} dataset_search;
 
-	  for (i = j = 0; i < rank; ++i)
-	       if (count[i] > 1)
-		    dims[j++] = count[i];
-	  rank2 = j;
+static herr_t search_datasets(hid_t group_id, const char *name, void *d)
+{
+     dataset_search *ds = (dataset_search *) d;
+     size_t len = strlen(ds->path);
+     H5G_stat_t info;
+     char *path;
 
-	  *a = arrayh5_create(rank2, dims);
+     CHK_MALLOC(path, char, len + strlen(name) + 2);
+     strcpy(path, ds->path);
+     strcpy(path + len, name);
+     if (H5Gget_objinfo(group_id, name, 1, &info) < 0)
+	  ;
+     else if (info.type == H5G_DATASET && glob_match(ds->pattern, path)) {
+	  char **names = (char **) realloc(ds->names,
+					   sizeof(char *) * (ds->n + 1));
+	  CHECK(names, "out of memory");
+	  ds->names = names;
+	  names[ds->n++] = path;
+	  return 0;
+     }
+     else if (info.type == H5G_GROUP && ds->depth > 0) {
+	  dataset_search sub = *ds;
+	  strcat(path, "/");
+	  sub.path = path;
+	  sub.depth--;
+	  H5Giterate(group_id, name, NULL, search_datasets, &sub);
+	  ds->names = sub.names;
+	  ds->n = sub.n;
+     }
+     free(path);
+     return 0;
+}
 
-	  mem_space_id = H5Screate_simple(rank, count, NULL);
-	  H5Sselect_all(mem_space_id);
+int arrayh5_find_datasets(const char *fname, const char *pattern,
+			  char ***names, int *n)
+{
+     dataset_search ds;
+     hid_t file_id;
+     const char *p;
+
+     CHECK(names && n, "NULL pointer passed to arrayh5_find_datasets");
+     *names = NULL;
+     *n = 0;
+     file_id = file_open(fname, 0);
+     if (file_id < 0)
+	  return OPEN_FAILED;
+
+     while (*pattern == '/')
+	  ++pattern;
+     ds.pattern = pattern;
+     ds.path = "";
+     ds.depth = 0;
+     for (p = pattern; *p; ++p)
+	  ds.depth += *p == '/';
+     ds.names = NULL;
+     ds.n = 0;
+     H5Giterate(file_id, "/", NULL, search_datasets, &ds);
+     file_close(file_id);
+
+     *names = ds.names;
+     *n = ds.n;
+     return ds.n > 0 ? NO_ERROR : NO_DATA;
+}
 
-	  readerr = H5Dread(data_id, H5T_NATIVE_DOUBLE,
-			    mem_space_id, space_id,
-			    H5P_DEFAULT, (void *) a->data);
+/***********************************************************************/
+/* Open dataset handles, so that many slices (e.g. successive frames of
+   a movie) can be read without re-opening the file and dataset (and
+   searching for the dataset) every time. */
+
+struct arrayh5_handle_s {
+     hid_t file_id, data_id, space_id;
+     char *dname;
+     int rank, *dims;
+
+     /* for datasets being written: the number of rows written so far
+	(-1 if not being written, or if their range isn't recorded),
+	and their range */
+     int rows_written, single_precision;
+     double range_min, range_max;
+};
 
-	  H5Sclose(mem_space_id);
-	  free(count);
-	  free(start);
+/* The range of a dataset written by arrayh5_write_rows etc. is stored
+   in this attribute, so that readers of the whole dataset don't have
+   to compute it again.  Nothing stops another program from changing
+   the data without updating the attribute, however, so the attribute
+   also records the number of elements and the first and last of them,
+   and it is only written or believed at all if TRUST_RANGE_ENV is set
+   (so that otherwise writers don't pay for computing it). */
+#define RANGE_ATTR "h5utils_range"
+#define RANGE_ATTR_LEN 5 /* min, max, #elements, first, last */
+#define TRUST_RANGE_ENV "H5UTILS_TRUST_RANGE"
+
+static int trust_range_attr(void)
+{
+     const char *env = getenv(TRUST_RANGE_ENV);
+     return env && *env && strcmp(env, "0");
+}
 
-	  if (readerr < 0) {
-	       err = SLICE_FAILED;
-	       goto done;
+static double handle_npoints(const arrayh5_handle *h)
+{
+     double N = 1;
+     int i;
+     for (i = 0; i < h->rank; ++i)
+	  N *= h->dims[i];
+     return N;
+}
+
+/* read the first and last elements of the dataset of h into v,
+   returning whether this succeeded */
+static int read_end_values(const arrayh5_handle *h, double v[2])
+{
+     hsize_t *coord, two = 2;
+     hid_t space_id, mem_space_id;
+     int i, ok;
+     double t0;
+
+     if (h->rank <= 0 || handle_npoints(h) <= 0)
+	  return 0;
+     CHK_MALLOC(coord, hsize_t, 2 * h->rank);
+     for (i = 0; i < h->rank; ++i) {
+	  coord[i] = 0;
+	  coord[h->rank + i] = h->dims[i] - 1;
+     }
+     space_id = H5Dget_space(h->data_id);
+     mem_space_id = H5Screate_simple(1, &two, NULL);
+     t0 = arrayh5_stats_start();
+     ok = H5Sselect_elements(space_id, H5S_SELECT_SET, 2, coord) >= 0
+	  && H5Dread(h->data_id, H5T_NATIVE_DOUBLE, mem_space_id, space_id,
+		     H5P_DEFAULT, v) >= 0;
+     stats_read(t0, sizeof(double) * 2.0);
+     H5Sclose(mem_space_id);
+     H5Sclose(space_id);
+     free(coord);
+     return ok;
+}
+
+/* read the RANGE_ATTR of h into min and max, returning whether it was
+   found, trusted, and matches the data */
+static int read_range_attr(arrayh5_handle *h, double *min, double *max)
+{
+     hid_t attr_id, space_id;
+     double range[RANGE_ATTR_LEN], ends[2];
+     int ok = 0;
+
+     if (!trust_range_attr() || h->rank <= 0)
+	  return 0;
+     SUPPRESS_HDF5_ERRORS(attr_id = H5Aopen_name(h->data_id, RANGE_ATTR));
+     if (attr_id < 0)
+	  return 0;
+     space_id = H5Aget_space(attr_id);
+     if (H5Sget_simple_extent_npoints(space_id) == RANGE_ATTR_LEN
+	 && H5Aread(attr_id, H5T_NATIVE_DOUBLE, range) >= 0
+	 && range[2] == handle_npoints(h)
+	 && range[0] <= range[1]
+	 && read_end_values(h, ends)
+	 && !memcmp(ends, range + 3, sizeof(ends))) {
+	  *min = range[0];
+	  *max = range[1];
+	  ok = 1;
+     }
+     H5Sclose(space_id);
+     H5Aclose(attr_id);
+     return ok;
+}
+
+static void write_range_attr(arrayh5_handle *h)
+{
+     hid_t attr_id, space_id;
+     hsize_t len = RANGE_ATTR_LEN;
+     double range[RANGE_ATTR_LEN];
+     int ok;
+
+     range[0] = h->range_min;
+     range[1] = h->range_max;
+     if (h->single_precision) { /* the range of the stored values */
+	  if (fabs(range[0]) > FLT_MAX || fabs(range[1]) > FLT_MAX)
+	       return; /* depends on how HDF5 handles overflow */
+	  range[0] = (float) range[0];
+	  range[1] = (float) range[1];
+     }
+     range[2] = handle_npoints(h);
+#ifdef HAVE_MPI
+     /* the ends may have been written by other processes, and the
+	attribute must be the same on all of them */
+     if (mpi_size > 1) {
+	  H5Fflush(h->data_id, H5F_SCOPE_LOCAL);
+	  MPI_Barrier(MPI_COMM_WORLD);
+     }
+#endif
+     ok = read_end_values(h, range + 3);
+#ifdef HAVE_MPI
+     if (mpi_size > 1) {
+	  double buf[3];
+	  buf[0] = ok;
+	  buf[1] = range[3];
+	  buf[2] = range[4];
+	  MPI_Bcast(buf, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	  ok = buf[0] != 0;
+	  range[3] = buf[1];
+	  range[4] = buf[2];
+     }
+#endif
+     if (!ok)
+	  return;
+     space_id = H5Screate_simple(1, &len, NULL);
+     attr_id = H5Acreate(h->data_id, RANGE_ATTR, H5T_NATIVE_DOUBLE,
+			 space_id, H5P_DEFAULT);
+     if (attr_id >= 0) {
+	  H5Awrite(attr_id, H5T_NATIVE_DOUBLE, range);
+	  H5Aclose(attr_id);
+     }
+     H5Sclose(space_id);
+}
+
+int arrayh5_open(arrayh5_handle **h_, const char *fname, const char *datapath)
+{
+     arrayh5_handle *h;
+     int err, i;
+
+     CHECK(h_, "NULL handle passed to arrayh5_open");
+     CHK_MALLOC(h, arrayh5_handle, 1);
+     h->space_id = -1;
+     h->rank = 0;
+     h->dims = NULL;
+     h->rows_written = -1;
+
+     err = open_data(fname, datapath, &h->file_id, &h->data_id, &h->dname);
+     if (err != NO_ERROR) {
+	  arrayh5_close(h);
+	  *h_ = NULL;
+	  return err;
+     }
+
+     h->space_id = H5Dget_space(h->data_id);
+     h->rank = H5Sget_simple_extent_ndims(h->space_id);
+     if (h->rank > 0) {
+	  hsize_t *dims;
+	  CHK_MALLOC(dims, hsize_t, h->rank);
+	  CHK_MALLOC(h->dims, int, h->rank);
+	  H5Sget_simple_extent_dims(h->space_id, dims, NULL);
+	  for (i = 0; i < h->rank; ++i)
+	       h->dims[i] = dims[i];
+	  free(dims);
+     }
+
+     *h_ = h;
+     return NO_ERROR;
+}
+
+void arrayh5_close(arrayh5_handle *h)
+{
+     if (!h)
+	  return;
+#ifdef HAVE_MPI
+     /* each process wrote some of the rows */
+     if (h->rows_written >= 0 && mpi_size > 1) {
+	  int rows = h->rows_written;
+	  double mn = h->range_min, mx = h->range_max;
+	  MPI_Allreduce(&rows, &h->rows_written, 1, MPI_INT, MPI_SUM,
+			MPI_COMM_WORLD);
+	  MPI_Allreduce(&mn, &h->range_min, 1, MPI_DOUBLE, MPI_MIN,
+			MPI_COMM_WORLD);
+	  MPI_Allreduce(&mx, &h->range_max, 1, MPI_DOUBLE, MPI_MAX,
+			MPI_COMM_WORLD);
+     }
+#endif
+     /* if all of a written dataset was written, record its range */
+     if (h->rows_written >= 0 && h->rank > 0
+	 && h->rows_written >= h->dims[0] && h->range_min <= h->range_max)
+	  write_range_attr(h);
+     if (h->space_id >= 0)
+	  H5Sclose(h->space_id);
+     if (h->data_id >= 0)
+	  H5Dclose(h->data_id);
+     if (h->file_id >= 0)
+	  file_close(h->file_id);
+     free(h->dname);
+     free(h->dims);
+     free(h);
+}
+
+int arrayh5_handle_rank(const arrayh5_handle *h)
+{
+     return h->rank;
+}
+
+const int *arrayh5_handle_dims(const arrayh5_handle *h)
+{
+     return h->dims;
+}
+
+const char *arrayh5_handle_name(const arrayh5_handle *h)
+{
+     return h->dname;
+}
+
+/* Given the slice specification of arrayh5_read, compute the start and
+   count of the hyperslab to read (or, if there are no slices, the
+   whole dataset), and the rank and dimensions of the resulting
+   array; start, count, and dims must have room for h->rank entries. */
+static int get_slices(const arrayh5_handle *h,
+		      int nslicedims, const int *slicedim_,
+		      const int *islice_, const int *center_slice,
+		      hsize_t *start, hsize_t *count,
+		      int *rank2, int *dims, int *sliced)
+{
+     int i, j, rank = h->rank;
+
+     if (rank <= 0)
+	  return INVALID_RANK;
+
+     for (i = 0; i < rank; ++i) {
+	  count[i] = h->dims[i];
+	  start[i] = 0;
+     }
+
+     for (i = 0; i < nslicedims && slicedim_[i] == NO_SLICE_DIM; ++i)
+	  ;
+
+     if (i == nslicedims) { /* no slices */
+	  *sliced = 0;
+	  *rank2 = rank;
+	  for (i = 0; i < rank; ++i)
+	       dims[i] = h->dims[i];
+	  return NO_ERROR;
+     }
+     else if (nslicedims <= 0)
+	  return INVALID_SLICE;
+
+     for (i = 0; i < nslicedims; ++i)
+	  if (slicedim_[i] != NO_SLICE_DIM) {
+	       int sd, is;
+	       if (slicedim_[i] == LAST_SLICE_DIM)
+		    sd = rank - 1;
+	       else
+		    sd = slicedim_[i];
+	       if (sd < 0 || sd >= rank)
+		    return INVALID_SLICE;
+	       is = islice_[i];
+	       if (center_slice[i])
+		    is += h->dims[sd] / 2;
+	       if (is < 0 || is >= h->dims[sd])
+		    return INVALID_SLICE;
+	       start[sd] = is;
+	       count[sd] = 1;
 	  }
+
+     for (i = j = 0; i < rank; ++i)
+	  if (count[i] > 1)
+	       dims[j++] = count[i];
+     *rank2 = j;
+     *sliced = 1;
+     return NO_ERROR;
+}
+
+int arrayh5_slice_dims(const arrayh5_handle *h,
+		       int nslicedims, const int *slicedim,
+		       const int *islice, const int *center_slice,
+		       int *rank, int *dims)
+{
+     hsize_t *start, *count;
+     int err, sliced;
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, rank, dims, &sliced);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* If the range of the given slice of h is known from the file (i.e.
+   the slice is the whole dataset, and it has a range attribute), set
+   *min and *max to it and return 1; otherwise, return 0. */
+int arrayh5_slice_range(arrayh5_handle *h,
+			int nslicedims, const int *slicedim,
+			const int *islice, const int *center_slice,
+			double *min, double *max)
+{
+     hsize_t *start, *count;
+     int *dims, rank2, sliced, known;
+
+     if (h->rank <= 0)
+	  return 0;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+     known = get_slices(h, nslicedims, slicedim, islice, center_slice,
+			start, count, &rank2, dims, &sliced) == NO_ERROR
+	  && !sliced && read_range_attr(h, min, max);
+     free(dims);
+     free(count);
+     free(start);
+     return known;
+}
+
+/* number of rows of n doubles each to process at a time in a slab,
+   out of a total of nrows; the number of elements of the slab (the
+   result times n) always fits in an int, even for very long rows */
+static int slab_rows(int nrows, int n)
+{
+     size_t rowsize = n > 0 ? (size_t) n : 1;
+     size_t m = TRANSPOSE_SLAB_BYTES / (sizeof(double) * rowsize);
+     if (m < TRANSPOSE_BLOCK)
+	  m = TRANSPOSE_BLOCK;
+     if (m > INT_MAX / rowsize)
+	  m = INT_MAX / rowsize;
+     return nrows > 0 && m < (size_t) nrows ? (int) m : nrows;
+}
+
+/* the dimension of h corresponding to the first dimension of the
+   hyperslab start/count computed by get_slices (h->rank if none) */
+static int first_slice_dim(const arrayh5_handle *h, const hsize_t *count,
+			   int sliced)
+{
+     int k0;
+     for (k0 = 0; sliced && k0 < h->rank && count[k0] <= 1; ++k0)
+	  ;
+     return k0;
+}
+
+/* read nrows rows, starting at row0, of the first dimension k0 of the
+   hyperslab start/count of h into buf */
+static int read_rows(arrayh5_handle *h, hsize_t *start,
+		     const hsize_t *stride, hsize_t *count,
+		     int k0, int row0, int nrows, double *buf)
+{
+     hsize_t start0 = 0, count0 = 0, nmem = 1;
+     hid_t mem_space_id;
+     int i, err = NO_ERROR;
+     double t0 = arrayh5_stats_start();
+
+     if (k0 < h->rank) {
+	  start0 = start[k0];
+	  count0 = count[k0];
+	  start[k0] = start0 + row0 * (stride ? stride[k0] : 1);
+	  count[k0] = nrows;
      }
-     else {
-	  err = INVALID_SLICE;
+     for (i = 0; i < h->rank; ++i)
+	  nmem *= count[i];
+
+     H5Sselect_hyperslab(h->space_id, H5S_SELECT_SET,
+			 start, stride, count, NULL);
+     mem_space_id = H5Screate_simple(1, &nmem, NULL);
+     if (H5Dread(h->data_id, H5T_NATIVE_DOUBLE,
+		 mem_space_id, h->space_id, H5P_DEFAULT, (void *) buf) < 0)
+	  err = SLICE_FAILED;
+     H5Sclose(mem_space_id);
+     stats_read(t0, sizeof(double) * (double) nmem);
+
+     if (k0 < h->rank) {
+	  start[k0] = start0;
+	  count[k0] = count0;
+     }
+     return err;
+}
+
+/* grow *p, which has room for *n doubles, to hold at least n doubles
+   (discarding its contents) */
+static void grow_buffer(double **p, int *n_, int n)
+{
+     if (n > *n_) {
+	  free(*p);
+	  CHK_MALLOC(*p, double, n);
+	  *n_ = n;
+     }
+}
+
+#ifdef USE_MMAP
+/* read element i (in row-major order) of h into *x */
+static int read_element(arrayh5_handle *h, hsize_t i, double *x)
+{
+     hsize_t *start, *count;
+     int k, err;
+
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     for (k = h->rank - 1; k >= 0; --k) {
+	  start[k] = i % h->dims[k];
+	  i /= h->dims[k];
+	  count[k] = 1;
+     }
+     err = read_rows(h, start, NULL, count, h->rank, 0, 1, x);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* If the N > 0 elements of the hyperslab start/count of h are stored
+   contiguously in the file as native doubles (i.e. the dataset is
+   contiguous and not external, and all the dimensions after the first
+   one with a count > 1 are complete), map them copy-on-write into
+   memory, returning a pointer to the data and setting *map and
+   *map_size to the region to munmap.  Otherwise, return NULL, so that
+   the data are read normally.  This way, large datasets are read on
+   demand, straight out of the page cache, rather than copied into
+   private memory before anything can be done with them.
+
+   A mapping can't protect us from the file being truncated while it
+   is mapped (accessing the lost pages raises SIGBUS, rather than
+   giving a read error), so only files that HDF5 opened read-only are
+   mapped, through HDF5's own descriptor (not a new open of the file's
+   name, which may since have been replaced), and only if the file is
+   big enough to hold the whole slice. */
+static double *map_slice(arrayh5_handle *h, const hsize_t *start,
+			 const hsize_t *count, int N,
+			 void **map, size_t *map_size)
+{
+     hid_t plist, type;
+     haddr_t addr;
+     hsize_t userblock = 0, i0 = 0, off, size, page;
+     unsigned intent;
+     int i, j, ok, *fdp = NULL;
+     struct stat st;
+     double *data, x;
+
+     if (N <= 0)
+	  return NULL;
+     for (j = 0; j < h->rank && count[j] == 1; ++j)
+	  ;
+     for (i = j + 1; i < h->rank; ++i)
+	  if (count[i] != (hsize_t) h->dims[i])
+	       return NULL;
+     for (i = 0; i < h->rank; ++i)
+	  i0 = i0 * h->dims[i] + start[i];
+
+     plist = H5Dget_create_plist(h->data_id);
+     ok = H5Pget_layout(plist) == H5D_CONTIGUOUS
+	  && H5Pget_external_count(plist) == 0;
+     H5Pclose(plist);
+     type = H5Dget_type(h->data_id);
+     ok = ok && H5Tequal(type, H5T_NATIVE_DOUBLE) > 0;
+     H5Tclose(type);
+     plist = H5Fget_access_plist(h->file_id);
+     ok = ok && H5Pget_driver(plist) == H5FD_SEC2;
+     H5Pclose(plist);
+     ok = ok && H5Fget_intent(h->file_id, &intent) >= 0
+	  && intent == H5F_ACC_RDONLY
+	  && H5Fget_vfd_handle(h->file_id, H5P_DEFAULT,
+			       (void **) &fdp) >= 0 && fdp && *fdp >= 0;
+     if (!ok)
+	  return NULL;
+     SUPPRESS_HDF5_ERRORS(addr = H5Dget_offset(h->data_id));
+     if (addr == HADDR_UNDEF) /* e.g. not yet written */
+	  return NULL;
+
+     /* HDF5 addresses are relative to the end of any user block */
+     plist = H5Fget_create_plist(h->file_id);
+     H5Pget_userblock(plist, &userblock);
+     H5Pclose(plist);
+     off = userblock + addr + i0 * sizeof(double);
+     size = (hsize_t) N * sizeof(double);
+     page = sysconf(_SC_PAGESIZE);
+     if (off % sizeof(double) /* misaligned */
+	 || (hsize_t) (off_t) (off - off % page) != off - off % page
+	 || (hsize_t) (size_t) (size + off % page) != size + off % page)
+	  return NULL;
+
+     *map_size = size + off % page;
+     if (fstat(*fdp, &st) || !S_ISREG(st.st_mode)
+	 || (hsize_t) st.st_size < off + size)
+	  *map = MAP_FAILED; /* e.g. truncated file */
+     else
+	  *map = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		      *fdp, (off_t) (off - off % page));
+     if (*map == MAP_FAILED) {
+	  *map = NULL;
+	  return NULL;
+     }
+     data = (double *) ((char *) *map + off % page);
+
+     /* paranoia: check that the first and last elements are where we
+	think they are, in case of some file layout we don't know */
+     if (read_element(h, i0, &x) != NO_ERROR
+	 || memcmp(&x, data, sizeof(double))
+	 || read_element(h, i0 + N - 1, &x) != NO_ERROR
+	 || memcmp(&x, data + N - 1, sizeof(double))) {
+	  munmap(*map, *map_size);
+	  *map = NULL;
+	  return NULL;
+     }
+     return data;
+}
+#endif /* USE_MMAP */
+
+/* Read a slice of h into *a, which is newly allocated unless b is
+   non-NULL, in which case a must be &b->a and b's storage is reused. */
+static int read_handle(arrayh5 *a, arrayh5_handle *h,
+		       int nslicedims, const int *slicedim,
+		       const int *islice, const int *center_slice,
+		       int transpose, arrayh5_buffer *b)
+{
+     hsize_t *start = 0, *count = 0;
+     int *dims = 0;
+     int err, rank2, sliced, i, N = 1;
+     double *mapped = NULL, t0;
+     void *map = NULL;
+     size_t map_size = 0;
+
+     CHECK(a, "NULL array passed to arrayh5_read");
+     if (!b) {
+	  a->dims = NULL;
+	  a->data = NULL;
+	  a->map = NULL;
+     }
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, &rank2, dims, &sliced);
+     if (err != NO_ERROR)
 	  goto done;
+
+     for (i = 0; i < rank2; ++i)
+	  N *= dims[i];
+#ifdef USE_MMAP
+     if (!transpose || rank2 < 2) {
+	  t0 = arrayh5_stats_start();
+	  mapped = map_slice(h, start, count, N, &map, &map_size);
+	  if (mapped) {
+	       stats_count(&stats.maps);
+	       stats_read(t0, sizeof(double) * (double) N);
+	  }
+     }
+#endif
+
+     if (b) {
+	  if (rank2 > b->max_rank) {
+	       free(b->a.dims);
+	       CHK_MALLOC(b->a.dims, int, rank2);
+	       b->max_rank = rank2;
+	  }
+	  if (b->a.map || mapped) { /* the old data aren't reusable */
+	       free_data(&b->a);
+	       b->max_N = 0;
+	  }
+	  if (mapped) {
+	       b->a.data = mapped;
+	       b->a.map = map;
+	       b->a.map_size = map_size;
+	  }
+	  else
+	       grow_buffer(&b->a.data, &b->max_N, N);
+	  b->a.rank = rank2;
+	  b->a.N = N;
+	  memcpy(b->a.dims, dims, sizeof(int) * rank2);
+     }
+     else {
+	  *a = arrayh5_create_withdata(rank2, dims, mapped);
+	  a->map = map;
+	  a->map_size = map_size;
+     }
+
+     a->have_range = !sliced && a->N > 0
+	  && read_range_attr(h, &a->range_min, &a->range_max);
+
+     if (mapped)
+	  ; /* nothing to read */
+     else if (transpose && rank2 >= 2 && a->N > 0) {
+	  /* read slabs of the first (non-sliced) dimension, transposing
+	     each one into place */
+	  int k0, r0, nr, n = a->N / dims[0];
+	  double *buf;
+
+	  k0 = first_slice_dim(h, count, sliced);
+	  nr = slab_rows(dims[0], n);
+	  if (b) {
+	       grow_buffer(&b->work, &b->max_work, nr * n);
+	       buf = b->work;
+	  }
+	  else
+	       CHK_MALLOC(buf, double, nr * n);
+	  for (r0 = 0; r0 < dims[0] && err == NO_ERROR; r0 += nr) {
+	       if (nr > dims[0] - r0)
+		    nr = dims[0] - r0;
+	       err = read_rows(h, start, NULL, count, k0, r0, nr, buf);
+	       if (err == NO_ERROR)
+		    transpose_slab(buf, a->data + r0, rank2, dims,
+				   nr, dims[rank2 - 1]);
+	       else if (!sliced)
+		    err = READ_FAILED;
+	  }
+	  if (!b)
+	       free(buf);
+	  reverse_dims(a->rank, a->dims);
+     }
+     else if (!sliced) {
+	  t0 = arrayh5_stats_start();
+	  if (H5Dread(h->data_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+		      H5P_DEFAULT, (void *) a->data) < 0)
+	       err = READ_FAILED;
+	  stats_read(t0, sizeof(double) * (double) a->N);
+     }
+     else {
+	  hid_t mem_space_id;
+
+	  H5Sselect_hyperslab(h->space_id, H5S_SELECT_SET,
+			      start, NULL, count, NULL);
+
+	  mem_space_id = H5Screate_simple(h->rank, count, NULL);
+	  H5Sselect_all(mem_space_id);
+
+	  t0 = arrayh5_stats_start();
+	  if (H5Dread(h->data_id, H5T_NATIVE_DOUBLE,
+		      mem_space_id, h->space_id,
+		      H5P_DEFAULT, (void *) a->data) < 0)
+	       err = SLICE_FAILED;
+	  stats_read(t0, sizeof(double) * (double) a->N);
+
+	  H5Sclose(mem_space_id);
+     }
+
+     if (err != NO_ERROR && !b) {
+	  arrayh5_destroy(*a);
+	  a->dims = NULL;
+	  a->data = NULL;
      }
 
  done:
+     free(dims);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* Read rows row0 to row0+nrows-1 of the first dimension of a slice
+   of h (whose dimensions are given by arrayh5_slice_dims) into data,
+   so that a large dataset can be processed a block at a time.  (A
+   rank-0 slice consists of a single row.) */
+int arrayh5_read_rows(arrayh5_handle *h,
+		      int nslicedims, const int *slicedim,
+		      const int *islice, const int *center_slice,
+		      int row0, int nrows, double *data)
+{
+     hsize_t *start, *count;
+     int *dims;
+     int err, rank2, sliced;
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, &rank2, dims, &sliced);
+     if (err == NO_ERROR) {
+	  if (row0 < 0 || nrows < 0
+	      || row0 + nrows > (rank2 > 0 ? dims[0] : 1))
+	       err = INVALID_SLICE;
+	  else if (nrows > 0)
+	       err = read_rows(h, start, NULL, count,
+			       first_slice_dim(h, count, sliced),
+			       row0, nrows, data);
+     }
+
+     free(dims);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* the dimension of h corresponding to the last dimension of the
+   hyperslab start/count computed by get_slices (-1 if none) */
+static int last_slice_dim(const arrayh5_handle *h, const hsize_t *count,
+			  int sliced)
+{
+     int kl;
+     for (kl = h->rank - 1; sliced && kl >= 0 && count[kl] <= 1; --kl)
+	  ;
+     return kl;
+}
+
+/* Like arrayh5_read_rows, but for the transpose of the slice: read
+   rows row0 to row0+nrows-1 of the first dimension of the transposed
+   slice (i.e. of the last dimension of the slice) into data, in the
+   transposed order. */
+int arrayh5_read_transposed_rows(arrayh5_handle *h,
+				 int nslicedims, const int *slicedim,
+				 const int *islice, const int *center_slice,
+				 int row0, int nrows, double *data)
+{
+     hsize_t *start, *count;
+     int *dims;
+     int err, rank2, sliced;
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, &rank2, dims, &sliced);
+     if (err == NO_ERROR) {
+	  if (row0 < 0 || nrows < 0
+	      || row0 + nrows > (rank2 > 0 ? dims[rank2 - 1] : 1))
+	       err = INVALID_SLICE;
+	  else if (rank2 < 2 && nrows > 0)
+	       err = read_rows(h, start, NULL, count,
+			       first_slice_dim(h, count, sliced),
+			       row0, nrows, data);
+	  else if (nrows > 0) {
+	       /* read the rows of the last dimension, then transpose */
+	       int i, n = nrows;
+	       double *buf;
+	       for (i = 0; i < rank2 - 1; ++i)
+		    n *= dims[i];
+	       CHK_MALLOC(buf, double, n);
+	       err = read_rows(h, start, NULL, count,
+			       last_slice_dim(h, count, sliced),
+			       row0, nrows, buf);
+	       if (err == NO_ERROR) {
+		    dims[rank2 - 1] = nrows;
+		    transpose_slab(buf, data, rank2, dims, dims[0], nrows);
+	       }
+	       free(buf);
+	  }
+     }
+
+     free(dims);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* Read a sub-block of a slice of h (whose dimensions are given by
+   arrayh5_slice_dims) into data, in transposed (column-major) order,
+   so that callers with column-major storage (e.g. Octave) can read
+   directly into it.  In each dimension k of the slice, the block
+   consists of bcount[k] elements starting at bstart[k] with a stride
+   of bstride[k]; if bcount is NULL, the whole slice is read.  The
+   transpose is done a slab at a time, so only a bounded scratch
+   buffer is needed. */
+int arrayh5_read_transposed_block(arrayh5_handle *h,
+				  int nslicedims, const int *slicedim,
+				  const int *islice, const int *center_slice,
+				  const int *bstart, const int *bstride,
+				  const int *bcount, double *data)
+{
+     hsize_t *start, *count, *stride;
+     int *dims, *fd;
+     int i, k, err, rank2, sliced, N;
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(stride, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+     CHK_MALLOC(fd, int, h->rank);
+
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, &rank2, dims, &sliced);
      if (err != NO_ERROR)
-	  arrayh5_destroy(*a);
-     free(islice);
-     free(slicedim);
+	  goto done;
+
+     /* fd[k] = the dimension of h corresponding to dimension k of the
+	slice (we can't use first/last_slice_dim once a block count
+	may be 1) */
+     for (i = k = 0; i < h->rank; ++i) {
+	  stride[i] = 1;
+	  if (!sliced || count[i] > 1)
+	       fd[k++] = i;
+     }
+
+     if (bcount)
+	  for (k = 0; k < rank2; ++k) {
+	       if (bstart[k] < 0 || bstride[k] < 1 || bcount[k] < 0
+		   || (bcount[k] > 0 && bstart[k] + (bcount[k] - 1)
+		       * (double) bstride[k] >= dims[k])) {
+		    err = INVALID_SLICE;
+		    goto done;
+	       }
+	       start[fd[k]] += bstart[k];
+	       stride[fd[k]] = bstride[k];
+	       count[fd[k]] = dims[k] = bcount[k];
+	  }
+
+     for (N = 1, k = 0; k < rank2; ++k)
+	  N *= dims[k];
+
+     if (N == 0)
+	  ;
+     else if (rank2 < 2)
+	  err = read_rows(h, start, stride, count, h->rank, 0, 1, data);
+     else {
+	  /* read slabs of the last dimension, transposing each one
+	     into the corresponding rows of data */
+	  int nlast = dims[rank2 - 1], n = N / nlast, r0, nr;
+	  double *buf;
+
+	  nr = slab_rows(nlast, n);
+	  CHK_MALLOC(buf, double, nr * n);
+	  for (r0 = 0; r0 < nlast && err == NO_ERROR; r0 += nr) {
+	       if (nr > nlast - r0)
+		    nr = nlast - r0;
+	       err = read_rows(h, start, stride, count, fd[rank2 - 1],
+			       r0, nr, buf);
+	       if (err == NO_ERROR) {
+		    dims[rank2 - 1] = nr;
+		    transpose_slab(buf, data + r0 * n, rank2, dims,
+				   dims[0], nr);
+	       }
+	  }
+	  free(buf);
+     }
+
+ done:
+     free(fd);
      free(dims);
-     if (space_id >= 0)
-	  H5Sclose(space_id);
-     if (data_id >= 0)
-	  H5Dclose(data_id);
+     free(stride);
+     free(count);
+     free(start);
+     return err;
+}
+
+/* Return the number of rows in each chunk of h along the first
+   dimension of the given slice, or 1 if h is not chunked; reading rows
+   in multiples of this avoids reading any chunk more than once. */
+int arrayh5_slice_chunk_rows(const arrayh5_handle *h,
+			     int nslicedims, const int *slicedim,
+			     const int *islice, const int *center_slice)
+{
+     hsize_t *start, *count;
+     int *dims;
+     int rank2, sliced, rows = 1;
+
+     if (h->rank <= 0)
+	  return 1;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+
+     if (get_slices(h, nslicedims, slicedim, islice, center_slice,
+		    start, count, &rank2, dims, &sliced) == NO_ERROR) {
+	  int k0 = first_slice_dim(h, count, sliced);
+	  hid_t plist_id = H5Dget_create_plist(h->data_id);
+	  if (k0 < h->rank && H5Pget_layout(plist_id) == H5D_CHUNKED) {
+	       hsize_t *chunk;
+	       CHK_MALLOC(chunk, hsize_t, h->rank);
+	       if (H5Pget_chunk(plist_id, h->rank, chunk) == h->rank)
+		    rows = chunk[k0];
+	       free(chunk);
+	  }
+	  H5Pclose(plist_id);
+     }
+
+     free(dims);
+     free(count);
+     free(start);
+     return rows;
+}
+
+int arrayh5_read_handle(arrayh5 *a, arrayh5_handle *h,
+			int nslicedims, const int *slicedim,
+			const int *islice, const int *center_slice)
+{
+     return read_handle(a, h, nslicedims, slicedim, islice, center_slice,
+			0, NULL);
+}
+
+/* like arrayh5_read_handle, but returns the transpose of the data,
+   as if by arrayh5_transpose */
+int arrayh5_read_transposed_handle(arrayh5 *a, arrayh5_handle *h,
+				   int nslicedims, const int *slicedim,
+				   const int *islice, const int *center_slice)
+{
+     return read_handle(a, h, nslicedims, slicedim, islice, center_slice,
+			1, NULL);
+}
+
+/* A reusable array for reading many slices: arrayh5_read_buffer reads
+   a slice into b->a as arrayh5_read_handle does, but b->a keeps its
+   storage from one read to the next and is only reallocated when a
+   slice is bigger than any previous one (so that reading many
+   equal-sized slices does not allocate, and page-fault, fresh memory
+   every time).  b->a is valid until the next read or until
+   arrayh5_buffer_destroy. */
+void arrayh5_buffer_init(arrayh5_buffer *b)
+{
+     b->a.rank = b->a.N = 0;
+     b->a.dims = NULL;
+     b->a.data = NULL;
+     b->a.map = NULL;
+     b->a.map_size = 0;
+     b->a.have_range = 0;
+     b->max_rank = b->max_N = b->max_work = 0;
+     b->work = NULL;
+}
+
+void arrayh5_buffer_destroy(arrayh5_buffer *b)
+{
+     free(b->a.dims);
+     free_data(&b->a);
+     free(b->work);
+     arrayh5_buffer_init(b);
+}
+
+int arrayh5_read_buffer(arrayh5_buffer *b, arrayh5_handle *h,
+			int nslicedims, const int *slicedim,
+			const int *islice, const int *center_slice)
+{
+     return read_handle(&b->a, h, nslicedims, slicedim, islice,
+			center_slice, 0, b);
+}
+
+int arrayh5_read_transposed_buffer(arrayh5_buffer *b, arrayh5_handle *h,
+				   int nslicedims, const int *slicedim,
+				   const int *islice, const int *center_slice)
+{
+     return read_handle(&b->a, h, nslicedims, slicedim, islice,
+			center_slice, 1, b);
+}
+
+static int read_file(arrayh5 *a, const char *fname, const char *datapath,
+		     char **dataname,
+		     int nslicedims, const int *slicedim, const int *islice,
+		     const int *center_slice, int transpose)
+{
+     arrayh5_handle *h;
+     int err;
+
+     CHECK(a, "NULL array passed to arrayh5_read");
+     a->dims = NULL;
+     a->data = NULL;
      if (dataname)
-	  *dataname = dname;
+	  *dataname = NULL;
+
+     err = arrayh5_open(&h, fname, datapath);
+     if (err != NO_ERROR)
+	  return err;
+
+     err = read_handle(a, h, nslicedims, slicedim, islice,
+		       center_slice, transpose, NULL);
+     if (dataname) {
+	  CHK_MALLOC(*dataname, char, strlen(h->dname) + 1);
+	  strcpy(*dataname, h->dname);
+     }
+
+     arrayh5_close(h);
+     return err;
+}
+
+int arrayh5_read(arrayh5 *a, const char *fname, const char *datapath,
+		 char **dataname,
+		 int nslicedims, const int *slicedim, const int *islice,
+		 const int *center_slice)
+{
+     return read_file(a, fname, datapath, dataname,
+		      nslicedims, slicedim, islice, center_slice, 0);
+}
+
+int arrayh5_read_transposed(arrayh5 *a, const char *fname,
+			    const char *datapath, char **dataname,
+			    int nslicedims, const int *slicedim,
+			    const int *islice, const int *center_slice)
+{
+     return read_file(a, fname, datapath, dataname,
+		      nslicedims, slicedim, islice, center_slice, 1);
+}
+
+/* HDF5 memory type corresponding to an arrayh5_type */
+static hid_t type_to_h5(arrayh5_type type)
+{
+     switch (type) {
+	 case ARRAYH5_FLOAT: return H5T_NATIVE_FLOAT;
+	 case ARRAYH5_INT8: return H5T_NATIVE_INT8;
+	 case ARRAYH5_UINT8: return H5T_NATIVE_UINT8;
+	 case ARRAYH5_INT16: return H5T_NATIVE_INT16;
+	 case ARRAYH5_UINT16: return H5T_NATIVE_UINT16;
+	 case ARRAYH5_INT32: return H5T_NATIVE_INT32;
+	 case ARRAYH5_UINT32: return H5T_NATIVE_UINT32;
+	 case ARRAYH5_INT64: return H5T_NATIVE_INT64;
+	 case ARRAYH5_UINT64: return H5T_NATIVE_UINT64;
+	 default: return H5T_NATIVE_DOUBLE;
+     }
+}
+
+/* the arrayh5_type that can hold the dataset's on-disk elements
+   without loss, falling back to double for anything exotic */
+static arrayh5_type h5_to_type(hid_t data_id)
+{
+     hid_t type_id = H5Dget_type(data_id);
+     arrayh5_type type = ARRAYH5_DOUBLE;
+     size_t size = H5Tget_size(type_id);
+
+     switch (H5Tget_class(type_id)) {
+	 case H5T_FLOAT:
+	      if (size <= sizeof(float))
+		   type = ARRAYH5_FLOAT;
+	      break;
+	 case H5T_INTEGER:
+	 {
+	      int is_signed = H5Tget_sign(type_id) != H5T_SGN_NONE;
+	      if (size == 1)
+		   type = is_signed ? ARRAYH5_INT8 : ARRAYH5_UINT8;
+	      else if (size == 2)
+		   type = is_signed ? ARRAYH5_INT16 : ARRAYH5_UINT16;
+	      else if (size == 4)
+		   type = is_signed ? ARRAYH5_INT32 : ARRAYH5_UINT32;
+	      else if (size == 8)
+		   type = is_signed ? ARRAYH5_INT64 : ARRAYH5_UINT64;
+	      break;
+	 }
+	 default:
+	      break;
+     }
+     H5Tclose(type_id);
+     return type;
+}
+
+/* Read a (possibly strided) hyperslab of a dataset, keeping the data
+   in the given element type (or the dataset's own type, if type is
+   ARRAYH5_NATIVE).  start, stride, and count give the hyperslab in
+   the first nslab dimensions (any of them may be NULL), with the
+   remaining dimensions read in full; start defaults to 0, stride to
+   1, and a count <= 0 means as many elements as fit.  Dimensions with
+   an explicit count of 1 are dropped from the resulting array, as for
+   the slices of arrayh5_read. */
+int arrayh5_read_typed_handle(arrayh5_typed *a, arrayh5_handle *h,
+			      arrayh5_type type, int nslab,
+			      const int *start_, const int *stride_,
+			      const int *count_)
+{
+     hid_t mem_space_id;
+     int err = NO_ERROR;
+     int i, j, rank = h->rank;
+     hsize_t *start = 0, *stride = 0, *count = 0;
+     int *adims = 0;
+     double t0;
+
+     CHECK(a, "NULL array passed to arrayh5_read_typed");
+     a->dims = NULL;
+     a->data = NULL;
+
+     if (rank <= 0)
+	  return INVALID_RANK;
+     if (nslab > rank)
+	  return INVALID_SLICE;
+
+     CHK_MALLOC(start, hsize_t, rank);
+     CHK_MALLOC(stride, hsize_t, rank);
+     CHK_MALLOC(count, hsize_t, rank);
+     CHK_MALLOC(adims, int, rank);
+
+     for (i = j = 0; i < rank; ++i) {
+	  int st = (i < nslab && start_) ? start_[i] : 0;
+	  int sd = (i < nslab && stride_) ? stride_[i] : 1;
+	  int cnt = (i < nslab && count_) ? count_[i] : 0;
+	  if (st < 0 || st >= h->dims[i] || sd < 1) {
+	       err = INVALID_SLICE;
+	       goto done;
+	  }
+	  if (cnt <= 0)
+	       cnt = (h->dims[i] - st + sd - 1) / sd;
+	  else if (st + (cnt - 1) * (double) sd >= h->dims[i]) {
+	       err = INVALID_SLICE;
+	       goto done;
+	  }
+	  start[i] = st;
+	  stride[i] = sd;
+	  count[i] = cnt;
+	  if (!(i < nslab && count_ && count_[i] == 1))
+	       adims[j++] = cnt;
+     }
+
+     if (type == ARRAYH5_NATIVE)
+	  type = h5_to_type(h->data_id);
+     *a = arrayh5_typed_create(j, adims, type);
+
+     H5Sselect_hyperslab(h->space_id, H5S_SELECT_SET,
+			 start, stride, count, NULL);
+     mem_space_id = H5Screate_simple(rank, count, NULL);
+     H5Sselect_all(mem_space_id);
+
+     t0 = arrayh5_stats_start();
+     if (H5Dread(h->data_id, type_to_h5(type), mem_space_id, h->space_id,
+		 H5P_DEFAULT, a->data) < 0) {
+	  arrayh5_typed_destroy(*a);
+	  a->dims = NULL;
+	  a->data = NULL;
+	  err = READ_FAILED;
+     }
      else
-	  free(dname);
-     if (file_id >= 0)
-	  H5Fclose(file_id);
+	  stats_read(t0, arrayh5_type_size(type) * (double) a->N);
+     H5Sclose(mem_space_id);
+
+ done:
+     free(adims);
+     free(count);
+     free(stride);
+     free(start);
+     return err;
+}
+
+int arrayh5_read_typed(arrayh5_typed *a, const char *fname,
+		       const char *datapath, char **dataname,
+		       arrayh5_type type, int nslab,
+		       const int *start, const int *stride,
+		       const int *count)
+{
+     arrayh5_handle *h;
+     int err;
+
+     CHECK(a, "NULL array passed to arrayh5_read_typed");
+     a->dims = NULL;
+     a->data = NULL;
+     if (dataname)
+	  *dataname = NULL;
+
+     err = arrayh5_open(&h, fname, datapath);
+     if (err != NO_ERROR)
+	  return err;
+
+     err = arrayh5_read_typed_handle(a, h, type, nslab, start, stride, count);
+     if (dataname) {
+	  CHK_MALLOC(*dataname, char, strlen(h->dname) + 1);
+	  strcpy(*dataname, h->dname);
+     }
+
+     arrayh5_close(h);
+     return err;
+}
 
+/* Read the given slice of h (as for arrayh5_read_handle, but not
+   transposed) without widening it to double, as by
+   arrayh5_read_typed_handle. */
+int arrayh5_read_typed_slice(arrayh5_typed *a, arrayh5_handle *h,
+			     arrayh5_type type, int nslicedims,
+			     const int *slicedim, const int *islice,
+			     const int *center_slice)
+{
+     hsize_t *start, *count;
+     int *istart, *icount, *dims, i, err, rank2, sliced;
+
+     if (h->rank <= 0)
+	  return INVALID_RANK;
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     CHK_MALLOC(istart, int, h->rank);
+     CHK_MALLOC(icount, int, h->rank);
+     CHK_MALLOC(dims, int, h->rank);
+     err = get_slices(h, nslicedims, slicedim, islice, center_slice,
+		      start, count, &rank2, dims, &sliced);
+     if (err == NO_ERROR) {
+	  for (i = 0; i < h->rank; ++i) {
+	       istart[i] = start[i];
+	       icount[i] = count[i];
+	  }
+	  /* the dimensions of count 1 are dropped, as in get_slices */
+	  err = arrayh5_read_typed_handle(a, h, type, h->rank,
+					  istart, NULL, icount);
+     }
+     free(dims);
+     free(icount);
+     free(istart);
+     free(count);
+     free(start);
      return err;
 }
 
+/* the element type in which h is stored */
+arrayh5_type arrayh5_handle_type(const arrayh5_handle *h)
+{
+     return h5_to_type(h->data_id);
+}
+
 static int dataset_exists(hid_t id, const char *name)
 {
      hid_t data_id;
@@ -363,80 +2324,381 @@ static int dataset_exists(hid_t id, const char *name)
      return (data_id >= 0);
 }
 
-void arrayh5_write(arrayh5 a, char *filename, char *dataname,
-		   short append_data)
+/* chunks of extendible datasets, and automatically chunked datasets,
+   hold about this many elements */
+#define EXTENDIBLE_CHUNK_ELEMENTS 65536
+
+/* Set chunk to a chunk of dims with at most EXTENDIBLE_CHUNK_ELEMENTS
+   elements, found by repeatedly halving the largest dimension, so that
+   slices along any dimension touch about the same number of chunks. */
+static void auto_chunk(int rank, const hsize_t *dims, hsize_t *chunk)
 {
+     hsize_t n = 1;
      int i;
-     hid_t file_id, space_id, type_id, data_id;
-     hsize_t *dims_copy;
 
+     for (i = 0; i < rank; ++i)
+	  n *= (chunk[i] = dims[i] > 0 ? dims[i] : 1);
+     while (n > EXTENDIBLE_CHUNK_ELEMENTS) {
+	  int imax = 0;
+	  for (i = 1; i < rank; ++i)
+	       if (chunk[i] > chunk[imax])
+		    imax = i;
+	  n /= chunk[imax];
+	  chunk[imax] = (chunk[imax] + 1) / 2;
+	  n *= chunk[imax];
+     }
+}
+
+/* Set up the chunking and filters of prop_id according to opts, if
+   chunk is non-NULL using it for the chunk dimensions (rather than
+   opts->chunk or automatic chunking); returns the (possibly newly
+   created) property list. */
+static hid_t set_write_options(hid_t prop_id, int rank, const hsize_t *dims,
+			       const hsize_t *chunk,
+			       const arrayh5_write_options *opts)
+{
+     int i, filters = opts && (opts->deflate || opts->shuffle || opts->szip);
+
+     if (!chunk && !filters && !(opts && opts->chunk_rank))
+	  return prop_id; /* contiguous */
+
+     if (prop_id == H5P_DEFAULT)
+	  prop_id = H5Pcreate(H5P_DATASET_CREATE);
+     if (!chunk) {
+	  hsize_t *c;
+	  CHK_MALLOC(c, hsize_t, rank);
+	  if (opts->chunk_rank) {
+	       CHECK(opts->chunk_rank == rank,
+		     "chunk rank doesn't match rank of HDF5 output dataset");
+	       for (i = 0; i < rank; ++i) /* chunks can't exceed dims */
+		    c[i] = (hsize_t) opts->chunk[i] < dims[i]
+			 ? (hsize_t) opts->chunk[i] : (dims[i] > 0 ? dims[i] : 1);
+	  }
+	  else
+	       auto_chunk(rank, dims, c);
+	  H5Pset_chunk(prop_id, rank, c);
+	  free(c);
+     }
+     else
+	  H5Pset_chunk(prop_id, rank, chunk);
+
+     if (opts && opts->shuffle)
+	  H5Pset_shuffle(prop_id);
+     if (opts && opts->deflate)
+	  CHECK(H5Pset_deflate(prop_id, opts->deflate) >= 0,
+		"error setting up deflate compression");
+     if (opts && opts->szip) {
+	  unsigned config = 0;
+	  CHECK(H5Zfilter_avail(H5Z_FILTER_SZIP)
+		&& H5Zget_filter_info(H5Z_FILTER_SZIP, &config) >= 0
+		&& (config & H5Z_FILTER_CONFIG_ENCODE_ENABLED),
+		"szip compression is not available in this HDF5");
+	  CHECK(H5Pset_szip(prop_id, H5_SZIP_NN_OPTION_MASK, opts->szip) >= 0,
+		"error setting up szip compression");
+     }
+     return prop_id;
+}
+
+static arrayh5_handle *create_data(char *filename, char *dataname,
+				   int rank, const int *dims,
+				   short append_data, int extendible,
+				   const arrayh5_write_options *opts)
+{
+     int i;
+     arrayh5_handle *h;
+     hsize_t *dims_copy, *maxdims = NULL;
+     hid_t prop_id = H5P_DEFAULT, fapl;
+
+     CHECK(rank > 0, "non-positive rank");
+     CHECK(!extendible || mpi_size == 1,
+	   "extendible datasets are not supported with MPI");
+     CHK_MALLOC(h, arrayh5_handle, 1);
+
+     file_forget(filename);
+     fapl = mpi_fapl(1);
      if (append_data)
-	  file_id = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+	  h->file_id = H5Fopen(filename, H5F_ACC_RDWR, fapl);
      else
-	  file_id = H5Fcreate(filename, H5F_ACC_TRUNC,
-			      H5P_DEFAULT, H5P_DEFAULT);
-     CHECK(file_id >= 0, "error opening HDF5 output file");
+	  h->file_id = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+     close_plist(fapl);
+     CHECK(h->file_id >= 0, "error opening HDF5 output file");
+     stats_count(&stats.opens);
 
-     if (dataset_exists(file_id, dataname))
-	  H5Gunlink(file_id, dataname);  /* delete it */
+     if (dataset_exists(h->file_id, dataname))
+	  H5Gunlink(h->file_id, dataname);  /* delete it */
 
-     CHECK(a.rank > 0, "non-positive rank");
-     CHK_MALLOC(dims_copy, hsize_t, a.rank);
-     for (i = 0; i < a.rank; ++i)
-	  dims_copy[i] = a.dims[i];
-     space_id = H5Screate_simple(a.rank, dims_copy, NULL);
+     h->rank = rank;
+     CHK_MALLOC(h->dims, int, rank);
+     CHK_MALLOC(dims_copy, hsize_t, rank);
+     for (i = 0; i < rank; ++i)
+	  dims_copy[i] = h->dims[i] = dims[i];
+     if (extendible) {
+	  /* the first dimension starts empty and grows without bound;
+	     each chunk is a whole number of rows */
+	  hsize_t *chunk, rowsize = 1;
+	  CHK_MALLOC(maxdims, hsize_t, rank);
+	  CHK_MALLOC(chunk, hsize_t, rank);
+	  for (i = 1; i < rank; ++i) {
+	       maxdims[i] = dims_copy[i];
+	       chunk[i] = dims[i] > 0 ? dims[i] : 1;
+	       rowsize *= chunk[i];
+	  }
+	  maxdims[0] = H5S_UNLIMITED;
+	  dims_copy[0] = h->dims[0] = 0;
+	  chunk[0] = rowsize < EXTENDIBLE_CHUNK_ELEMENTS
+	       ? EXTENDIBLE_CHUNK_ELEMENTS / rowsize : 1;
+	  if (dims[0] > 0 && chunk[0] > (hsize_t) dims[0])
+	       chunk[0] = dims[0]; /* don't make chunks bigger than needed */
+	  if (opts && opts->chunk_rank) {
+	       CHECK(opts->chunk_rank == rank,
+		     "chunk rank doesn't match rank of HDF5 output dataset");
+	       for (i = 0; i < rank; ++i)
+		    if (i == 0 || (hsize_t) opts->chunk[i] < chunk[i])
+			 chunk[i] = opts->chunk[i];
+	  }
+	  prop_id = set_write_options(H5P_DEFAULT, rank, dims_copy, chunk,
+				      opts);
+	  free(chunk);
+     }
+     else
+	  prop_id = set_write_options(H5P_DEFAULT, rank, dims_copy, NULL,
+				      opts);
+     h->space_id = H5Screate_simple(rank, dims_copy, maxdims);
+     free(maxdims);
      free(dims_copy);
 
-     type_id = H5T_NATIVE_DOUBLE;
-     data_id = H5Dcreate(file_id, dataname, type_id, space_id, H5P_DEFAULT);
-     H5Sclose(space_id);
+     CHK_MALLOC(h->dname, char, strlen(dataname) + 1);
+     strcpy(h->dname, dataname);
+     h->rows_written = trust_range_attr() ? 0 : -1;
+     h->single_precision = opts && opts->single_precision;
+     h->range_min = HUGE_VAL;
+     h->range_max = -HUGE_VAL;
+     h->data_id = H5Dcreate(h->file_id, dataname,
+			    opts && opts->single_precision
+			    ? H5T_NATIVE_FLOAT : H5T_NATIVE_DOUBLE,
+			    h->space_id, prop_id);
+     CHECK(h->data_id >= 0, "error creating HDF5 output dataset");
+     if (prop_id != H5P_DEFAULT)
+	  H5Pclose(prop_id);
+
+     return h;
+}
 
-     H5Dwrite(data_id, type_id, H5S_ALL, H5S_ALL, H5P_DEFAULT, a.data);
+/* Create a new dataset (overwriting any existing dataset of the same
+   name) of dimensions dims in filename, returning a handle to which
+   the data are then written by arrayh5_write_rows, and which is closed
+   by arrayh5_close.  opts (NULL for the defaults) gives the storage
+   layout and type of the dataset. */
+arrayh5_handle *arrayh5_create_dataset(char *filename, char *dataname,
+				       int rank, const int *dims,
+				       short append_data,
+				       const arrayh5_write_options *opts)
+{
+     return create_data(filename, dataname, rank, dims, append_data, 0,
+			opts);
+}
 
-     H5Dclose(data_id);
-     H5Fclose(file_id);
+/* Like arrayh5_create_dataset, but the dataset is chunked and starts
+   out with no rows; rows are added to the end of it by
+   arrayh5_append_rows, so that data whose length is not known in
+   advance can be written as it is produced.  dims[0], if positive, is
+   a lower bound for the final number of rows, which limits the number
+   of rows in a chunk. */
+arrayh5_handle *arrayh5_create_extendible(char *filename, char *dataname,
+					  int rank, const int *dims,
+					  short append_data,
+					  const arrayh5_write_options *opts)
+{
+     return create_data(filename, dataname, rank, dims, append_data, 1,
+			opts);
 }
 
-int arrayh5_read_rank(const char *fname, const char *datapath, int *rank)
+/* Rename the dataset of h, being written, to dataname, replacing any
+   existing dataset of that name; returns whether this succeeded. */
+int arrayh5_rename_dataset(arrayh5_handle *h, const char *dataname)
 {
-     hid_t file_id = -1, data_id = -1, space_id = -1;
-     char *dname = NULL;
-     int err = NO_ERROR;
+     char *dname;
 
-     file_id = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
-     if (file_id < 0) {
-	  err = OPEN_FAILED;
-	  goto done;
-     }
+     if (dataset_exists(h->file_id, dataname))
+	  H5Gunlink(h->file_id, dataname);
+     if (H5Gmove(h->file_id, h->dname, dataname) < 0)
+	  return 0;
+     CHK_MALLOC(dname, char, strlen(dataname) + 1);
+     strcpy(dname, dataname);
+     free(h->dname);
+     h->dname = dname;
+     return 1;
+}
 
-     if (datapath && datapath[0]) {
-	  CHK_MALLOC(dname, char, strlen(datapath) + 1);
-	  strcpy(dname, datapath);
+/* Close a handle of a dataset being written, deleting the dataset
+   (e.g. after an error, when the dataset is incomplete). */
+void arrayh5_discard(arrayh5_handle *h)
+{
+     if (!h)
+	  return;
+     h->rows_written = -1; /* don't record its range */
+     if (h->file_id >= 0 && h->dname)
+	  H5Gunlink(h->file_id, h->dname);
+     arrayh5_close(h);
+}
+
+/* append nrows rows (of the first dimension) to the end of a dataset
+   created by arrayh5_create_extendible */
+void arrayh5_append_rows(arrayh5_handle *h, int nrows, const double *data)
+{
+     hsize_t *dims;
+     int i, row0 = h->dims[0];
+
+     if (nrows <= 0)
+	  return;
+     CHK_MALLOC(dims, hsize_t, h->rank);
+     for (i = 0; i < h->rank; ++i)
+	  dims[i] = h->dims[i];
+     dims[0] += nrows;
+     CHECK(H5Dextend(h->data_id, dims) >= 0,
+	   "error extending HDF5 output dataset");
+     free(dims);
+     h->dims[0] += nrows;
+     H5Sclose(h->space_id);
+     h->space_id = H5Dget_space(h->data_id);
+     arrayh5_write_rows(h, row0, nrows, data);
+}
+
+/* write nrows rows (of the first dimension), starting at row0, of the
+   dataset created by arrayh5_create_dataset */
+void arrayh5_write_rows(arrayh5_handle *h, int row0, int nrows,
+			const double *data)
+{
+     hsize_t *start, *count, nmem = 1;
+     hid_t mem_space_id;
+     int i;
+     double t0;
+
+     CHECK(row0 >= 0 && nrows >= 0 && row0 + nrows <= h->dims[0],
+	   "invalid rows in arrayh5_write_rows");
+     CHK_MALLOC(start, hsize_t, h->rank);
+     CHK_MALLOC(count, hsize_t, h->rank);
+     for (i = 0; i < h->rank; ++i) {
+	  start[i] = 0;
+	  count[i] = h->dims[i];
      }
-     else {
-	  if (H5Giterate(file_id, "/", NULL, find_dataset, &dname) <= 0) {
-	       err = NO_DATA;
-	       goto done;
+     start[0] = row0;
+     count[0] = nrows;
+     for (i = 0; i < h->rank; ++i)
+	  nmem *= count[i];
+
+     /* with MPI, the writes are collective, so every process writes
+	(possibly nothing) every time */
+     if (nmem > 0 || mpi_size > 1) {
+	  hid_t dxpl = mpi_dxpl();
+	  if (nmem > 0) {
+	       H5Sselect_hyperslab(h->space_id, H5S_SELECT_SET,
+				   start, NULL, count, NULL);
+	       /* a memory space of the same shape as the selection is
+		  much faster than a 1d one for chunked datasets */
+	       mem_space_id = H5Screate_simple(h->rank, count, NULL);
+	  }
+	  else {
+	       hsize_t one = 1;
+	       H5Sselect_none(h->space_id);
+	       mem_space_id = H5Screate_simple(1, &one, NULL);
+	       H5Sselect_none(mem_space_id);
+	  }
+	  t0 = arrayh5_stats_start();
+	  CHECK(H5Dwrite(h->data_id, H5T_NATIVE_DOUBLE, mem_space_id,
+			 h->space_id, dxpl, data) >= 0,
+		"error writing HDF5 output");
+	  stats_write(t0, sizeof(double) * (double) nmem);
+	  close_plist(dxpl);
+	  H5Sclose(mem_space_id);
+
+	  if (nmem > 0 && h->rows_written >= 0) {
+	       double min, max;
+	       arrayh5_range(data, (int) nmem, 1, &min, &max);
+	       if (min < h->range_min)
+		    h->range_min = min;
+	       if (max > h->range_max)
+		    h->range_max = max;
 	  }
      }
+     if (h->rows_written >= 0)
+	  h->rows_written += nrows;
 
-     data_id = H5Dopen(file_id, dname);
-     if (data_id < 0) {
-	  err = OPEN_DATA_FAILED;
-	  goto done;
+     free(count);
+     free(start);
+}
+
+/* With MPI, a is written by process 0 (the other processes take part
+   in the collective writes without writing anything). */
+static void write_data(arrayh5 a, char *filename, char *dataname,
+		       short append_data, int transpose,
+		       const arrayh5_write_options *opts)
+{
+     arrayh5_handle *h;
+     int root = mpi_rank == 0;
+
+     if (a.rank < 2 || a.N == 0)
+	  transpose = 0; /* nothing to do */
+
+     if (transpose) {
+	  /* write slabs of the first dimension of the transposed array,
+	     i.e. of the last dimension of a */
+	  int i, nlast = a.dims[a.rank - 1], n = a.N / nlast;
+	  int j0, nj = slab_rows(nlast, n);
+	  int *dims_t;
+	  double *buf;
+
+	  CHK_MALLOC(dims_t, int, a.rank);
+	  for (i = 0; i < a.rank; ++i)
+	       dims_t[i] = a.dims[a.rank - 1 - i];
+	  h = arrayh5_create_dataset(filename, dataname, a.rank, dims_t,
+				     append_data, opts);
+	  free(dims_t);
+
+	  CHK_MALLOC(buf, double, nj * n);
+	  for (j0 = 0; j0 < nlast; j0 += nj) {
+	       if (nj > nlast - j0)
+		    nj = nlast - j0;
+	       if (root)
+		    transpose_slab(a.data + j0, buf, a.rank, a.dims,
+				   a.dims[0], nj);
+	       arrayh5_write_rows(h, j0, root ? nj : 0, buf);
+	  }
+	  free(buf);
      }
+     else {
+	  h = arrayh5_create_dataset(filename, dataname, a.rank, a.dims,
+				     append_data, opts);
+	  arrayh5_write_rows(h, 0, root ? a.dims[0] : 0, a.data);
+     }
+     arrayh5_close(h);
+}
+
+void arrayh5_write(arrayh5 a, char *filename, char *dataname,
+		   short append_data, const arrayh5_write_options *opts)
+{
+     write_data(a, filename, dataname, append_data, 0, opts);
+}
 
-     space_id = H5Dget_space(data_id);
-     *rank = H5Sget_simple_extent_ndims(space_id);
+/* write the transpose of a, as if by arrayh5_transpose, without
+   modifying a or making a transposed copy of it */
+void arrayh5_write_transposed(arrayh5 a, char *filename, char *dataname,
+			      short append_data,
+			      const arrayh5_write_options *opts)
+{
+     write_data(a, filename, dataname, append_data, 1, opts);
+}
 
- done:
-     if (space_id >= 0)
-	  H5Sclose(space_id);
-     if (data_id >= 0)
-	  H5Dclose(data_id);
-     free(dname);
-     if (file_id >= 0)
-	  H5Fclose(file_id);
+int arrayh5_read_rank(const char *fname, const char *datapath, int *rank)
+{
+     arrayh5_handle *h;
+     int err;
 
-     return err;
+     err = arrayh5_open(&h, fname, datapath);
+     if (err != NO_ERROR)
+	  return err;
+     *rank = h->rank;
+     arrayh5_close(h);
+
+     return NO_ERROR;
 }
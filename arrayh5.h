@@ -23,6 +23,8 @@
 #ifndef ARRAYH5_H
 #define ARRAYH5_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -32,6 +34,9 @@ extern "C" {
 typedef struct {
      int rank, *dims, N;
      double *data;
+     void *map; size_t map_size; /* mmap()ed region holding data, if any */
+     int have_range; /* whether the range of data is known (from the file) */
+     double range_min, range_max;
 } arrayh5;
 
 extern arrayh5 arrayh5_create_withdata(int rank, const int *dims,double *data);
@@ -41,6 +46,33 @@ extern void arrayh5_transpose(arrayh5 *a);
 extern void arrayh5_destroy(arrayh5 a);
 extern int arrayh5_conformant(arrayh5 a, arrayh5 b);
 extern void arrayh5_getrange(arrayh5 a, double *min, double *max);
+extern void arrayh5_getrange_threads(arrayh5 a, int nthreads,
+				     double *min, double *max);
+extern void arrayh5_range(const double *data, int n, int nthreads,
+			  double *min, double *max);
+
+/* Element types for arrays whose data are kept in the dataset's own
+   numeric type instead of being widened to double; ARRAYH5_INTn and
+   ARRAYH5_UINTn are n-bit signed and unsigned integers. */
+typedef enum {
+     ARRAYH5_NATIVE = -1, /* use the type stored in the file */
+     ARRAYH5_DOUBLE = 0, ARRAYH5_FLOAT,
+     ARRAYH5_INT8, ARRAYH5_UINT8, ARRAYH5_INT16, ARRAYH5_UINT16,
+     ARRAYH5_INT32, ARRAYH5_UINT32, ARRAYH5_INT64, ARRAYH5_UINT64
+} arrayh5_type;
+
+typedef struct {
+     int rank, *dims, N;
+     arrayh5_type type;
+     void *data;
+} arrayh5_typed;
+
+extern size_t arrayh5_type_size(arrayh5_type type);
+extern arrayh5_typed arrayh5_typed_create(int rank, const int *dims,
+					  arrayh5_type type);
+extern void arrayh5_typed_destroy(arrayh5_typed a);
+extern double arrayh5_typed_value(arrayh5_typed a, int i);
+extern void arrayh5_typed_getrange(arrayh5_typed a, double *min, double *max);
 
 extern const char arrayh5_read_strerror[][100];
 extern int arrayh5_read(arrayh5 *a, const char *fname, const char *datapath,
@@ -48,14 +80,190 @@ extern int arrayh5_read(arrayh5 *a, const char *fname, const char *datapath,
 			int nslicedims,
 			const int *slicedim, const int *islice,
 			const int *center_slice);
+extern int arrayh5_read_transposed(arrayh5 *a, const char *fname,
+				   const char *datapath, char **dataname,
+				   int nslicedims, const int *slicedim,
+				   const int *islice, const int *center_slice);
+/* How the writing routines store a dataset; a NULL options pointer is
+   equivalent to all zeros, i.e. a contiguous, uncompressed dataset of
+   doubles.  Any filter implies chunking (automatic, with chunks of a
+   moderate size in every dimension, if chunk_rank is 0). */
+#define ARRAYH5_MAX_RANK 32 /* = H5S_MAX_RANK */
+typedef struct {
+     int chunk_rank;      /* rank of chunk (must match the dataset), or 0 */
+     int chunk[ARRAYH5_MAX_RANK]; /* chunk dimensions */
+     int deflate;         /* deflate (gzip) level 1-9, or 0 for none */
+     int shuffle;         /* byte-shuffle the data (to compress better) */
+     int szip;            /* szip pixels per block, or 0 for none */
+     int single_precision; /* store as 32-bit floats */
+} arrayh5_write_options;
+
 extern void arrayh5_write(arrayh5 a, char *filename, char *dataname,
-			  short append_data);
+			  short append_data,
+			  const arrayh5_write_options *opts);
+extern void arrayh5_write_transposed(arrayh5 a, char *filename,
+				     char *dataname, short append_data,
+				     const arrayh5_write_options *opts);
+
+/* An open dataset (and its file), which can be used to read many
+   slices without re-opening and searching the file each time. */
+typedef struct arrayh5_handle_s arrayh5_handle;
+
+extern int arrayh5_open(arrayh5_handle **h, const char *fname,
+			const char *datapath);
+extern void arrayh5_close(arrayh5_handle *h);
+extern int arrayh5_handle_rank(const arrayh5_handle *h);
+extern const int *arrayh5_handle_dims(const arrayh5_handle *h);
+extern const char *arrayh5_handle_name(const arrayh5_handle *h);
+extern arrayh5_type arrayh5_handle_type(const arrayh5_handle *h);
+extern int arrayh5_slice_dims(const arrayh5_handle *h,
+			      int nslicedims, const int *slicedim,
+			      const int *islice, const int *center_slice,
+			      int *rank, int *dims);
+extern int arrayh5_read_handle(arrayh5 *a, arrayh5_handle *h,
+			       int nslicedims, const int *slicedim,
+			       const int *islice, const int *center_slice);
+extern int arrayh5_read_transposed_handle(arrayh5 *a, arrayh5_handle *h,
+					  int nslicedims, const int *slicedim,
+					  const int *islice,
+					  const int *center_slice);
+
+/* Keep the file fname open until arrayh5_release_file, so that its
+   datasets are all opened (by arrayh5_open, arrayh5_read, ...) without
+   re-opening the file; the open handles of a file always share it.
+   Files that are held are closed again before being written. */
+extern int arrayh5_hold_file(const char *fname);
+extern void arrayh5_release_file(const char *fname);
+
+/* Find the datasets of fname whose paths match pattern, in which "*"
+   and "?" match any characters (or any one character) other than "/"
+   and "[...]" matches one of a set of characters; the paths are
+   relative to the root group (e.g. "g/ex" for "/g/ex" or "g/e?").
+   Returns an arrayh5_read_strerror index, and the number of datasets
+   and a newly allocated array of their newly allocated paths (in the
+   order of the file) in *n and *names. */
+extern int arrayh5_find_datasets(const char *fname, const char *pattern,
+				 char ***names, int *n);
+
+/* A reusable array, whose storage is kept between reads of slices of
+   the same (or smaller) size. */
+typedef struct {
+     arrayh5 a;
+     int max_rank, max_N;
+     double *work; /* scratch space for transposed reads */
+     int max_work;
+} arrayh5_buffer;
+
+extern void arrayh5_buffer_init(arrayh5_buffer *b);
+extern void arrayh5_buffer_destroy(arrayh5_buffer *b);
+extern int arrayh5_read_buffer(arrayh5_buffer *b, arrayh5_handle *h,
+			       int nslicedims, const int *slicedim,
+			       const int *islice, const int *center_slice);
+extern int arrayh5_read_transposed_buffer(arrayh5_buffer *b,
+					  arrayh5_handle *h,
+					  int nslicedims, const int *slicedim,
+					  const int *islice,
+					  const int *center_slice);
+
+extern int arrayh5_read_rows(arrayh5_handle *h,
+			     int nslicedims, const int *slicedim,
+			     const int *islice, const int *center_slice,
+			     int row0, int nrows, double *data);
+extern int arrayh5_read_transposed_rows(arrayh5_handle *h,
+					int nslicedims, const int *slicedim,
+					const int *islice,
+					const int *center_slice,
+					int row0, int nrows, double *data);
+extern int arrayh5_read_transposed_block(arrayh5_handle *h,
+					 int nslicedims, const int *slicedim,
+					 const int *islice,
+					 const int *center_slice,
+					 const int *bstart, const int *bstride,
+					 const int *bcount, double *data);
+extern int arrayh5_slice_range(arrayh5_handle *h,
+			       int nslicedims, const int *slicedim,
+			       const int *islice, const int *center_slice,
+			       double *min, double *max);
+extern int arrayh5_slice_chunk_rows(const arrayh5_handle *h,
+				    int nslicedims, const int *slicedim,
+				    const int *islice,
+				    const int *center_slice);
+extern arrayh5_handle *arrayh5_create_dataset(char *filename, char *dataname,
+					      int rank, const int *dims,
+					      short append_data,
+					      const arrayh5_write_options *opts);
+extern void arrayh5_write_rows(arrayh5_handle *h, int row0, int nrows,
+			       const double *data);
+extern arrayh5_handle *arrayh5_create_extendible(char *filename,
+						 char *dataname,
+						 int rank, const int *dims,
+						 short append_data,
+						 const arrayh5_write_options *opts);
+extern void arrayh5_append_rows(arrayh5_handle *h, int nrows,
+				const double *data);
+extern int arrayh5_rename_dataset(arrayh5_handle *h, const char *dataname);
+extern void arrayh5_discard(arrayh5_handle *h);
+extern int arrayh5_read_typed_handle(arrayh5_typed *a, arrayh5_handle *h,
+				     arrayh5_type type, int nslab,
+				     const int *start, const int *stride,
+				     const int *count);
+extern int arrayh5_read_typed(arrayh5_typed *a, const char *fname,
+			      const char *datapath, char **dataname,
+			      arrayh5_type type, int nslab,
+			      const int *start, const int *stride,
+			      const int *count);
+extern int arrayh5_read_typed_slice(arrayh5_typed *a, arrayh5_handle *h,
+				    arrayh5_type type, int nslicedims,
+				    const int *slicedim, const int *islice,
+				    const int *center_slice);
+extern void arrayh5_typed_transposed_rows(arrayh5_typed a, int row0,
+					  int nrows, double *data);
 
 int arrayh5_read_rank(const char *fname, const char *datapath, int *rank);
 
 #define NO_SLICE_DIM -1
 #define LAST_SLICE_DIM -2
 
+/* Lightweight instrumentation: once arrayh5_stats_init has enabled it
+   (if verbose, or if the H5UTILS_STATS environment variable is set),
+   the time and bytes of each stage of processing and the HDF5 I/O
+   counts are accumulated, and a summary is printed on exit.  Stages
+   not done by arrayh5 itself are timed by the callers, as in:
+	double t0 = arrayh5_stats_start();
+	...convert the data...
+	arrayh5_stats_stop(ARRAYH5_STAGE_CONVERT, t0, nbytes); */
+typedef enum {
+     ARRAYH5_STAGE_READ, ARRAYH5_STAGE_RANGE, ARRAYH5_STAGE_TRANSPOSE,
+     ARRAYH5_STAGE_CONVERT, ARRAYH5_STAGE_ENCODE, ARRAYH5_STAGE_WRITE,
+     ARRAYH5_NUM_STAGES
+} arrayh5_stage;
+
+extern int arrayh5_stats_enabled;
+extern void arrayh5_stats_init(const char *prog, int verbose);
+extern double arrayh5_stats_start(void);
+extern void arrayh5_stats_stop(arrayh5_stage stage, double t0,
+			       double bytes);
+extern void arrayh5_stats_add(arrayh5_stage stage, double seconds,
+			      double bytes);
+
+/* MPI (if h5utils was configured --with-mpi): a program that calls
+   arrayh5_mpi_init (first thing in main) may divide its work among the
+   processes of an MPI job.  Each process then reads the input files
+   independently through MPI-IO, while the files written by
+   arrayh5_create_dataset and arrayh5_write are opened by all of the
+   processes together, which must make the same sequence of calls:
+   each process writes its own rows, but every process must call
+   arrayh5_write_rows the same number of times (with nrows = 0 if it
+   has nothing more to write).  arrayh5_write writes the array of
+   process 0.  arrayh5_mpi_range combines the ranges found by each
+   process (those with no data pass min = HUGE_VAL, max = -HUGE_VAL).
+   Without MPI, or with a single process, the rank is 0, the size is 1,
+   and everything is as usual. */
+extern void arrayh5_mpi_init(int *argc, char ***argv);
+extern int arrayh5_mpi_rank(void);
+extern int arrayh5_mpi_size(void);
+extern void arrayh5_mpi_range(double *min, double *max);
+
 /***********************************************************************/
 
 #ifdef __cplusplus
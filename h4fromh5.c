@@ -95,6 +95,7 @@ int main(int argc, char **argv)
 	  fprintf(stderr, "h4fromh5: only one .h5 file can be used with -o\n");
 	  return EXIT_FAILURE;
      }
+     arrayh5_stats_init("h4fromh5", verbose);
 
      for (ifile = optind; ifile < argc; ++ifile) {
 	  char *h5_fname, *dname;
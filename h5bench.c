@@ -0,0 +1,502 @@
+/* Copyright (c) 1999-2017 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* h5bench: performance benchmarks of the h5utils library routines and
+   programs, on a synthetic dataset of configurable size and storage,
+   run by "make bench".  For comparability between benchmarks, the
+   MB/s figures are always in terms of the double-precision data
+   processed (8 bytes per element), not the size of the files. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "arrayh5.h"
+#include "copyright.h"
+#include "h5utils.h"
+#include "mathexpr.h"
+
+#define CHECK(cond, msg) { if (!(cond)) { fprintf(stderr, "h5bench error: %s\n", msg); exit(EXIT_FAILURE); } }
+
+#define DIMS_DEFAULT "128x128x128"
+#define DATA_NAME "data"
+#define MAX_SLICES 16 /* slices read per dimension by the "slice" test */
+#define WRITE_BYTES (8 * 1024 * 1024) /* rows are generated in blocks */
+#define MATH_EXPR "sqrt(abs(d1)) * sin(d1) + exp(-d1*d1) / (2 + cos(d1))"
+
+static const char *all_benchmarks[] = {
+     "write", "read", "slice", "transpose", "range", "math",
+     "h5totxt", "h5fromtxt", "h5tovtk", "h5topng", "h5math", NULL
+};
+
+void usage(FILE *f)
+{
+     fprintf(f, "Usage: h5bench [options] [<benchmarks>]\n"
+	     "Options:\n"
+	     "         -h : this help message\n"
+             "         -V : print version number and copyright\n"
+	     "  -n <size> : dimensions of the synthetic dataset [default: "
+	     DIMS_DEFAULT "]\n"
+	     WRITE_OPTIONS_USAGE
+	     "  -g <file> : just write the synthetic dataset to <file>\n"
+	     "     -r <n> : report the best of <n> repetitions [default: 3]\n"
+	     "   -B <dir> : run the h5utils programs in <dir> [default: .]\n"
+	     "   -D <dir> : put the scratch files in <dir> [default: .]\n"
+	     "         -k : keep the scratch files\n"
+	     "     -j <n> : use <n> threads where supported [default: 1]\n"
+	     "Benchmarks [default: all]:\n"
+	     "  write read slice transpose range math\n"
+	     "  h5totxt h5fromtxt h5tovtk h5topng h5math\n");
+}
+
+static volatile double sink; /* keeps results from being optimized away */
+
+static double wall_time(void)
+{
+     struct timeval tv;
+     gettimeofday(&tv, NULL);
+     return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void report(const char *name, double t, double N)
+{
+     if (t <= 0)
+	  t = 1e-9;
+     printf("%-12s %10.4f s %10.1f MB/s %12.4g elements/s\n",
+	    name, t, N * sizeof(double) / (t * 1048576.0), N / t);
+     fflush(stdout);
+}
+
+static char *concat_path(const char *dir, const char *name)
+{
+     char *s = (char *) malloc(strlen(dir) + strlen(name) + 2);
+     CHECK(s, "out of memory");
+     sprintf(s, "%s/%s", dir, name);
+     return s;
+}
+
+/* the synthetic data: smooth in every dimension, with a little noise
+   so that it is not too easy to compress */
+static void synthetic_rows(int rank, const int *dims, int row0, int nrows,
+			   double *data)
+{
+     int i, j, n = 1;
+
+     for (i = 1; i < rank; ++i)
+	  n *= dims[i];
+     for (i = 0; i < nrows; ++i) {
+	  double c = cos(0.05 * (row0 + i));
+	  for (j = 0; j < n; ++j) {
+	       int k = (row0 + i) * n + j;
+	       data[i * n + j] = c * sin(0.1 * (j % dims[rank - 1])
+					 + 0.01 * (j / dims[rank - 1]))
+		    + 1e-3 * ((k * 2654435761U) >> 22) / 1024.0;
+	  }
+     }
+}
+
+static void write_synthetic(char *fname, int rank, const int *dims,
+			    const arrayh5_write_options *opts)
+{
+     arrayh5_handle *h;
+     int i, n = 1, block, row0;
+     double *data;
+
+     for (i = 1; i < rank; ++i)
+	  n *= dims[i];
+     block = WRITE_BYTES / (sizeof(double) * n);
+     if (block < 1)
+	  block = 1;
+     if (block > dims[0])
+	  block = dims[0];
+     data = (double *) malloc(sizeof(double) * n * block);
+     CHECK(data, "out of memory");
+     h = arrayh5_create_dataset(fname, DATA_NAME, rank, dims, 0, opts);
+     for (row0 = 0; row0 < dims[0]; row0 += block) {
+	  int nrows = dims[0] - row0 < block ? dims[0] - row0 : block;
+	  synthetic_rows(rank, dims, row0, nrows, data);
+	  arrayh5_write_rows(h, row0, nrows, data);
+     }
+     arrayh5_close(h);
+     free(data);
+}
+
+/* time the shell command cmd (the best of nrep runs), returning a
+   negative number if it fails */
+static double time_command(const char *cmd, int nrep)
+{
+     double best = -1;
+     int rep;
+
+     for (rep = 0; rep < nrep; ++rep) {
+	  double t = wall_time();
+	  if (system(cmd) != 0) {
+	       fprintf(stderr, "h5bench: failed: %s\n", cmd);
+	       return -1;
+	  }
+	  t = wall_time() - t;
+	  if (best < 0 || t < best)
+	       best = t;
+     }
+     return best;
+}
+
+/* time the h5utils program name in bindir, with the arguments given
+   by the printf-style fmt, and report the result for N elements */
+static void run_tool(const char *name, const char *bindir, int nrep,
+		     double N, const char *fmt, ...)
+{
+     char *prog = concat_path(bindir, name), cmd[4096];
+     va_list ap;
+     int len;
+
+     if (access(prog, X_OK)) {
+	  printf("%-12s skipped (no %s)\n", name, prog);
+	  free(prog);
+	  return;
+     }
+     len = snprintf(cmd, sizeof(cmd), "'%s' ", prog);
+     va_start(ap, fmt);
+     len += vsnprintf(cmd + len, sizeof(cmd) - len, fmt, ap);
+     va_end(ap);
+     CHECK(len < (int) sizeof(cmd), "file names are too long");
+     {
+	  double t = time_command(cmd, nrep);
+	  if (t >= 0)
+	       report(name, t, N);
+	  else
+	       printf("%-12s failed\n", name);
+     }
+     free(prog);
+}
+
+int main(int argc, char **argv)
+{
+     extern char *optarg;
+     extern int optind;
+     int c, i, rep;
+     int rank = 0, dims[ARRAYH5_MAX_RANK], N = 1;
+     arrayh5_write_options wopts = {0};
+     char *gen_fname = NULL, *bindir = my_strdup("."), *dir = my_strdup(".");
+     char *fname, *txt_fname, *out_fname;
+     int nrep = 3, keep = 0, nthreads = 1;
+     const char **benchmarks = all_benchmarks;
+     arrayh5 a;
+     int err;
+
+     {
+	  arrayh5_write_options d = {0};
+	  CHECK(parse_write_option('c', DIMS_DEFAULT, &d), "bug");
+	  rank = d.chunk_rank;
+	  memcpy(dims, d.chunk, sizeof(int) * rank);
+     }
+
+     while ((c = getopt(argc, argv, "hVn:g:r:B:D:kj:" WRITE_OPTIONS)) != -1)
+	  switch (c) {
+	      case 'h':
+		   usage(stdout);
+		   return EXIT_SUCCESS;
+	      case 'V':
+		   printf("h5bench " PACKAGE_VERSION " by Steven G. Johnson\n"
+			  COPYRIGHT);
+		   return EXIT_SUCCESS;
+	      case 'n': {
+		   /* dataset dimensions are parsed like chunk sizes */
+		   arrayh5_write_options d = {0};
+		   CHECK(parse_write_option('c', optarg, &d),
+			 "invalid argument to -n; should be e.g. 64x64x64");
+		   rank = d.chunk_rank;
+		   memcpy(dims, d.chunk, sizeof(int) * rank);
+		   break;
+	      }
+	      case 'c': case 'G': case 's': case 'Z': case 'F':
+		   CHECK(parse_write_option(c, optarg, &wopts),
+			 "invalid output storage option");
+		   break;
+	      case 'g':
+		   free(gen_fname);
+		   gen_fname = my_strdup(optarg);
+		   break;
+	      case 'r':
+		   nrep = atoi(optarg);
+		   CHECK(nrep > 0, "invalid argument to -r");
+		   break;
+	      case 'B':
+		   free(bindir);
+		   bindir = my_strdup(optarg);
+		   break;
+	      case 'D':
+		   free(dir);
+		   dir = my_strdup(optarg);
+		   break;
+	      case 'k':
+		   keep = 1;
+		   break;
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
+	      default:
+		   fprintf(stderr, "Invalid argument -%c\n", c);
+		   usage(stderr);
+		   return EXIT_FAILURE;
+	  }
+     if (optind < argc)
+	  benchmarks = (const char **) argv + optind;
+     for (i = 0; benchmarks[i]; ++i) {
+	  int j;
+	  for (j = 0; all_benchmarks[j]; ++j)
+	       if (!strcmp(benchmarks[i], all_benchmarks[j]))
+		    break;
+	  if (!all_benchmarks[j]) {
+	       fprintf(stderr, "Unknown benchmark \"%s\"\n", benchmarks[i]);
+	       usage(stderr);
+	       return EXIT_FAILURE;
+	  }
+     }
+     for (i = 0; i < rank; ++i)
+	  N *= dims[i];
+
+     if (gen_fname) {
+	  write_synthetic(gen_fname, rank, dims, &wopts);
+	  free(gen_fname);
+	  return EXIT_SUCCESS;
+     }
+
+     fname = concat_path(dir, "h5bench.h5");
+     txt_fname = concat_path(dir, "h5bench.txt");
+     out_fname = concat_path(dir, "h5bench-out.h5");
+
+     printf("h5bench: %d", dims[0]);
+     for (i = 1; i < rank; ++i)
+	  printf("x%d", dims[i]);
+     printf(" dataset (%g MB of doubles), best of %d, %d thread%s\n",
+	    N * sizeof(double) / 1048576.0, nrep, nthreads,
+	    nthreads == 1 ? "" : "s");
+
+     /* the dataset is always written, since the others need it */
+     {
+	  double best = -1;
+	  for (rep = 0; rep < nrep; ++rep) {
+	       double t = wall_time();
+	       write_synthetic(fname, rank, dims, &wopts);
+	       t = wall_time() - t;
+	       if (best < 0 || t < best)
+		    best = t;
+	  }
+	  err = arrayh5_read(&a, fname, DATA_NAME, NULL, 0, NULL, NULL, NULL);
+	  CHECK(!err, arrayh5_read_strerror[err]);
+	  for (i = 0; benchmarks[i] && strcmp(benchmarks[i], "write"); ++i)
+	       ;
+	  if (benchmarks[i])
+	       report("write", best, N);
+     }
+
+     for (i = 0; benchmarks[i]; ++i) {
+	  const char *b = benchmarks[i];
+	  double best = -1;
+
+	  if (!strcmp(b, "read")) {
+	       for (rep = 0; rep < nrep; ++rep) {
+		    /* the data are summed so that a memory-mapped read
+		       is timed including the actual reading of the file */
+		    arrayh5 r;
+		    double sum = 0, t = wall_time();
+		    int k;
+		    err = arrayh5_read(&r, fname, DATA_NAME, NULL,
+				       0, NULL, NULL, NULL);
+		    CHECK(!err, arrayh5_read_strerror[err]);
+		    for (k = 0; k < r.N; ++k)
+			 sum += r.data[k];
+		    t = wall_time() - t;
+		    sink = sum;
+		    arrayh5_destroy(r);
+		    if (best < 0 || t < best)
+			 best = t;
+	       }
+	       report(b, best, N);
+	  }
+	  else if (!strcmp(b, "slice")) {
+	       /* read up to MAX_SLICES evenly spaced slices along each
+		  dimension in turn, through one open handle */
+	       arrayh5_handle *h;
+	       arrayh5_buffer buf;
+	       int dim;
+
+	       err = arrayh5_open(&h, fname, DATA_NAME);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       arrayh5_buffer_init(&buf);
+	       for (dim = 0; dim < rank && rank > 1; ++dim) {
+		    int nslices = dims[dim] < MAX_SLICES ? dims[dim]
+			 : MAX_SLICES, is, center = 0;
+		    char name[32];
+		    best = -1;
+		    for (rep = 0; rep < nrep; ++rep) {
+			 double t = wall_time();
+			 for (is = 0; is < nslices; ++is) {
+			      int islice = is * (dims[dim] / nslices);
+			      err = arrayh5_read_buffer(&buf, h, 1, &dim,
+							&islice, &center);
+			      CHECK(!err, arrayh5_read_strerror[err]);
+			 }
+			 t = wall_time() - t;
+			 if (best < 0 || t < best)
+			      best = t;
+		    }
+		    if (dim < 4)
+			 sprintf(name, "slice-%c", "xyzt"[dim]);
+		    else
+			 sprintf(name, "slice-%d", dim);
+		    report(name, best, (double) nslices * (N / dims[dim]));
+	       }
+	       arrayh5_buffer_destroy(&buf);
+	       arrayh5_close(h);
+	  }
+	  else if (!strcmp(b, "transpose")) {
+	       for (rep = 0; rep < nrep; ++rep) {
+		    arrayh5 t_a = arrayh5_clone(a);
+		    double t = wall_time();
+		    arrayh5_transpose(&t_a);
+		    t = wall_time() - t;
+		    arrayh5_destroy(t_a);
+		    if (best < 0 || t < best)
+			 best = t;
+	       }
+	       report(b, best, N);
+	  }
+	  else if (!strcmp(b, "range")) {
+	       for (rep = 0; rep < nrep; ++rep) {
+		    double min, max, t = wall_time();
+		    arrayh5_range(a.data, a.N, nthreads, &min, &max);
+		    t = wall_time() - t;
+		    if (best < 0 || t < best)
+			 best = t;
+	       }
+	       report(b, best, N);
+	  }
+	  else if (!strcmp(b, "math")) {
+	       /* h5math's evaluator, without the file I/O */
+	       char *vars[1];
+	       mathexpr *e;
+	       double *work, *result;
+	       const double *vals[1];
+
+	       vars[0] = (char *) "d1";
+	       e = mathexpr_create(MATH_EXPR, 1, vars);
+	       CHECK(e, "cannot compile the benchmark expression");
+	       work = (double *) malloc(sizeof(double)
+					* mathexpr_work_size(e));
+	       result = (double *) malloc(sizeof(double) * N);
+	       CHECK(work && result, "out of memory");
+	       vals[0] = a.data;
+	       for (rep = 0; rep < nrep; ++rep) {
+		    double t = wall_time();
+		    mathexpr_evaluate(e, N, vals, result, work);
+		    t = wall_time() - t;
+		    if (best < 0 || t < best)
+			 best = t;
+	       }
+	       free(result);
+	       free(work);
+	       mathexpr_destroy(e);
+	       report(b, best, N);
+	  }
+	  else if (!strcmp(b, "h5totxt"))
+	       run_tool(b, bindir, nrep, N, "-j %d '%s' > '%s'",
+			nthreads, fname, txt_fname);
+	  else if (!strcmp(b, "h5fromtxt")) {
+	       char size[ARRAYH5_MAX_RANK * 12] = "";
+	       int k;
+	       if (access(txt_fname, R_OK)) {
+		    /* the text input is produced by h5totxt, untimed */
+		    char *totxt = concat_path(bindir, "h5totxt");
+		    char *cmd = (char *) malloc(strlen(totxt) + strlen(fname)
+						+ strlen(txt_fname) + 16);
+		    CHECK(cmd, "out of memory");
+		    sprintf(cmd, "'%s' '%s' > '%s'", totxt, fname, txt_fname);
+		    time_command(cmd, 1);
+		    free(cmd);
+		    free(totxt);
+	       }
+	       for (k = 0; k < rank; ++k)
+		    sprintf(size + strlen(size), k ? "x%d" : "%d", dims[k]);
+	       unlink(out_fname);
+	       run_tool(b, bindir, nrep, N, "-j %d -n %s '%s' < '%s'",
+			nthreads, size, out_fname, txt_fname);
+	  }
+	  else if (!strcmp(b, "h5tovtk")) {
+	       char *vtk_fname = concat_path(dir, "h5bench.vtk");
+	       run_tool(b, bindir, nrep, N, "-j %d -o '%s' '%s'",
+			nthreads, vtk_fname, fname);
+	       if (!keep)
+		    unlink(vtk_fname);
+	       free(vtk_fname);
+	  }
+	  else if (!strcmp(b, "h5topng")) {
+	       /* a single slice through the middle (as h5topng renders
+		  two-dimensional data), which is mostly writepng */
+	       char *png_fname = concat_path(dir, "h5bench.png");
+	       char slice[64] = "";
+	       double Nslice = N;
+	       if (rank > 2) {
+		    sprintf(slice, "-z %d", dims[2] / 2);
+		    Nslice /= dims[2];
+	       }
+	       if (rank > 3) {
+		    strcat(slice, " -t 0");
+		    Nslice /= dims[3];
+	       }
+	       if (rank > 4)
+		    printf("%-12s skipped (rank > 4)\n", b);
+	       else
+		    run_tool(b, bindir, nrep, Nslice, "-j %d %s -o '%s' '%s'",
+			     nthreads, slice, png_fname, fname);
+	       if (!keep)
+		    unlink(png_fname);
+	       free(png_fname);
+	  }
+	  else if (!strcmp(b, "h5math")) {
+	       unlink(out_fname);
+	       run_tool(b, bindir, nrep, N, "-j %d -e '" MATH_EXPR
+			"' '%s' '%s'", nthreads, out_fname, fname);
+	  }
+     }
+
+     if (!keep) {
+	  unlink(fname);
+	  unlink(txt_fname);
+	  unlink(out_fname);
+     }
+     arrayh5_destroy(a);
+     free(out_fname);
+     free(txt_fname);
+     free(fname);
+     free(dir);
+     free(bindir);
+     return EXIT_SUCCESS;
+}
@@ -32,7 +32,7 @@
 #include "copyright.h"
 #include "h5utils.h"
 
-#define CHECK(cond, msg) { if (!(cond)) { fprintf(stderr, "h5totxt error: %s\n", msg); exit(EXIT_FAILURE); } }
+#define CHECK(cond, msg) { if (!(cond)) { fprintf(stderr, "h5cyl2cart error: %s\n", msg); exit(EXIT_FAILURE); } }
 
 void usage(FILE *f)
 {
@@ -43,55 +43,84 @@ void usage(FILE *f)
 	     "         -v : verbose output\n"
 	     "     -m <m> : for complex data, multiply by exp(i m phi)\n"
 	     "  -o <file> : output to <file> (first input file only)\n"
-	     "     -r <r> : radial coordinate starts at <r> (default: 0)\n"
 	     "  -d <name> : use dataset <name> in the input files (default: first dataset)\n"
 	     "              -- you can also specify a dataset via <filename>:<name>\n"
 	     "              -- nonzero <m> implies complex data <name>.[ri]\n"
 	     "                 or alternatively -i can be used\n"
 	     "  -i <name> : imaginary dataset name\n"
+	     "     -j <n> : convert the data using <n> threads in parallel [default: 1]\n"
+	     WRITE_OPTIONS_USAGE
 	  );
 }
 
-void cyl2cart(arrayh5 ar, arrayh5 ai, int m, arrayh5 *cr_, arrayh5 *ci_)
+/* Interpolate the cylindrical data ar + i*ai, a function of (r,z)
+   with z varying fastest (i.e. read transposed), onto a Cartesian
+   (x,y,z) grid with the same spacing, multiplied by exp(i m phi).  If
+   ai is NULL, the data are real and only *cr_ is computed.  Since r,
+   phi, and the phase depend only on (x,y), they are computed once for
+   each (x,y) column of z values, which are contiguous in both the
+   input and the output. */
+static void cyl2cart(arrayh5 ar, const arrayh5 *ai, int m, int nthreads,
+		     arrayh5 *cr_, arrayh5 *ci_)
 {
      arrayh5 cr, ci;
-     int nx,ny,nz,nr, dims[3], ix,iy,iz;
-     double *dcr, *dci, *dar, *dai;
+     int nx,ny,nz,nr, dims[3], ixy;
+     double *dcr, *dci = NULL, *dar, *dai = NULL, t0;
      
-     nz = ar.rank < 1 ? 1 : ar.dims[0];
-     nr = ar.rank < 2 ? 1 : ar.dims[1];
+     nr = ar.rank < 2 ? 1 : ar.dims[0];
+     nz = ar.rank < 1 ? 1 : ar.dims[ar.rank - 1];
      nx = ny = 2*nr - 1;
      dims[0] = nx; dims[1] = ny; dims[2] = nz;
      *cr_ = cr = arrayh5_create(3, dims);
-     *ci_ = ci = arrayh5_create(3, dims);
-     dcr = cr.data; dci = ci.data;
-     dar = ar.data; dai = ai.data;
-
-     for (ix = 0; ix < nx; ++ix)
-      for (iy = 0; iy < ny; ++iy) 
-       for (iz = 0; iz < nz; ++iz) {
-	    double x = ix - (nr - 1);
-	    double y = iy - (nr - 1);
-	    double p = atan2(y, x), r = sqrt(x*x + y*y);
-	    int ir = (int) r; /* round down */
-	    double cm = cos(m*p), sm = sin(m*p);
-	    double re, im;
-	    if (ir == nr-1 && r-ir < 1e-8) {
-		 re = dar[ir*nz+iz];
-		 im = dai[ir*nz+iz];
-	    }
-	    else if (ir >= nr-1) { /* r is outside the a array */
-		 re = im = 0.0;
-	    }
-	    else { /* linearly interpolate between ir and ir+1 */
-		 double dr = r - ir;
-		 re = dar[ir+nr*iz]*(1-dr) + dr*dar[(ir+1)+nr*iz];
-		 im = dai[ir+nr*iz]*(1-dr) + dr*dai[(ir+1)+nr*iz];
-	    }
-	    /* (re + i*im) * (cm + i*sm) */
-	    dcr[(ix*ny+iy)*nz+iz] = re*cm - im*sm;
-	    dci[(ix*ny+iy)*nz+iz] = re*sm + im*cm;
-       }
+     dcr = cr.data;
+     dar = ar.data;
+     if (ai) {
+	  *ci_ = ci = arrayh5_create(3, dims);
+	  dci = ci.data;
+	  dai = ai->data;
+     }
+
+     t0 = arrayh5_stats_start();
+#ifdef _OPENMP
+#    pragma omp parallel for num_threads(nthreads) schedule(static)
+#endif
+     for (ixy = 0; ixy < nx * ny; ++ixy) {
+	  double x = ixy / ny - (nr - 1);
+	  double y = ixy % ny - (nr - 1);
+	  double p = atan2(y, x), r = sqrt(x*x + y*y);
+	  int ir = (int) r; /* round down */
+	  double cm = cos(m*p), sm = sin(m*p);
+	  double dr = r - ir;
+	  int ir1 = ir + 1, iz;
+	  double *ocr = dcr + ixy * nz, *oci = dci ? dci + ixy * nz : NULL;
+
+	  if (ir == nr-1 && dr < 1e-8) { /* r is on the edge of the array */
+	       dr = 0;
+	       ir1 = ir;
+	  }
+	  else if (ir >= nr-1) { /* r is outside the a array */
+	       for (iz = 0; iz < nz; ++iz) {
+		    ocr[iz] = 0.0;
+		    if (oci) oci[iz] = 0.0;
+	       }
+	       continue;
+	  }
+
+	  /* linearly interpolate between ir and ir+1 */
+	  if (!ai)
+	       for (iz = 0; iz < nz; ++iz)
+		    ocr[iz] = (dar[ir*nz+iz]*(1-dr) + dr*dar[ir1*nz+iz]) * cm;
+	  else
+	       for (iz = 0; iz < nz; ++iz) {
+		    double re = dar[ir*nz+iz]*(1-dr) + dr*dar[ir1*nz+iz];
+		    double im = dai[ir*nz+iz]*(1-dr) + dr*dai[ir1*nz+iz];
+		    /* (re + i*im) * (cm + i*sm) */
+		    ocr[iz] = re*cm - im*sm;
+		    oci[iz] = re*sm + im*cm;
+	       }
+     }
+     arrayh5_stats_stop(ARRAYH5_STAGE_CONVERT, t0, sizeof(double)
+			* (ai ? 2.0 : 1.0) * nx * ny * nz);
 }
 
 
@@ -106,8 +135,10 @@ int main(int argc, char **argv)
      int verbose = 0;
      int m = 0;
      int ifile;
+     int nthreads = 1;
+     arrayh5_write_options wopts = {0};
 
-     while ((c = getopt(argc, argv, "hVvm:o:r:d:i:")) != -1)
+     while ((c = getopt(argc, argv, "hVvm:o:d:i:j:" WRITE_OPTIONS)) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -120,6 +151,10 @@ int main(int argc, char **argv)
 	      case 'v':
 		   verbose = 1;
 		   break;
+	      case 'c': case 'G': case 's': case 'Z': case 'F':
+		   CHECK(parse_write_option(c, optarg, &wopts),
+			 "invalid output storage option");
+		   break;
 	      case 'm':
 		   m = atoi(optarg);
 		   break;
@@ -135,6 +170,10 @@ int main(int argc, char **argv)
 		   free(data_name_i);
 		   data_name_i = my_strdup(optarg);
 		   break;		   
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
 	      default:
 		   fprintf(stderr, "Invalid argument -%c\n", c);
 		   usage(stderr);
@@ -145,6 +184,12 @@ int main(int argc, char **argv)
 	  return EXIT_FAILURE;
      }
 
+#ifndef _OPENMP
+     if (nthreads > 1)
+	  fprintf(stderr, "h5cyl2cart: compiled without OpenMP; ignoring -j\n");
+#endif
+     arrayh5_stats_init("h5cyl2cart", verbose);
+
      for (ifile = optind; ifile < argc; ++ifile) {
 	  short append_data = 0;
 	  char *dname, *dnamei, *h5_fname;
@@ -173,8 +218,9 @@ int main(int argc, char **argv)
 	  if (verbose)
 	       printf("reading from %s in \"%s\"\n", dname?dname:"?",h5_fname);
 	  
-	  err = arrayh5_read(&ar, h5_fname, dname, &dnamei,
-			     0, NULL, NULL, NULL);
+	  /* read the data transposed, so that z varies fastest */
+	  err = arrayh5_read_transposed(&ar, h5_fname, dname, &dnamei,
+					0, NULL, NULL, NULL);
 	  if (!dname) {
 	       dname = strdup(dnamei);
 	       if (verbose) printf("found dataset %s\n", dname);
@@ -189,9 +235,7 @@ int main(int argc, char **argv)
 	  CHECK(!err, arrayh5_read_strerror[err]);
 	  CHECK(ar.rank <= 2, "input data must be < 3 dimensional");
 
-	  if (m == 0)
-	       ai = arrayh5_clone(ar);
-	  else {
+	  if (m != 0) {
 	       if (data_name_i) {
 		    free(dnamei);
 		    dnamei = strdup(data_name_i);
@@ -207,8 +251,8 @@ int main(int argc, char **argv)
 	       if (verbose)
 		    printf("reading from %s in \"%s\"\n", dnamei, h5_fname);
 	  
-	       err = arrayh5_read(&ai, h5_fname, dnamei, NULL,
-				  0, NULL, NULL, NULL);
+	       err = arrayh5_read_transposed(&ai, h5_fname, dnamei, NULL,
+					     0, NULL, NULL, NULL);
 	       CHECK(!err, arrayh5_read_strerror[err]);
 	       CHECK(arrayh5_conformant(ar, ai),
 		     "real and imaginary data sets must be the same size");
@@ -229,19 +273,21 @@ int main(int argc, char **argv)
 	       free(dnamei); dnamei = tmp;
 	  }
 
-	  cyl2cart(ar, ai, m, &cr, &ci);
+	  cyl2cart(ar, m != 0 ? &ai : NULL, m, nthreads, &cr, &ci);
 
 	  if (verbose)
 	       printf("writing %s from %dx%d input data.\n",
 		      out_fname, (cr.dims[0]+1)/2, cr.dims[2]);
 
-	  arrayh5_write(cr, out_fname, dname, append_data);
-	  if (m != 0) arrayh5_write(ci, out_fname, dnamei, 1);
+	  arrayh5_write(cr, out_fname, dname, append_data, &wopts);
+	  if (m != 0) arrayh5_write(ci, out_fname, dnamei, 1, &wopts);
 
 	  arrayh5_destroy(ar);
-	  arrayh5_destroy(ai);
 	  arrayh5_destroy(cr);
-	  arrayh5_destroy(ci);
+	  if (m != 0) {
+	       arrayh5_destroy(ai);
+	       arrayh5_destroy(ci);
+	  }
 	  free(h5_fname);
 	  free(out_fname); out_fname = NULL;
 	  free(dname); free(dnamei);
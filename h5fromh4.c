@@ -45,6 +45,7 @@ void usage(FILE *f)
              "         -a : append to existing hdf5 file\n"
 	     "  -d <name> : use dataset <name> in the output file (default: \"data\")\n"
 	     "              -- you can also specify a dataset via <file>:<name>\n"
+	     WRITE_OPTIONS_USAGE
 	  );
 }
 
@@ -58,8 +59,9 @@ int main(int argc, char **argv)
      int ifile;
      int verbose = 0;
      int append = 0;
+     arrayh5_write_options wopts = {0};
 
-     while ((c = getopt(argc, argv, "hd:vo:aV")) != -1)
+     while ((c = getopt(argc, argv, "hd:vo:aV" WRITE_OPTIONS)) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -74,6 +76,10 @@ int main(int argc, char **argv)
 	      case 'a':
 		   append = 1;
 		   break;
+	      case 'c': case 'G': case 's': case 'Z': case 'F':
+		   CHECK(parse_write_option(c, optarg, &wopts),
+			 "invalid output storage option");
+		   break;
 	      case 'd':
 		   free(data_name);
 		   data_name = my_strdup(optarg);
@@ -95,6 +101,7 @@ int main(int argc, char **argv)
 	  usage(stderr);
 	  return EXIT_FAILURE;
      }
+     arrayh5_stats_init("h5fromh4", verbose);
 
      for (ifile = optind; ifile < argc; ++ifile) {
 	  char *h4_fname = argv[ifile];
@@ -161,7 +168,7 @@ int main(int argc, char **argv)
 	  }
 
 	  arrayh5_write(a, cur_h5_fname, dname, 
-			append || (h5_fname && ifile > optind));
+			append || (h5_fname && ifile > optind), &wopts);
 	  arrayh5_destroy(a);
 
 	  if (h5_fname != cur_h5_fname)
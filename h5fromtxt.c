@@ -26,6 +26,8 @@
 #include <ctype.h>
 
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "arrayh5.h"
@@ -46,29 +48,325 @@ void usage(FILE *f)
 	     "         -T : transpose the data [default: no]\n"
 	     "  -d <name> : use dataset <name> in the output file (default: \"data\")\n"
 	     "              -- you can also specify a dataset via <filename>:<name>\n"
+	     "     -j <n> : parse the input using <n> threads in parallel [default: 1]\n"
+	     WRITE_OPTIONS_USAGE
 	  );
 }
 
 #define MAX_RANK 10
 
+/***********************************************************************/
+/* Bulk text parsing.  Rather than calling scanf once per number, we
+   read the input in large blocks, cut at newline boundaries so that
+   no number straddles two blocks, and tokenize each block in memory,
+   counting rows and columns as we go.  The rules for what separates
+   the numbers and the rows are the same as those of the original
+   getc/scanf loop.
+
+   Since a block boundary is always a row boundary, a block can also
+   be cut (at newlines) into segments that are parsed independently
+   by different threads: each segment contains only whole rows, and
+   the segments' row/column counts and errors are then combined in
+   order, as if the block had been parsed sequentially. */
+
+#define TXT_BUFSIZE (1<<20) /* input block size per thread */
+#define TXT_MIN_SEGMENT (1<<16) /* don't split blocks more finely */
+#define TXT_STREAM_BYTES (1<<26) /* without -n, buffer this much data
+				    before writing it as it is read */
+
+typedef struct {
+     double *data;
+     int idata0, idata, N; /* numbers in data before/after, allocated */
+     int fixed_size; /* whether the dims were given (no column checks) */
+     int nrows, ncols, first_ncols, cur_ncols; /* rows completed here */
+     int started; /* whether we have reached the first number */
+     int newline; /* whether a newline followed the last number */
+     const char *err; /* first error encountered, if any */
+} txt_parser;
+
+/* characters that can start a number after the first one */
+#define NUMBER_START(c) (isdigit(c) || (c) == '.' || (c) == '-' || (c) == '+')
+
+/* powers of ten that are exactly representable as doubles */
+static const double exact_pow10[] = {
+     1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_MANTISSA 9007199254740992.0 /* 2^53 */
+#define MAX_MANTISSA_DIGITS 19 /* digits that fit in an unsigned long long */
+
+/* Parse a number starting at s, returning a pointer to the character
+   after it, or NULL if there is no number there.  Simple decimal
+   numbers whose mantissa and power of ten are both exactly
+   representable are converted with a single (correctly rounded)
+   floating-point operation; anything else (long mantissas, large
+   exponents, hex, inf/nan, ...) is handed to strtod, so the result is
+   the same as scanf's either way.  s must be terminated by a
+   character that cannot be part of a number. */
+static const char *parse_number(const char *s, double *x)
+{
+     const char *p = s;
+     unsigned long long m = 0;
+     int ndigits = 0, e = 0, neg = 0;
+     char *end;
+
+     if (*p == '-' || *p == '+')
+	  neg = *p++ == '-';
+     if (!(isdigit(*p) || (*p == '.' && isdigit(p[1]))))
+	  goto slow;
+     while (*p == '0')
+	  ++p;
+     for (; isdigit(*p); ++p) {
+	  if (++ndigits > MAX_MANTISSA_DIGITS)
+	       goto slow;
+	  m = m * 10 + (*p - '0');
+     }
+     if (*p == '.')
+	  for (++p; isdigit(*p); ++p) {
+	       if (m == 0 && *p == '0') { /* leading zero: not significant */
+		    --e;
+		    continue;
+	       }
+	       if (++ndigits > MAX_MANTISSA_DIGITS)
+		    goto slow;
+	       m = m * 10 + (*p - '0');
+	       --e;
+	  }
+     if (*p == 'e' || *p == 'E') {
+	  const char *q = p + 1;
+	  int eneg = 0, ex = 0;
+	  if (*q == '-' || *q == '+')
+	       eneg = *q++ == '-';
+	  if (isdigit(*q)) {
+	       for (; isdigit(*q); ++q)
+		    if (ex < 10000)
+			 ex = ex * 10 + (*q - '0');
+	       e += eneg ? -ex : ex;
+	       p = q;
+	  }
+     }
+     if (isalnum(*p) || *p == '.' || (double) m > MAX_EXACT_MANTISSA)
+	  goto slow;
+     if (m == 0)
+	  *x = 0.0;
+     else if (e == 0)
+	  *x = (double) m;
+     else if (e > 0 && e <= MAX_EXACT_POW10)
+	  *x = (double) m * exact_pow10[e];
+     else if (e < 0 && e >= -MAX_EXACT_POW10)
+	  *x = (double) m / exact_pow10[-e];
+     else
+	  goto slow;
+     if (neg)
+	  *x = -*x;
+     return p;
+
+ slow:
+     *x = strtod(s, &end);
+     return end == s ? NULL : end;
+}
+
+static void end_row(txt_parser *p)
+{
+     ++p->nrows;
+     if (!p->fixed_size && p->ncols >= 0 && p->cur_ncols != p->ncols)
+	  p->err = "the number of input columns is not constant.";
+     if (p->first_ncols < 0)
+	  p->first_ncols = p->cur_ncols;
+     p->ncols = p->cur_ncols;
+     p->cur_ncols = 0;
+}
+
+/* Parse the numbers in [s, end), where *end is a character that
+   cannot be part of a number (a newline or the terminating NUL).
+   The last row is ended at end, which must be a row boundary. */
+static void parse_block(txt_parser *p, const char *s, const char *end)
+{
+     while (s < end) {
+	  if (!p->started) {
+	       /* eat leading spaces; the first number is parsed
+		  whatever it begins with */
+	       while (s < end && isspace((unsigned char) *s))
+		    ++s;
+	       if (s == end)
+		    break;
+	       p->started = 1;
+	  }
+	  else {
+	       /* eat characters until the next number: */
+	       while (s < end && !NUMBER_START(*s)) {
+		    if (*s == '\n')
+			 p->newline = 1;
+		    ++s;
+	       }
+	       if (s == end)
+		    break;
+	       if (p->newline && p->cur_ncols > 0) {
+		    end_row(p);
+		    if (p->err)
+			 return;
+	       }
+	       p->newline = 0;
+	  }
+
+	  /* increase the size of the data array, if necessary */
+	  if (p->idata >= p->N) {
+	       p->N = p->N > 0 ? p->N * 2 : 1024;
+	       p->data = (double *) realloc(p->data, sizeof(double) * p->N);
+	       CHECK(p->data, "out of memory");
+	  }
+
+	  s = parse_number(s, &p->data[p->idata]);
+	  if (!s) {
+	       p->err = "error reading numeric input";
+	       return;
+	  }
+	  ++p->idata;
+	  ++p->cur_ncols;
+     }
+     if (p->cur_ncols > 0)
+	  end_row(p);
+}
+
+/* Parse [s, end) as nseg segments, cut at newlines, in parallel,
+   returning the number of segments actually used.  The numbers of
+   segment 0 are appended to its existing data, and those of the other
+   segments are stored from the start of their data.  first is
+   whether s is the first non-space character of the input. */
+static int parse_segments(txt_parser *seg, int nseg, int nthreads,
+			  const char *s, const char *end, int first)
+{
+     const char **cut;
+     int i;
+
+     if (nseg > (end - s) / TXT_MIN_SEGMENT)
+	  nseg = (end - s) / TXT_MIN_SEGMENT;
+     if (nseg < 1)
+	  nseg = 1;
+     cut = (const char **) malloc(sizeof(const char *) * (nseg + 1));
+     CHECK(cut, "out of memory");
+     cut[0] = s;
+     for (i = 1; i < nseg; ++i) {
+	  const char *q = s + (end - s) / nseg * i;
+	  if (q <= cut[i-1])
+	       q = cut[i-1] + 1;
+	  while (q < end && q[-1] != '\n')
+	       ++q;
+	  cut[i] = q;
+     }
+     cut[nseg] = end;
+
+     for (i = 0; i < nseg; ++i) {
+	  seg[i].idata0 = seg[i].idata = i == 0 ? seg[0].idata : 0;
+	  seg[i].nrows = seg[i].cur_ncols = 0;
+	  seg[i].ncols = seg[i].first_ncols = -1;
+	  seg[i].started = !(first && i == 0);
+	  seg[i].newline = 0;
+	  seg[i].err = NULL;
+     }
+
+#ifdef _OPENMP
+#    pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+#endif
+     for (i = 0; i < nseg; ++i)
+	  parse_block(&seg[i], cut[i], cut[i+1]);
+
+     free(cut);
+     return nseg;
+}
+
+/***********************************************************************/
+/* Rows that are written as they are read, before the whole input has
+   been read and checked, go to a temporary file (or, with -a, a
+   temporary dataset of the output file) that replaces the output only
+   once everything has succeeded, and is removed if we exit with an
+   error, so that a bad input leaves any existing output untouched. */
+
+static arrayh5_handle *partial_h = NULL;
+static char *partial_fname = NULL; /* the temporary file, if any */
+
+static void remove_partial_output(void)
+{
+     arrayh5_discard(partial_h);
+     partial_h = NULL;
+     if (partial_fname) {
+	  remove(partial_fname);
+	  free(partial_fname);
+	  partial_fname = NULL;
+     }
+}
+
+static arrayh5_handle *create_partial(char *fname, char *dname,
+				      int rank, const int *dims,
+				      short append, int extendible,
+				      const arrayh5_write_options *opts)
+{
+     char *tmp = (char *) malloc(strlen(append ? dname : fname) + 32);
+     CHECK(tmp, "out of memory");
+     sprintf(tmp, "%s.tmp%ld", append ? dname : fname, (long) getpid());
+     if (!append)
+	  partial_fname = tmp;
+     if (extendible)
+	  partial_h = arrayh5_create_extendible(append ? fname : tmp,
+					        append ? tmp : dname,
+					        rank, dims, append, opts);
+     else
+	  partial_h = arrayh5_create_dataset(append ? fname : tmp,
+					     append ? tmp : dname,
+					     rank, dims, append, opts);
+     if (append)
+	  free(tmp);
+     /* after HDF5 is initialized, so that this runs before it exits */
+     atexit(remove_partial_output);
+     return partial_h;
+}
+
+/* replace the output by the (completed) partial output */
+static void finish_partial(char *fname, char *dname)
+{
+     struct stat st;
+
+     if (!partial_fname)
+	  CHECK(arrayh5_rename_dataset(partial_h, dname),
+		"error renaming temporary output dataset");
+     arrayh5_close(partial_h);
+     partial_h = NULL;
+     if (partial_fname) {
+	  if (!stat(fname, &st)) /* keep the permissions of the old file */
+	       chmod(partial_fname, st.st_mode & 07777);
+	  CHECK(!rename(partial_fname, fname),
+		"error replacing output file");
+	  free(partial_fname);
+	  partial_fname = NULL;
+     }
+}
+
+/***********************************************************************/
+
 int main(int argc, char **argv)
 {
-     arrayh5 a;
      char *dname, *h5_fname;
      char *data_name = NULL;
      extern char *optarg;
      extern int optind;
      int c;
-     double *data;
-     int idata = 0;
-     int rank = -1, dims[MAX_RANK], N = 1, nrows = 0;
-     int ncols = -1, cur_ncols = 0;
-     int read_newline = 0;
+     int i, rank = -1, dims[MAX_RANK], N = 1;
+     int nthreads = 1, nseg, fixed_size;
+     txt_parser *seg;
+     char *buf;
+     size_t bufsize, len = 0;
+     int started = 0, nread = 0, nrows = 0, ncols = -1;
+     int rowsize = 0, write_rows = 1, nrows_written = 0, extendible = 0;
+     arrayh5_handle *h = NULL;
+     double data_min = 0, data_max = 0;
      int verbose = 0;
      int transpose = 0;
      int append = 0;
+     arrayh5_write_options wopts = {0};
 
-     while ((c = getopt(argc, argv, "hn:d:vTaV")) != -1)
+     while ((c = getopt(argc, argv, "hn:d:vTaVj:" WRITE_OPTIONS)) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -90,6 +388,14 @@ int main(int argc, char **argv)
 		   free(data_name);
 		   data_name = my_strdup(optarg);
 		   break;		   
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
+	      case 'c': case 'G': case 's': case 'Z': case 'F':
+		   CHECK(parse_write_option(c, optarg, &wopts),
+			 "invalid output storage option");
+		   break;
 	      case 'n':
 	      {
 		   int pos = 0;
@@ -122,72 +428,178 @@ int main(int argc, char **argv)
 	  return EXIT_FAILURE;
      }
 
+#ifndef _OPENMP
+     if (nthreads > 1)
+	  fprintf(stderr, "h5fromtxt: compiled without OpenMP; ignoring -j\n");
+#endif
+     arrayh5_stats_init("h5fromtxt", verbose);
+
      h5_fname = split_fname(argv[optind], &dname);
      if (!dname[0])
 	  dname = data_name;
      if (!dname)
 	  dname = my_strdup("data");
 
-     data = (double *) malloc(sizeof(double) * N);
-     CHECK(data, "out of memory");
+     fixed_size = rank >= 0;
+     nseg = nthreads;
+     seg = (txt_parser *) malloc(sizeof(txt_parser) * nseg);
+     CHECK(seg, "out of memory");
+     for (i = 0; i < nseg; ++i) {
+	  seg[i].data = NULL;
+	  seg[i].idata = seg[i].N = 0;
+	  seg[i].fixed_size = fixed_size;
+     }
+     if (fixed_size && transpose) {
+	  /* the whole array is needed at once; we know how big it is */
+	  seg[0].N = N > 0 ? N : 1;
+	  seg[0].data = (double *) malloc(sizeof(double) * seg[0].N);
+	  CHECK(seg[0].data, "out of memory");
+     }
+     if (fixed_size && N > 0)
+	  rowsize = N / dims[0];
 
-     while (!feof(stdin)) {
-	  read_newline = 0;
+     bufsize = TXT_BUFSIZE * nthreads;
+     buf = (char *) malloc(bufsize + 1);
+     CHECK(buf, "out of memory");
 
-	  /* eat leading spaces */
-	  while (isspace(c = getc(stdin)));
-	  ungetc(c, stdin);
-	  if (c == EOF)
-	       break;
+     /* Read blocks of the input.  The numbers parsed from each block
+	are appended to seg[0].data, whose whole rows (of the first
+	output dimension) are then written out immediately, unless we
+	are transposing or don't yet know the dimensions of the data. */
+     for (;;) {
+	  size_t nblock, start = 0;
+	  int eof, first = 0, nused, idata_old = seg[0].idata;
+	  double t0 = arrayh5_stats_start();
+	  size_t nr = fread(buf + len, 1, bufsize - len, stdin);
 
-	  /* increase the size of the data array, if necessary */
-	  if (idata >= N) {
-	       CHECK(rank < 0, "more inputs in file than specified by -n");
-	       N *= 2;
-	       data = (double *) realloc(data, sizeof(double) * N);
-	       CHECK(data, "out of memory");
+	  arrayh5_stats_stop(ARRAYH5_STAGE_READ, t0, nr);
+	  len += nr;
+	  CHECK(!ferror(stdin), "error reading input");
+	  eof = feof(stdin);
+	  buf[len] = 0;
+
+	  if (eof)
+	       nblock = len;
+	  else {
+	       for (nblock = len; nblock > 0 && buf[nblock-1] != '\n';
+		    --nblock)
+		    ;
+	       if (nblock == 0) { /* no newline yet: need a bigger buffer */
+		    bufsize *= 2;
+		    buf = (char *) realloc(buf, bufsize + 1);
+		    CHECK(buf, "out of memory");
+		    continue;
+	       }
+	  }
+
+	  if (!started) {
+	       while (start < nblock && isspace((unsigned char) buf[start]))
+		    ++start;
+	       first = started = start < nblock;
 	  }
+	  t0 = arrayh5_stats_start();
+	  nused = !started ? 0 : parse_segments(seg, nseg, nthreads,
+						buf + start, buf + nblock,
+						first);
+	  arrayh5_stats_stop(ARRAYH5_STAGE_CONVERT, t0, nblock - start);
 
-	  CHECK(scanf("%lg", &data[idata++]) == 1,
-		"error reading numeric input");
-
-	  ++cur_ncols;
-	  
-	  /* eat characters until the next number: */
-	  do { 
-	       c = getc(stdin);
-	       if (c == '\n')
-		    read_newline = 1;
-	  } while (!(isdigit(c) || c == '.' || c == '-' || c == '+'
-		     || c == EOF));
-	  ungetc(c, stdin);
-
-	  if (read_newline) {
-	       ++nrows;
-	       if (rank < 0) {  /* we're trying to guess the input dims */
-		    CHECK(ncols < 0 || cur_ncols == ncols,
+	  /* combine the segments, in order */
+	  for (i = 0; i < nused; ++i) {
+	       int n = seg[i].idata - seg[i].idata0;
+	       if (fixed_size) {
+		    CHECK(nread + n <= N && !(seg[i].err && nread + n == N),
+			  "more inputs in file than specified by -n");
+	       }
+	       else {
+		    CHECK(seg[i].nrows == 0 || ncols < 0
+			  || seg[i].first_ncols == ncols,
 			  "the number of input columns is not constant.");
 	       }
-	       ncols = cur_ncols;
-	       cur_ncols = 0;
+	       CHECK(!seg[i].err, seg[i].err);
+	       if (seg[i].nrows > 0)
+		    ncols = seg[i].ncols;
+	       nrows += seg[i].nrows;
+	       nread += n;
+	       if (i > 0) {
+		    if (seg[0].idata + n > seg[0].N) {
+			 seg[0].N = seg[0].idata + n;
+			 seg[0].data = (double *) realloc(seg[0].data,
+							  sizeof(double)
+							  * seg[0].N);
+			 CHECK(seg[0].data, "out of memory");
+		    }
+		    memcpy(seg[0].data + seg[0].idata, seg[i].data,
+			   sizeof(double) * n);
+		    seg[0].idata += n;
+	       }
+	  }
+
+	  if (verbose && seg[0].idata > idata_old) {
+	       double min1, max1;
+	       arrayh5_range(seg[0].data + idata_old,
+			     seg[0].idata - idata_old, nthreads,
+			     &min1, &max1);
+	       if (nread - seg[0].idata + idata_old == 0
+		   || min1 < data_min || data_min != data_min)
+		    data_min = min1;
+	       if (nread - seg[0].idata + idata_old == 0
+		   || max1 > data_max || data_max != data_max)
+		    data_max = max1;
 	  }
-     }
 
-     if (!read_newline) { /* don't require a newline on the last line */
-	  ++nrows;
-	  if (rank < 0) {  /* we're trying to guess the input dims */
-	       CHECK(ncols < 0 || cur_ncols == ncols,
-		     "the number of input columns is not constant.");
+	  /* once there are two rows, we know the shape of the data if
+	     we are guessing it, so that once there is too much of it to
+	     keep reading into memory, we can start appending rows to an
+	     extendible dataset.  (Smaller inputs are written at the end,
+	     to an ordinary contiguous dataset.) */
+	  if (rank < 0 && !transpose && !h && nrows >= 2
+	      && sizeof(double) * (double) seg[0].idata >= TXT_STREAM_BYTES) {
+	       rank = ncols == 1 ? 1 : 2;
+	       dims[0] = nrows;
+	       dims[1] = ncols;
+	       rowsize = ncols;
+	       extendible = 1;
+	       h = create_partial(h5_fname, dname, rank, dims, append, 1,
+				  &wopts);
+	       /* append whole chunks, so that HDF5 can write them directly */
+	       write_rows = arrayh5_slice_chunk_rows(h, 0, NULL, NULL, NULL);
+	  }
+	  if (!transpose && rowsize > 0
+	      && seg[0].idata >= rowsize * write_rows) {
+	       int nwrite = seg[0].idata / (rowsize * write_rows) * write_rows;
+	       if (extendible)
+		    arrayh5_append_rows(h, nwrite, seg[0].data);
+	       else {
+		    if (!h)
+			 h = create_partial(h5_fname, dname, rank, dims,
+					    append, 0, &wopts);
+		    arrayh5_write_rows(h, nrows_written, nwrite, seg[0].data);
+	       }
+	       nrows_written += nwrite;
+	       seg[0].idata -= nwrite * rowsize;
+	       memmove(seg[0].data, seg[0].data + nwrite * rowsize,
+		       sizeof(double) * seg[0].idata);
 	  }
+
+	  if (eof)
+	       break;
+	  memmove(buf, buf + nblock, len - nblock);
+	  len -= nblock;
      }
+     free(buf);
 
-     CHECK(idata > 0, "no inputs read");
+     CHECK(nread > 0, "no inputs read");
 
      if (verbose)
-	  printf("Read %d numbers in %d rows.\n", idata, nrows);
+	  printf("Read %d numbers in %d rows.\n", nread, nrows);
 
-     if (rank < 0) {
-	  N = idata;
+     if (extendible) {
+	  dims[0] = nrows;
+	  if (rank == 1)
+	       dims[0] = nread;
+     }
+     else if (rank < 0) {
+	  N = nread;
 	  CHECK(N % nrows == 0,
 		"each row must have an equal number of columns");
 	  if (nrows == 1 || nrows == N) {
@@ -201,30 +613,46 @@ int main(int argc, char **argv)
 	  }
      }
      else {
-	  CHECK(idata == N, "number of inputs does not match -n");
+	  CHECK(nread == N, "number of inputs does not match -n");
      }
 
-     a = arrayh5_create_withdata(rank, dims, data);
-
-     if (transpose)
-	  arrayh5_transpose(&a);
+     if (verbose)
+	  printf("data ranges from %g to %g.\n", data_min, data_max);
 
      if (verbose) {
-	  double a_min, a_max;
-	  arrayh5_getrange(a, &a_min, &a_max);
-	  printf("data ranges from %g to %g.\n", a_min, a_max);
+	  printf("Writing size %d", dims[transpose ? rank - 1 : 0]);
+	  for (i = 1; i < rank; ++i)
+	       printf("x%d", dims[transpose ? rank - 1 - i : i]);
+	  printf(" data to %s:%s\n", h5_fname, dname);
      }
 
-     if (verbose) {
-	  int i;
-	  printf("Writing size %d", a.dims[0]);
-	  for (i = 1; i < a.rank; ++i)
-	       printf("x%d", a.dims[i]);
-	  printf(" data to %s:%s\n", h5_fname, dname);
+     if (transpose) {
+	  /* transpose while writing, rather than making a transposed copy */
+	  arrayh5 a = arrayh5_create_withdata(rank, dims, seg[0].data);
+	  arrayh5_write_transposed(a, h5_fname, dname, append, &wopts);
+	  seg[0].data = NULL;
+	  arrayh5_destroy(a);
+     }
+     else {
+	  /* write whatever is left (everything, if it was too small
+	     to tell the shape until now) */
+	  if (!h)
+	       h = arrayh5_create_dataset(h5_fname, dname, rank, dims, append,
+					  &wopts);
+	  if (extendible)
+	       arrayh5_append_rows(h, dims[0] - nrows_written, seg[0].data);
+	  else if (seg[0].idata > 0)
+	       arrayh5_write_rows(h, nrows_written, dims[0] - nrows_written,
+				  seg[0].data);
+	  if (h == partial_h)
+	       finish_partial(h5_fname, dname);
+	  else
+	       arrayh5_close(h);
      }
 
-     arrayh5_write(a, h5_fname, dname, append);
-     arrayh5_destroy(a);
+     for (i = 0; i < nseg; ++i)
+	  free(seg[i].data);
+     free(seg);
 
      return EXIT_SUCCESS;
 }
@@ -26,11 +26,14 @@
 #include <ctype.h>
 
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "arrayh5.h"
 #include "copyright.h"
 #include "h5utils.h"
+#include "mathexpr.h"
 
 #include <matheval.h>
 
@@ -55,6 +58,8 @@ void usage(FILE *f)
 	     "    -t <it> : take t=<it> slice of data's last dimension\n"
 	     "         -0 : use dataset center as origin for -x/-y/-z\n"
 	     "     -r <r> : use resolution <r> for xyz coordinate units in expression\n"
+	     "     -j <n> : evaluate using <n> threads in parallel [default: 1]\n"
+	     WRITE_OPTIONS_USAGE
 	     "  -d <name> : use dataset <name> in the input/output files\n"
 	     "              [ default: first dataset/%s ]\n"
 	     "              -- you can also specify a dataset via <filename>:<name>\n",
@@ -64,9 +69,30 @@ void usage(FILE *f)
 
 #define MAX_RANK 10
 
+/* whether the files named a and b are the same file (which may be
+   named differently, e.g. "./foo.h5" and "foo.h5"); a file that
+   doesn't exist yet is not the same as any other */
+static int same_file(const char *a, const char *b)
+{
+     struct stat sa, sb;
+     if (!strcmp(a, b))
+	  return 1;
+     if (stat(a, &sa) || stat(b, &sb))
+	  return 0;
+     return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* the inputs and output are processed in blocks of rows (of their
+   first dimension) of about this many bytes in total */
+#define STREAM_BYTES (64 * 1024 * 1024)
+
 int main(int argc, char **argv)
 {
-     arrayh5 *a, ao;
+     arrayh5_handle **h, *ho;
+     int orank = 0, *odims = NULL, nrows, rowN, nbrows;
+     int row_lo, row_hi, rows_max, nsteps;
+     int in_place = 0;
+     double **din, *dout;
      int i, n;
      int rank = -1, dims[MAX_RANK];
      extern char *optarg;
@@ -76,19 +102,23 @@ int main(int argc, char **argv)
      int islice[4], center_slice[4] = {0,0,0,0};
      int verbose = 0;
      int append = 0;
+     arrayh5_write_options wopts = {0};
      char *expr_string = 0, *expr_filename = 0;
      char *data_name = 0;
      char *out_fname, *out_dname;
      char **eval_vars;
      int eval_nvars;
      char **vars;
-     double *vals;
      void *evaluator;
+     mathexpr *expr;
+     int coords, nthreads = 1;
      double res = 1.0;
-     int nx, ny, nz, nt, nr, ix, iy, iz, it, ir;
+     int nx, ny, nz, nt, nr, ix, iy;
      double cx, cy, cz;
 
-     while ((c = getopt(argc, argv, "hVvan:f:e:x:y:z:t:0d:r:")) != -1)
+     arrayh5_mpi_init(&argc, &argv);
+
+     while ((c = getopt(argc, argv, "hVvan:f:e:x:y:z:t:0d:r:j:" WRITE_OPTIONS)) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -157,6 +187,14 @@ int main(int argc, char **argv)
 		   free(data_name);
 		   data_name = my_strdup(optarg);
 		   break;		   
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
+	      case 'c': case 'G': case 's': case 'Z': case 'F':
+		   CHECK(parse_write_option(c, optarg, &wopts),
+			 "invalid output storage option");
+		   break;
 	      default:
 		   fprintf(stderr, "Invalid argument -%c\n", c);
 		   usage(stderr);
@@ -166,6 +204,11 @@ int main(int argc, char **argv)
 	  usage(stderr);
 	  return EXIT_FAILURE;
      }
+#ifndef _OPENMP
+     if (nthreads > 1)
+	  fprintf(stderr, "h5math: compiled without OpenMP; ignoring -j\n");
+#endif
+     arrayh5_stats_init("h5math", verbose);
 
      out_fname = split_fname(argv[optind], &out_dname);
      if (!out_dname[0]) {
@@ -175,65 +218,94 @@ int main(int argc, char **argv)
 	       out_dname = (char *) default_data_name;
      }
      optind++;
+     argv = expand_fname_args(&argc, argv, optind);
 
      n = argc - optind;
-     a = (arrayh5 *) malloc(sizeof(arrayh5) * n);
-     CHECK(a, "out of memory");
+     h = (arrayh5_handle **) malloc(sizeof(arrayh5_handle *) * (n + 1));
+     CHECK(h, "out of memory");
 
      for (i = 0; i < n; ++i) {
-	  int err;
+	  int err, r, *d;
 	  char *fname, *dname;
 
           fname = split_fname(argv[i + optind], &dname);
           if (!dname[0])
                dname = data_name;
 
-	  err = arrayh5_read(&a[i], fname, dname, NULL,
-                             4, slicedim, islice, center_slice);
+	  err = arrayh5_open(&h[i], fname, dname);
+          CHECK(!err, arrayh5_read_strerror[err]);
+	  d = (int *) malloc(sizeof(int) * (arrayh5_handle_rank(h[i]) + 1));
+	  CHECK(d, "out of memory");
+	  err = arrayh5_slice_dims(h[i], 4, slicedim, islice, center_slice,
+				   &r, d);
           CHECK(!err, arrayh5_read_strerror[err]);
 
-	  CHECK(!i || arrayh5_conformant(a[i], a[i-1]),
-		"all input arrays must have the same dimensions");
+	  if (!i) {
+	       orank = r;
+	       odims = d;
+	  }
+	  else {
+	       CHECK(r == orank && !memcmp(d, odims, sizeof(int) * r),
+		     "all input arrays must have the same dimensions");
+	       free(d);
+	  }
+
+	  /* we can't write the output file while we have it open for
+	     reading, so in that case we read all of the inputs first */
+	  if (same_file(fname, out_fname))
+	       in_place = 1;
 
 	  if (verbose)
-	       printf("read variable d%d: dataset \"%s\" in file \"%s\"\n",
+	       printf("reading variable d%d: dataset \"%s\" in file \"%s\"\n",
 		      i + 1, dname ? dname : "<first>", fname);
 	  
 	  free(fname);
      }
 
      if (rank >= 0) {
-	  ao = arrayh5_create(rank, dims);
-	  CHECK(!n || arrayh5_conformant(ao, a[0]),
+	  CHECK(!n || (rank == orank
+		       && !memcmp(dims, odims, sizeof(int) * rank)),
 		"-n dimensions must be same as those of input arrays");
+	  if (!n) {
+	       orank = rank;
+	       odims = (int *) malloc(sizeof(int) * (rank + 1));
+	       CHECK(odims, "out of memory");
+	       memcpy(odims, dims, sizeof(int) * rank);
+	  }
      }
-     else if (n)
-	  ao = arrayh5_clone(a[0]);
      else
-	  CHECK(0, "output size must be specified with -n if no input arrays");
+	  CHECK(n, "output size must be specified with -n if no input arrays");
 
      if (verbose) {
-	  printf("rank-%d array dimensions: ", ao.rank);
-	  if (!ao.rank) printf("1\n");
-	  for (i = 0; i < ao.rank; ++i)
-	       printf("%s%d", i ? "x" : "", ao.dims[i]);
+	  printf("rank-%d array dimensions: ", orank);
+	  if (!orank) printf("1\n");
+	  for (i = 0; i < orank; ++i)
+	       printf("%s%d", i ? "x" : "", odims[i]);
 	  printf("\n");
      }
 
-     nx = ao.rank >= 1 ? ao.dims[0] : 1;
-     ny = ao.rank >= 2 ? ao.dims[1] : 1;
-     nz = ao.rank >= 3 ? ao.dims[2] : 1;
-     nt = ao.rank >= 4 ? ao.dims[3] : 1;
-     for (nr = 1, i = 4; i < ao.rank; ++i)
-	  nr *= ao.dims[i];
+     nrows = orank >= 1 ? odims[0] : 1;
+     /* with MPI, each process computes a contiguous range of the rows */
+     row_lo = (int) ((long long) nrows * arrayh5_mpi_rank()
+		     / arrayh5_mpi_size());
+     row_hi = (int) ((long long) nrows * (arrayh5_mpi_rank() + 1)
+		     / arrayh5_mpi_size());
+     rows_max = (nrows + arrayh5_mpi_size() - 1) / arrayh5_mpi_size();
+     for (rowN = 1, i = 1; i < orank; ++i)
+	  rowN *= odims[i];
+
+     nx = orank >= 1 ? odims[0] : 1;
+     ny = orank >= 2 ? odims[1] : 1;
+     nz = orank >= 3 ? odims[2] : 1;
+     nt = orank >= 4 ? odims[3] : 1;
+     for (nr = 1, i = 4; i < orank; ++i)
+	  nr *= odims[i];
      cx = center_slice[0] ? (nx - 1) * 0.5 : 0.0;
      cy = center_slice[1] ? (ny - 1) * 0.5 : 0.0;
      cz = center_slice[2] ? (nz - 1) * 0.5 : 0.0;
 
      vars = (char **) malloc(sizeof(char *) * (n + 4));
      CHECK(vars, "out of memory");
-     vals = (double *) malloc(sizeof(double) * (n + 4));
-     CHECK(vals, "out of memory");
      for (i = 0; i < n; ++i) {
 	  vars[i] = my_strdup("dxxxxxxxxxxxx");
 #ifdef HAVE_SNPRINTF
@@ -241,12 +313,11 @@ int main(int argc, char **argv)
 #else
 	  sprintf(vars[i], "d%d", i + 1);
 #endif
-	  vals[i] = 0.0;
      }
-     vars[n+0] = strdup("x"); vals[n+0] = 0.0;
-     vars[n+1] = strdup("y"); vals[n+1] = 0.0;
-     vars[n+2] = strdup("z"); vals[n+2] = 0.0;
-     vars[n+3] = strdup("t"); vals[n+3] = 0.0;
+     vars[n+0] = strdup("x");
+     vars[n+1] = strdup("y");
+     vars[n+2] = strdup("z");
+     vars[n+3] = strdup("t");
      
      if (!expr_string) {
 	  char buf[1024] = "";
@@ -291,37 +362,203 @@ int main(int argc, char **argv)
 	  printf("Evaluating expression: %s\n", buf);
      }
 
-     for (ix = 0; ix < nx; ++ix)
-     for (iy = 0; iy < ny; ++iy)
-     for (iz = 0; iz < nz; ++iz)
-     for (it = 0; it < nt; ++it)
-     for (ir = 0; ir < nr; ++ir) {
-	  int idx = ir + nr * (it + nt * (iz + nz * (iy + ny * ix)));
-	  for (i = 0; i < n; ++i)
-	       vals[i] = a[i].data[idx];
-	  vals[n+0] = (ix - cx) / res;
-	  vals[n+1] = (iy - cy) / res;
-	  vals[n+2] = (iz - cz) / res;
-	  vals[n+3] = ao.rank >= 4 ? it : 
-	       (ao.rank >= 3 ? iz : (ao.rank >= 2 ? iy : ix));
-	  ao.data[idx] = evaluator_evaluate(evaluator, n+4, vars, vals);
+     /* Rather than reading all of the inputs into memory, we process
+	nbrows rows of the inputs and output at a time, chosen to stay
+	within about STREAM_BYTES and to be a multiple of the inputs'
+	chunk size if possible (unless in_place, as explained above). */
+     if (in_place)
+	  nbrows = rows_max;
+     else {
+	  nbrows = STREAM_BYTES / (sizeof(double) * (n + 1)
+				   * (rowN > 0 ? rowN : 1));
+	  if (n > 0) {
+	       int chunk = arrayh5_slice_chunk_rows(h[0], 4, slicedim,
+						    islice, center_slice);
+	       if (nbrows > chunk)
+		    nbrows -= nbrows % chunk;
+	  }
+	  if (nbrows < 1)
+	       nbrows = 1;
+	  if (nbrows > rows_max)
+	       nbrows = rows_max;
+     }
+     /* the same number of steps for every process, since the writes
+	of each step are collective with MPI */
+     nsteps = nbrows > 0 ? (rows_max + nbrows - 1) / nbrows : 0;
+     din = (double **) malloc(sizeof(double *) * (n + 1));
+     CHECK(din, "out of memory");
+     for (i = 0; i <= n; ++i) {
+	  din[i] = (double *) malloc(sizeof(double) * (nbrows * rowN + 1));
+	  CHECK(din[i], "out of memory");
+     }
+     dout = din[n];
+
+     if (in_place) {
+	  for (i = 0; i < n; ++i) {
+	       int err = arrayh5_read_rows(h[i], 4, slicedim, islice,
+					   center_slice, row_lo,
+					   row_hi - row_lo, din[i]);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       arrayh5_close(h[i]);
+	  }
      }
 
      if (verbose)
 	  printf("Writing data to \"%s\" in \"%s\"...\n", 
 		 out_dname ? out_dname : "<first>", out_fname);
-     arrayh5_write(ao, out_fname, out_dname, append);
+     ho = arrayh5_create_dataset(out_fname, out_dname, orank, odims, append,
+				 &wopts);
+
+     /* Evaluate the expression in blocks of MATHEXPR_BLOCK points,
+	using the block compiler if possible (since it is much faster
+	than calling evaluator_evaluate point by point).  With -j, the
+	blocks are divided among threads, each with its own workspace
+	(and its own libmatheval evaluator, if we need one), while the
+	reading and writing of each block of rows is done by one thread. */
+     expr = mathexpr_create(expr_string, n + 4, vars);
+     coords = !expr;
+     for (i = 0; expr && i < 4; ++i)
+	  coords = coords || mathexpr_uses_var(expr, n + i);
+
+#ifdef _OPENMP
+#    pragma omp parallel num_threads(nthreads)
+#endif
+     {
+	  const double **evals;
+	  double *xyzt, *work = NULL, *vals = NULL;
+	  void *evaluator_t = NULL;
+	  int step, iblock, j, k;
+	  double t0;
+
+	  evals = (const double **) malloc(sizeof(double *) * (n + 4));
+	  CHECK(evals, "out of memory");
+	  xyzt = (double *) malloc(sizeof(double) * 4 * MATHEXPR_BLOCK);
+	  CHECK(xyzt, "out of memory");
+	  for (k = 0; k < 4; ++k)
+	       evals[n + k] = xyzt + k * MATHEXPR_BLOCK;
+	  if (expr) {
+	       work = (double *) malloc(sizeof(double)
+					* mathexpr_work_size(expr));
+	       CHECK(work, "out of memory");
+	  }
+	  else {
+	       vals = (double *) malloc(sizeof(double) * (n + 4));
+	       CHECK(vals, "out of memory");
+#ifdef _OPENMP
+#    pragma omp critical (matheval)
+#endif
+	       evaluator_t = evaluator_create(expr_string);
+	       CHECK(evaluator_t, "error parsing symbolic expression");
+	  }
+
+	  for (step = 0; step < nsteps; ++step) {
+	       int row0 = row_lo + step * nbrows < row_hi
+		    ? row_lo + step * nbrows : row_hi;
+	       int mrows = row_hi - row0 < nbrows ? row_hi - row0 : nbrows;
+	       int npts = mrows * rowN, base = row0 * rowN;
+	       int nblocks = (npts + MATHEXPR_BLOCK - 1) / MATHEXPR_BLOCK;
+
+	       if (!in_place) {
+#ifdef _OPENMP
+#    pragma omp single
+#endif
+		    for (k = 0; k < n; ++k) {
+			 int err = arrayh5_read_rows(h[k], 4, slicedim, islice,
+						     center_slice, row0, mrows,
+						     din[k]);
+			 CHECK(!err, arrayh5_read_strerror[err]);
+		    }
+	       }
+
+	       t0 = arrayh5_stats_start();
+#ifdef _OPENMP
+#    pragma omp for schedule(static)
+#endif
+	       for (iblock = 0; iblock < nblocks; ++iblock) {
+		    int idx = iblock * MATHEXPR_BLOCK, rem = base + idx;
+		    int m = npts - idx < MATHEXPR_BLOCK ? npts - idx
+			 : MATHEXPR_BLOCK;
+		    int jx, jy, jz, jt, jr;
+
+		    /* coordinates of the first point in the block, then
+		       counting in row-major order through the block: */
+		    jr = rem % nr; rem /= nr;
+		    jt = rem % nt; rem /= nt;
+		    jz = rem % nz; rem /= nz;
+		    jy = rem % ny; jx = rem / ny;
+		    for (j = 0; coords && j < m; ++j) {
+			 xyzt[j] = (jx - cx) / res;
+			 xyzt[MATHEXPR_BLOCK + j] = (jy - cy) / res;
+			 xyzt[2*MATHEXPR_BLOCK + j] = (jz - cz) / res;
+			 xyzt[3*MATHEXPR_BLOCK + j] = orank >= 4 ? jt :
+			      (orank >= 3 ? jz : (orank >= 2 ? jy : jx));
+			 if (++jr == nr) {
+			      jr = 0;
+			      if (++jt == nt) {
+				   jt = 0;
+				   if (++jz == nz) {
+					jz = 0;
+					if (++jy == ny) {
+					     jy = 0;
+					     ++jx;
+					}
+				   }
+			      }
+			 }
+		    }
+
+		    if (expr) {
+			 for (k = 0; k < n; ++k)
+			      evals[k] = din[k] + idx;
+			 mathexpr_evaluate(expr, m, evals, dout + idx, work);
+		    }
+		    else
+			 for (j = 0; j < m; ++j) {
+			      for (k = 0; k < n; ++k)
+				   vals[k] = din[k][idx + j];
+			      for (k = 0; k < 4; ++k)
+				   vals[n + k] = xyzt[k * MATHEXPR_BLOCK + j];
+			      dout[idx + j] = evaluator_evaluate(evaluator_t,
+								 n+4, vars,
+								 vals);
+			 }
+	       }
+
+	       /* the omp for ends with a barrier, so t0 of whichever
+		  thread writes the rows bounds the whole evaluation */
+#ifdef _OPENMP
+#    pragma omp single
+#endif
+	       {
+		    arrayh5_stats_stop(ARRAYH5_STAGE_CONVERT, t0,
+				       sizeof(double) * (double) npts);
+		    arrayh5_write_rows(ho, row0, mrows, dout);
+	       }
+	  }
+
+	  if (evaluator_t)
+	       evaluator_destroy(evaluator_t);
+	  free(vals);
+	  free(work);
+	  free(xyzt);
+	  free(evals);
+     } /* omp parallel */
+     mathexpr_destroy(expr);
+     arrayh5_close(ho);
 
-     free(vals);
      for (i = 0; i < n+4; ++i) free(vars[i]);
      free(vars);
-     arrayh5_destroy(ao);
-     for (i = 0; i < n; ++i) arrayh5_destroy(a[i]);
-     free(a);
+     for (i = 0; i <= n; ++i) free(din[i]);
+     free(din);
+     if (!in_place)
+	  for (i = 0; i < n; ++i) arrayh5_close(h[i]);
+     free(h);
+     free(odims);
      free(out_fname);
      free(expr_filename);
      free(expr_string);
      free(data_name);
+     free_fname_args(argc, argv, optind);
 
      return EXIT_SUCCESS;
 }
@@ -24,28 +24,52 @@
 #include <stdio.h>
 #include <ctype.h>
 
+#include <algorithm>
+
 #include <octave/oct.h>
 
 #include "arrayh5.h"
 
+/* Get the optional 1-based index vector args(iarg), of length rank, as
+   0-based ints in v (or leave v as-is if it is missing or empty). */
+static bool get_index_arg(const octave_value_list &args, int iarg,
+			  int rank, int offset, int *v)
+{
+     if (args.length() <= iarg || args(iarg).is_empty())
+	  return true;
+     Array<int> a = args(iarg).int_vector_value();
+     if (a.numel() != rank)
+	  return false;
+     for (int k = 0; k < rank; ++k)
+	  v[k] = a(k) - offset;
+     return true;
+}
+
 DEFUN_DLD(h5read, args, , 
-"h5read(filename [, slicedim, islice, dataname])\n"
-"Read a 1d or 2d array slice from an HDF5 file.\n\n"
+"h5read(filename [, slicedim, islice, dataname, start, count, stride])\n"
+"Read an array, or a slice or sub-block of one, from an HDF5 file.\n\n"
 "slicedim and islice are optional parameters indicating a \"slice\" of a\n"
-"multidimensional dataset, where slicedim is \"x\", \"y\", or \"z\", and\n"
-"islice is the index in that dimension.  The default is slicedim=\"z\" and\n"
-"islice=0, meaning the xy plane at z index 0 is read.\n\n"
+"multidimensional dataset, where slicedim is \"x\", \"y\", \"z\", or \"t\"\n"
+"(the last dimension), and islice is the index in that dimension.  The\n"
+"default, for datasets of rank 3 or more, is slicedim=\"z\" and islice=0,\n"
+"meaning the xy plane at z index 0 is read.  If slicedim is \"\", the\n"
+"whole (N-dimensional) dataset is read.\n\n"
 "The optional parameter dataname indicates the name of the dataset to read\n"
-"within the HDF5 file.  The default is to read the first dataset.\n"
+"within the HDF5 file.  The default is to read the first dataset.\n\n"
+"The optional vectors start, count, and stride select a sub-block of the\n"
+"slice: count(k) elements starting at (1-based) index start(k) with a\n"
+"stride of stride(k) in each dimension k.  The defaults are start=1,\n"
+"stride=1, and count=as many elements as fit in the slice.\n"
 )
 {
      std::string fname, dataname;
      octave_value retval;
-     arrayh5 a;
+     arrayh5_handle *h;
      int readerr;
      int slicedim = 2, islice = 0, center_slice = 0;
+     bool default_slice = true;
      
-     if (args.length() < 1 || args.length() > 4 || !args(0).is_string()
+     if (args.length() < 1 || args.length() > 7 || !args(0).is_string()
 	 || (args.length() >= 2 && !args(1).is_string())
 	 || (args.length() >= 3 && !args(2).is_real_scalar())
 	 || (args.length() >= 4 && !args(3).is_string())) {
@@ -54,43 +78,86 @@ DEFUN_DLD(h5read, args, ,
      }
      
      fname = args(0).string_value();
-     if (args.length() >= 2)
-	  slicedim = tolower(*(args(1).string_value().c_str())) - 'x';
+     if (args.length() >= 2) {
+	  std::string s = args(1).string_value();
+	  default_slice = false;
+	  if (s.empty())
+	       slicedim = NO_SLICE_DIM;
+	  else if (tolower(s[0]) == 't')
+	       slicedim = LAST_SLICE_DIM;
+	  else
+	       slicedim = tolower(s[0]) - 'x';
+     }
      if (args.length() >= 3)
 	  islice = (int) (args(2).double_value() + 0.5);
      
-     readerr = arrayh5_read(&a, fname.c_str(),
+     readerr = arrayh5_open(&h, fname.c_str(),
 			    args.length() >= 4 ? 
-			    args(3).string_value().c_str() : NULL, 
-			    NULL, 1, &slicedim, &islice, &center_slice);
+			    args(3).string_value().c_str() : NULL);
      if (readerr) {
 	  fprintf(stderr, "error in h5read: %s\n",
 		  arrayh5_read_strerror[readerr]);
 	  return retval;
      }
 
-     if (a.rank >= 2) {
-	  Matrix m(a.dims[0], a.dims[1]);
+     if (default_slice && arrayh5_handle_rank(h) < 3)
+	  slicedim = NO_SLICE_DIM;
 
-	  for (int i = 0; i < a.dims[0]; ++i)
-	       for (int j = 0; j < a.dims[1]; ++j)
-		    m(i,j) = a.data[i*a.dims[1] + j];
+     int rank, maxrank = arrayh5_handle_rank(h) + 1;
+     int *dims = new int[maxrank * 4];
+     int *start = dims + maxrank, *count = start + maxrank;
+     int *stride = count + maxrank;
+     bool block = args.length() >= 5;
 
-	  retval = m;
+     readerr = arrayh5_slice_dims(h, 1, &slicedim, &islice, &center_slice,
+				  &rank, dims);
+     if (!readerr && block) {
+	  for (int k = 0; k < rank; ++k) {
+	       start[k] = 0;
+	       stride[k] = 1;
+	       count[k] = -1;
+	  }
+	  if (!get_index_arg(args, 4, rank, 1, start)
+	      || !get_index_arg(args, 5, rank, 0, count)
+	      || !get_index_arg(args, 6, rank, 0, stride)) {
+	       fprintf(stderr, "error in h5read: start/count/stride must "
+		       "have one entry per dimension (%d)\n", rank);
+	       delete[] dims;
+	       arrayh5_close(h);
+	       return retval;
+	  }
+	  for (int k = 0; k < rank; ++k)
+	       if (count[k] < 0 && stride[k] > 0 && start[k] >= 0)
+		    count[k] = start[k] < dims[k] ?
+			 (dims[k] - start[k] - 1) / stride[k] + 1 : 0;
      }
-     else if (a.rank == 1) {
-	  ColumnVector v(a.dims[0]);
 
-	  for (int i = 0; i < a.dims[0]; ++i)
-	       v(i) = a.data[i];
+     if (!readerr) {
+	  /* Octave arrays are column-major, so reading the transposed
+	     slice directly into the NDArray's storage gives an array
+	     indexed in the same order as the dataset */
+	  dim_vector dv;
+	  dv.resize(rank < 2 ? 2 : rank);
+	  for (int k = 0; k < dv.ndims(); ++k) /* bad counts fail below */
+	       dv(k) = k < rank ? (block ? std::max(count[k], 0) : dims[k]) : 1;
+	  NDArray m(dv);
 
-	  retval = v;
-     }
-     else {
-	  retval = a.data[0];  /* scalar (rank = 0) */
+	  readerr = arrayh5_read_transposed_block(h, 1, &slicedim, &islice,
+						  &center_slice,
+						  block ? start : NULL,
+						  block ? stride : NULL,
+						  block ? count : NULL,
+						  m.fortran_vec());
+	  if (!readerr)
+	       retval = m;
      }
-     
-     arrayh5_destroy(a);
+
+     if (readerr)
+	  fprintf(stderr, "error in h5read: %s\n",
+		  arrayh5_read_strerror[readerr]);
+
+     delete[] dims;
+     arrayh5_close(h);
      
      return retval;
 }
@@ -29,6 +29,11 @@
 #include <unistd.h>
 
 #include "config.h"
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
 #include "arrayh5.h"
 #include "copyright.h"
 #include "writepng.h"
@@ -41,6 +46,10 @@
 #define OVERLAY_OPACITY_DEFAULT 0.2
 #define CMAP_DIR DATADIR "/" PACKAGE_NAME "/colormaps/"
 
+/* with -R, slices read while collecting the range are kept in memory,
+   up to this many bytes in total, so that they needn't be read again */
+#define RANGE_CACHE_BYTES (512 * 1024 * 1024.0)
+
 void usage(FILE *f)
 {
      fprintf(f, "Usage: h5topng [options] [<filenames>]\n"
@@ -71,8 +80,13 @@ void usage(FILE *f)
 	     "  -A <file> : overlay data from <file>, as specified by -y\n"
 "  -a <c>:<o>: overlay colormap <c>, opacity <o> (0-1) [default: %s:%g]\n"
 "         -8 : use an 8-bit color table, instead of 24-bit direct color\n"
+	     "   -L <lvl> : PNG compression level 0-9, or \"fast\" [default: 6]\n"
+	     "  -f <filt> : PNG row filters none/sub/up/avg/paeth/all, or a,b,...\n"
 	     "  -d <name> : use dataset <name> in the input files (default: first dataset)\n"
-	     "              -- you can also specify a dataset via <filename>:<name>\n",
+	     "              -- you can also specify a dataset via <filename>:<name>\n"
+	     "     -j <n> : render <n> images at a time in parallel [default: 1]\n"
+	     "              -- or compress each image with <n>/<#images> threads\n"
+	     "         -p : with -j 1, read the next image in a second thread\n",
 	  OVERLAY_CMAP_DEFAULT, OVERLAY_OPACITY_DEFAULT);
 }
 
@@ -157,7 +171,7 @@ colormap_t get_cmap(const char *colormap, int invert, double scale_alpha,
 	  if (!(cmap_f = fopen(cmap_fname, "r"))) {
 	       if (!strcmp(colormap, "gray"))
 		    cmap = gray_cmap;
-	       if (!strcmp(colormap, "yellow"))
+	       else if (!strcmp(colormap, "yellow"))
 		    cmap = yellow_cmap;
 	       else {
 		    fprintf(stderr, "Could not find colormap \"%s\"\n",
@@ -213,6 +227,44 @@ static int get_islice(const char *s, int *min, int *max, int *step)
      return num_read;
 }
 
+/* open the dataset specified by fname (of the form <filename>:<name>,
+   with the name defaulting to dname), exiting on failure */
+static arrayh5_handle *open_dataset(char *fname, char *dname)
+{
+     arrayh5_handle *h;
+     char *name, *h5_fname;
+     int err;
+
+     h5_fname = split_fname(fname, &name);
+     if (!name[0])
+	  name = dname;
+     err = arrayh5_open(&h, h5_fname, name);
+     CHECK(!err, arrayh5_read_strerror[err]);
+     free(h5_fname);
+     return h;
+}
+
+/* Read a slice from h into b, as for arrayh5_read_buffer.  If h has
+   lower rank than the data, the t slice (if any) is ignored, so that
+   contour and overlay datasets need not have a time dimension.  HDF5
+   is not thread-safe, so reads are serialized when rendering in
+   parallel. */
+static int read_slice(arrayh5_buffer *b, arrayh5_handle *h, int data_rank,
+		      const int *slicedim, const int *islice,
+		      const int *center_slice)
+{
+     int sd[4], err;
+
+     memcpy(sd, slicedim, sizeof(sd));
+     if (sd[3] == LAST_SLICE_DIM && data_rank > arrayh5_handle_rank(h))
+	  sd[3] = NO_SLICE_DIM;
+#ifdef _OPENMP
+#    pragma omp critical (hdf5)
+#endif
+     err = arrayh5_read_buffer(b, h, 4, sd, islice, center_slice);
+     return err;
+}
+
 static int iabs(int x) { return x < 0 ? -x : x; }
 static int imax(int x, int y) { return x > y ? x : y; }
 static int ilog10(int x) {
@@ -226,7 +278,6 @@ static int ilog10(int x) {
 
 int main(int argc, char **argv)
 {
-     arrayh5 a, contour_data, overlay_data;
      char *png_fname = NULL, *contour_fname = NULL, *data_name = NULL;
      char *overlay_fname = NULL;
      REAL mask_thresh = 0;
@@ -237,10 +288,8 @@ int main(int argc, char **argv)
      extern int optind;
      int c;
      int slicedim[4] = {NO_SLICE_DIM,NO_SLICE_DIM,NO_SLICE_DIM,NO_SLICE_DIM};
-     int islice[4], center_slice[4] = {0,0,0,0};
+     int center_slice[4] = {0,0,0,0};
      int islice_min[4] = {0,0,0,0}, islice_max[4] = {0,0,0,0}, islice_step[4] = {1,1,1,1};
-     int err;
-     int nx, ny;
      char *colormap = NULL, *overlay_colormap = NULL;
      int overlay_invert = 0;
      colormap_t cmap = { 0, NULL };
@@ -253,13 +302,25 @@ int main(int argc, char **argv)
      int invert = 0;
      double skew = 0.0;
      int eight_bit = 0;
-     int ifile, num_processed;
-     int data_rank, slicedim3;
+     int nfiles, nslices, nframes, num_processed;
+     int frame_lo, frame_hi, nlocal;
+     int data_rank;
+     arrayh5_handle *data_h, *contour_h = NULL, *overlay_h = NULL;
+     int data_jfile;
+     int nthreads = 1, prefetch = 0, want_prefetch = 0, nteam;
+     writepng_options png_opts = WRITEPNG_OPTIONS_DEFAULT;
+     arrayh5 *range_cache = NULL;
+     double range_cache_bytes = 0;
+#ifdef _OPENMP
+     omp_lock_t render_lock;
+#endif
+
+     arrayh5_mpi_init(&argc, &argv);
 
      colormap = my_strdup(CMAP_DEFAULT);
      overlay_colormap = my_strdup(OVERLAY_CMAP_DEFAULT);
 
-     while ((c = getopt(argc, argv, "ho:x:y:z:t:0c:m:M:RC:b:d:vX:Y:S:TrZs:Va:A:8")) != -1)
+     while ((c = getopt(argc, argv, "ho:x:y:z:t:0c:m:M:RC:b:d:vX:Y:S:TrZs:Va:A:8j:pL:f:")) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -363,6 +424,26 @@ int main(int argc, char **argv)
 	      case 's':
 		   skew = atof(optarg) * 3.14159265358979323846 / 180.0;
 		   break;
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
+	      case 'p':
+		   want_prefetch = 1;
+		   break;
+	      case 'L':
+		   if (!strcmp(optarg, "fast"))
+			png_opts.fast = 1;
+		   else {
+			png_opts.level = atoi(optarg);
+			CHECK(isdigit(optarg[0]) && png_opts.level <= 9,
+			      "invalid argument to -L");
+		   }
+		   break;
+	      case 'f':
+		   png_opts.filters = writepng_parse_filters(optarg);
+		   CHECK(png_opts.filters > 0, "invalid argument to -f");
+		   break;
 	      default:
 		   fprintf(stderr, "Invalid argument -%c\n", c);
 		   usage(stderr);
@@ -372,6 +453,8 @@ int main(int argc, char **argv)
      CHECK(!overlay_fname || !eight_bit,
 	   "-8 option is not currently supported with -A");
 
+     arrayh5_stats_init("h5topng", verbose);
+
      cmap = get_cmap(colormap, invert, 1.0, verbose);
      if (overlay_fname)
 	  overlay_cmap = get_cmap(overlay_colormap, overlay_invert,
@@ -381,198 +464,307 @@ int main(int argc, char **argv)
 	  usage(stderr);
 	  return EXIT_FAILURE;
      }
+     argv = expand_fname_args(&argc, argv, optind);
+
+#ifndef _OPENMP
+     if (nthreads > 1 || want_prefetch)
+	  fprintf(stderr, "h5topng: compiled without OpenMP; ignoring -j/-p\n");
+#endif
+
+     /* Every combination of slices and input files is a "frame",
+	rendered independently of the others (possibly in parallel). */
+     nslices = 1;
+     for (c = 0; c < 4; ++c) {
+	  CHECK(islice_step[c] > 0, "slice step must be positive");
+	  nslices *= islice_max[c] >= islice_min[c] ?
+	       (islice_max[c] - islice_min[c]) / islice_step[c] + 1 : 0;
+     }
+     nfiles = argc - optind;
+     nframes = nslices * nfiles;
+     /* with MPI, each process renders a contiguous range of the frames */
+     frame_lo = (int) ((long long) nframes * arrayh5_mpi_rank()
+		       / arrayh5_mpi_size());
+     frame_hi = (int) ((long long) nframes * (arrayh5_mpi_rank() + 1)
+		       / arrayh5_mpi_size());
+     nlocal = frame_hi - frame_lo;
 
-     contour_data.data = overlay_data.data = NULL;
-
-     slicedim3 = slicedim[3];
-     {
-          char *dname, *h5_fname;
-          h5_fname = split_fname(argv[optind], &dname);
-          if (!dname[0])
-               dname = data_name;
-	  err = arrayh5_read_rank(h5_fname, dname, &data_rank);
-	  CHECK(!err, arrayh5_read_strerror[err]);
-	  free(h5_fname);
-	  if (verbose)
-	       printf("data rank = %d\n", data_rank);
+     if (collect_range) {
+	  range_cache = (arrayh5 *) malloc(sizeof(arrayh5) * nframes);
+	  CHECK(range_cache, "out of memory");
+	  for (c = 0; c < nframes; ++c)
+	       range_cache[c].data = NULL;
      }
+#ifdef _OPENMP
+     /* With -p and a single rendering thread, a second thread reads the
+	next frame (and its contour/overlay slices) while the current one
+	is rendered and compressed, with rendering serialized by a lock so
+	that only one image is rendered at a time.  (For -j > 1, each
+	thread's reads already overlap the others' rendering.)  This is
+	not the default, so that -j 1 really uses one thread. */
+     prefetch = want_prefetch && nthreads == 1 && nlocal > 1;
+     omp_init_lock(&render_lock);
+#endif
+     /* threads left over when there are fewer frames than threads
+	are used to compress each image in parallel */
+     nteam = nthreads < nlocal ? nthreads : nlocal;
+     if (nteam < 1)
+	  nteam = 1;
+#ifdef _OPENMP
+     png_opts.nthreads = nthreads / nteam;
+     if (nteam > 1 && png_opts.nthreads > 1)
+	  omp_set_max_active_levels(2);
+#endif
+     /* Only the dataset currently being read is kept open, so that
+	successive slices of the same file (and both passes of -R, for
+	a single file) don't re-open it, without holding a handle (and
+	metadata cache) open for every input file. */
+     data_h = open_dataset(argv[optind], data_name);
+     data_jfile = 0;
+     data_rank = arrayh5_handle_rank(data_h);
+     if (verbose)
+	  printf("data rank = %d\n", data_rank);
+     if (contour_fname)
+	  contour_h = open_dataset(contour_fname, NULL);
+     if (overlay_fname)
+	  overlay_h = open_dataset(overlay_fname, NULL);
 
  process_files:
 
      num_processed = 0;
 
-     for (islice[0] = islice_min[0]; islice[0] <= islice_max[0];
-	  islice[0] += islice_step[0])
-     for (islice[1] = islice_min[1]; islice[1] <= islice_max[1];
-	  islice[1] += islice_step[1])
-     for (islice[2] = islice_min[2]; islice[2] <= islice_max[2];
-	  islice[2] += islice_step[2])
-     for (islice[3] = islice_min[3]; islice[3] <= islice_max[3];
-	  islice[3] += islice_step[3]) {
-
-     int onx = 1, ony = 1;
-     int cnx = 1, cny = 1;
-
-     if (contour_fname && !collect_range) {
-	  int rank;
-	  char *fname, *dname;
-
-	  fname = split_fname(contour_fname, &dname);
-	  if (!dname[0])
-	       dname = NULL;
-
-	  if (verbose)
-	       printf("reading contour data from \"%s\".\n", fname);
-
-	  err = arrayh5_read_rank(fname, dname, &rank);
-          CHECK(!err, arrayh5_read_strerror[err]);
-	  if (slicedim3 == LAST_SLICE_DIM && data_rank > rank)
-	       slicedim[3] = NO_SLICE_DIM;
-
-	  err = arrayh5_read(&contour_data, fname, dname, NULL,
-			     4, slicedim, islice, center_slice);
-	  slicedim[3] = slicedim3;
-	  CHECK(!err, arrayh5_read_strerror[err]);
-	  CHECK(contour_data.rank == 1 || contour_data.rank == 2,
-	       "contour slice must be one or two dimensional");
-
-	  cnx = contour_data.dims[0];
-	  cny = contour_data.rank >= 2 ? contour_data.dims[1] : 1;
+#ifdef _OPENMP
+#    pragma omp parallel num_threads(nteam + prefetch)
+#endif
+     {
+     /* each thread reuses its buffers for all of its frames */
+     arrayh5 a, contour_data, overlay_data;
+     arrayh5_buffer abuf, contour_buf, overlay_buf;
+     writepng_workspace *ws = writepng_workspace_create();
+     int islice[4], iframe;
+     int contour_slice = -1, overlay_slice = -1;
+     REAL contour_thresh = mask_thresh;
+
+     CHECK(ws, "out of memory");
+     arrayh5_buffer_init(&abuf);
+     arrayh5_buffer_init(&contour_buf);
+     arrayh5_buffer_init(&overlay_buf);
+     contour_data.data = overlay_data.data = NULL;
 
-	  if (!mask_thresh_set) {
-               double c_min, c_max;
-               arrayh5_getrange(contour_data, &c_min, &c_max);
-	       mask_thresh = (c_min + c_max) * 0.5;
+#ifdef _OPENMP
+#    pragma omp for schedule(dynamic, 1)
+#endif
+     for (iframe = frame_lo; iframe < frame_hi; ++iframe) {
+	  int islice_index = iframe / nfiles, jfile = iframe % nfiles;
+	  int onx = 1, ony = 1;
+	  int cnx = 1, cny = 1;
+	  int dim, k, err, cached = 0;
+	  double fmin, fmax;
+	  char *dname, *h5_fname;
+
+	  for (dim = 3, k = islice_index; dim >= 0; --dim) {
+	       int n = (islice_max[dim] - islice_min[dim])
+		    / islice_step[dim] + 1;
+	       islice[dim] = islice_min[dim] + (k % n) * islice_step[dim];
+	       k /= n;
 	  }
 
-	  free(fname);
-     }
-
-     if (overlay_fname && !collect_range) {
-	  int rank;
-	  char *fname, *dname;
-
-	  fname = split_fname(overlay_fname, &dname);
-	  if (!dname[0])
-	       dname = NULL;
-
-	  if (verbose)
-	       printf("reading overlay data from \"%s\".\n", fname);
-
-	  err = arrayh5_read_rank(fname, dname, &rank);
-          CHECK(!err, arrayh5_read_strerror[err]);
-	  if (slicedim3 == LAST_SLICE_DIM && data_rank > rank)
-	       slicedim[3] = NO_SLICE_DIM;
+	  if (verbose && jfile == 0)
+	       printf("------\n");
 
-	  err = arrayh5_read(&overlay_data, fname, dname, NULL,
-			     4, slicedim, islice, center_slice);
-	  slicedim[3] = slicedim3;
-	  CHECK(!err, arrayh5_read_strerror[err]);
-	  CHECK(overlay_data.rank == 1 || overlay_data.rank == 2,
-	       "overlay slice must be one or two dimensional");
+	  /* contour and overlay data are re-read only when the slice
+	     changes, not for every input file */
+	  if (contour_fname && !collect_range
+	      && contour_slice != islice_index) {
+	       if (verbose)
+		    printf("reading contour data from \"%s\".\n",
+			   contour_fname);
+
+	       err = read_slice(&contour_buf, contour_h, data_rank,
+				slicedim, islice, center_slice);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       contour_data = contour_buf.a;
+	       CHECK(contour_data.rank == 1 || contour_data.rank == 2,
+		     "contour slice must be one or two dimensional");
+
+	       if (!mask_thresh_set) {
+		    double c_min, c_max;
+		    arrayh5_getrange(contour_data, &c_min, &c_max);
+		    contour_thresh = (c_min + c_max) * 0.5;
+	       }
+	       contour_slice = islice_index;
+	  }
+	  if (contour_data.data) {
+	       cnx = contour_data.dims[0];
+	       cny = contour_data.rank >= 2 ? contour_data.dims[1] : 1;
+	  }
 
-	  onx = overlay_data.dims[0];
-	  ony = overlay_data.rank >= 2 ? overlay_data.dims[1] : 1;
+	  if (overlay_fname && !collect_range
+	      && overlay_slice != islice_index) {
+	       if (verbose)
+		    printf("reading overlay data from \"%s\".\n",
+			   overlay_fname);
+
+	       err = read_slice(&overlay_buf, overlay_h, data_rank,
+				slicedim, islice, center_slice);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       overlay_data = overlay_buf.a;
+	       CHECK(overlay_data.rank == 1 || overlay_data.rank == 2,
+		     "overlay slice must be one or two dimensional");
+	       overlay_slice = islice_index;
+	  }
+	  if (overlay_data.data) {
+	       onx = overlay_data.dims[0];
+	       ony = overlay_data.rank >= 2 ? overlay_data.dims[1] : 1;
+	  }
 
-	  free(fname);
-     }
+	  h5_fname = split_fname(argv[optind + jfile], &dname);
+
+	  if (verbose) {
+	       int i;
+	       printf("reading from \"%s\"", h5_fname);
+	       for (i = 0; i < 4; ++i)
+		    if (slicedim[i] != NO_SLICE_DIM)
+			 printf(", slice at %d in %c dimension", islice[i],
+				slicedim[i] == LAST_SLICE_DIM ? 't'
+				: slicedim[i] + 'x');
+	       printf(".\n");
+	  }
 
-     if (verbose)
-	  printf("------\n");
-     for (ifile = optind; ifile < argc; ++ifile) {
-          char *dname, *h5_fname;
-          h5_fname = split_fname(argv[ifile], &dname);
-          if (!dname[0])
-               dname = data_name;
-
-          if (verbose) {
-               int i;
-               printf("reading from \"%s\"", h5_fname);
-               for (i = 0; i < 4; ++i)
-                    if (slicedim[i] != NO_SLICE_DIM)
-                         printf(", slice at %d in %c dimension", islice[i],
-                                slicedim[i] == LAST_SLICE_DIM ? 't'
-                                : slicedim[i] + 'x');
-               printf(".\n");
-          }
-
-	  err = arrayh5_read(&a, h5_fname, dname, NULL,
-			     4, slicedim, islice, center_slice);
+	  if (range_cache && range_cache[iframe].data) {
+	       a = range_cache[iframe];
+	       range_cache[iframe].data = NULL;
+	       cached = 1;
+	       err = 0;
+	  }
+	  else
+#ifdef _OPENMP
+#    pragma omp critical (hdf5)
+#endif
+	  {
+	       if (data_jfile != jfile) {
+		    arrayh5_close(data_h);
+		    data_h = open_dataset(argv[optind + jfile], data_name);
+		    data_jfile = jfile;
+	       }
+	       err = arrayh5_read_buffer(&abuf, data_h,
+					 4, slicedim, islice, center_slice);
+	       a = abuf.a;
+	  }
 	  CHECK(!err, arrayh5_read_strerror[err]);
 	  CHECK(a.rank >= 1, "data must have at least one dimension");
 	  CHECK(a.rank <= 2, "data can have at most two dimensions (try specifying a slice)");
 
-	  if (!png_fname) {
-	       char dimname[] = "xyzt", suff[1024] = "";
-	       int dim;
-	       for (dim = 0; dim < 4; ++dim)
-		    if (islice_max[dim] >= islice_min[dim]+islice_step[dim]) {
-			 char s[128];
-			 sprintf(s, ".%c%0*d", dimname[dim],
-				 1 + ilog10(imax(iabs(islice_min[dim]),
-						 iabs(islice_max[dim]))),
-				 islice[dim]);
-			 strcat(suff, s);
-		    }
-	       strcat(suff, ".png");
-	       png_fname = replace_suffix(h5_fname, ".h5", suff);
-	  }
-
 	  {
 	       double a_min, a_max;
 	       arrayh5_getrange(a, &a_min, &a_max);
 	       if (verbose)
 		    printf("data ranges from %g to %g.\n", a_min, a_max);
-	       if (!min_set)
-		    min = a_min;
-	       if (!max_set)
-		    max = a_max;
-	       if (!num_processed || a_min < allmin)
-		    allmin = a_min;
-	       if (!num_processed || a_max > allmax)
-		    allmax = a_max;
-	       if (min > max) {
-		    a_min = min;
-		    min = max;
-		    max = a_min;
+	       fmin = min_set ? min : a_min;
+	       fmax = max_set ? max : a_max;
+	       if (fmin > fmax) {
+		    double tmp = fmin;
+		    fmin = fmax;
+		    fmax = tmp;
 	       }
 	       if (zero_center) {
-		    if (!max_set || min_set || max <= 0)
-			 max = fabs(max) > fabs(min) ? fabs(max) : fabs(min);
-		    min = -max;
+		    if (!max_set || min_set || fmax <= 0)
+			 fmax = fabs(fmax) > fabs(fmin) ? fabs(fmax) : fabs(fmin);
+		    fmin = -fmax;
+	       }
+#ifdef _OPENMP
+#    pragma omp critical (range)
+#endif
+	       {
+		    if (!num_processed || a_min < allmin)
+			 allmin = a_min;
+		    if (!num_processed || a_max > allmax)
+			 allmax = a_max;
+		    ++num_processed;
+		    if (collect_range && range_cache_bytes + sizeof(double) * a.N
+			<= RANGE_CACHE_BYTES) {
+			 /* the cache takes over the buffer's storage */
+			 range_cache[iframe] = a;
+			 range_cache_bytes += sizeof(double) * a.N;
+			 abuf.a.dims = NULL;
+			 abuf.a.data = NULL;
+			 abuf.a.map = NULL;
+			 abuf.max_rank = abuf.max_N = 0;
+		    }
 	       }
 	  }
 
 	  if (!collect_range) {
+	       char *fname;
+	       int nx, ny;
+
+	       if (png_fname && iframe == 0)
+		    fname = my_strdup(png_fname);
+	       else {
+		    char dimname[] = "xyzt", suff[1024] = "";
+		    for (dim = 0; dim < 4; ++dim)
+			 if (islice_max[dim] >= islice_min[dim]+islice_step[dim]) {
+			      char s[128];
+			      sprintf(s, ".%c%0*d", dimname[dim],
+				      1 + ilog10(imax(iabs(islice_min[dim]),
+						      iabs(islice_max[dim]))),
+				      islice[dim]);
+			      strcat(suff, s);
+			 }
+		    strcat(suff, ".png");
+		    fname = output_fname(argv[optind + jfile], ".h5", suff);
+	       }
+
 	       nx = a.dims[0];
 	       ny = a.rank < 2 ? 1 : a.dims[1];
 
 	       if (verbose)
 		    printf("writing \"%s\" from %dx%d input data.\n",
-			   png_fname, nx, ny);
+			   fname, nx, ny);
 
-	       writepng(png_fname, nx, ny, !transpose, skew,
+#ifdef _OPENMP
+	       if (prefetch)
+		    omp_set_lock(&render_lock);
+#endif
+	       writepng(fname, nx, ny, !transpose, skew,
 			scaley, scalex, a.data,
-			contour_fname ? contour_data.data : NULL, mask_thresh,
-			cnx, cny,
+			contour_fname ? contour_data.data : NULL,
+			contour_thresh, cnx, cny,
 			overlay_fname ? overlay_data.data : NULL,overlay_cmap,
 			onx, ony,
-			min, max, cmap, eight_bit);
+			fmin, fmax, cmap, eight_bit, ws, &png_opts);
+#ifdef _OPENMP
+	       if (prefetch)
+		    omp_unset_lock(&render_lock);
+#endif
+	       free(fname);
 	  }
-	  arrayh5_destroy(a);
-	  free(png_fname); png_fname = NULL;
+	  if (cached)
+	       arrayh5_destroy(a);
 	  free(h5_fname);
-	  ++num_processed;
-     }
-
-     if (contour_data.data)
-	  arrayh5_destroy(contour_data);
-     if (overlay_data.data)
-	  arrayh5_destroy(overlay_data);
-     contour_data.data = overlay_data.data = NULL;
-
-     } /* islice loop */
+     } /* iframe loop */
 
+     {
+	  const writepng_stats *st = writepng_workspace_stats(ws);
+	  arrayh5_stats_add(ARRAYH5_STAGE_CONVERT, st->render_time,
+			    st->data_bytes);
+	  arrayh5_stats_add(ARRAYH5_STAGE_ENCODE, st->encode_time,
+			    st->image_bytes);
+	  arrayh5_stats_add(ARRAYH5_STAGE_WRITE, 0, st->png_bytes);
+     }
+     arrayh5_buffer_destroy(&abuf);
+     arrayh5_buffer_destroy(&contour_buf);
+     arrayh5_buffer_destroy(&overlay_buf);
+     writepng_workspace_destroy(ws);
+     } /* omp parallel */
+
+     if (arrayh5_mpi_size() > 1) {
+	  if (!num_processed) {
+	       allmin = HUGE_VAL;
+	       allmax = -HUGE_VAL;
+	  }
+	  arrayh5_mpi_range(&allmin, &allmax);
+	  num_processed = nframes;
+     }
      if (verbose && num_processed)
 	  printf("all data range from %g to %g.\n", allmin, allmax);
      if (collect_range) {
@@ -585,6 +777,15 @@ int main(int argc, char **argv)
 	  goto process_files;
      }
 
+#ifdef _OPENMP
+     omp_destroy_lock(&render_lock);
+#endif
+     arrayh5_close(data_h);
+     free(range_cache);
+     arrayh5_close(contour_h);
+     arrayh5_close(overlay_h);
+
+     free(png_fname);
      free(contour_fname);
      free(overlay_fname);
      free(data_name);
@@ -592,6 +793,7 @@ int main(int argc, char **argv)
      if (cmap.rgba != gray_colors)
 	  free(cmap.rgba);
      free(colormap);
+     free_fname_args(argc, argv, optind);
 
      return EXIT_SUCCESS;
 }
@@ -49,14 +49,68 @@ void usage(FILE *f)
 	     "         -0 : use dataset center as origin for -x/-y/-z\n"
 	     "         -T : transpose the data [default: no]\n"
 	     "     -. <n> : output <n> decimal places [ default: 16 ]\n"
+	     "     -j <n> : format the output using <n> threads in parallel [default: 1]\n"
+	     "         -S : stream the data a slab at a time, rather than reading\n"
+	     "              it all into memory first\n"
 	     "  -d <name> : use dataset <name> in the input files (default: first dataset)\n"
 	     "              -- you can also specify a dataset via <filename>:<name>\n"
 	  );
 }
 
+/* Output is formatted in blocks of TXT_BLOCK numbers per thread into
+   memory buffers, which are then written in order, rather than by one
+   fprintf call per number. */
+#define TXT_BLOCK 16384
+
+/* With -S, the data are read and written in slabs of rows of about
+   STREAM_BYTES each, so that the memory use is bounded regardless of
+   the size of the dataset. */
+#define STREAM_BYTES (64 * 1024 * 1024)
+
+/* format elements i0..i1-1 of a rank-dimensional array into buf, with
+   the separators, newlines, etcetera that precede each number
+   (where there are nline numbers per line, and nblank per group of
+   lines for rank 3), returning the number of bytes; data points
+   to element i0 */
+static size_t format_block(char *buf, const double *data, int i0, int i1,
+			   int rank, int nline, int nblank,
+			   const char *sep, size_t seplen, int dec)
+{
+     char *p = buf;
+     int i;
+
+     for (i = i0; i < i1; ++i) {
+	  if (rank > 3 || (i > 0 && i % nline)) {
+	       memcpy(p, sep, seplen);
+	       p += seplen;
+	  }
+	  else if (i > 0) {
+	       *p++ = '\n';
+	       if (rank == 3 && i % nblank == 0)
+		    *p++ = '\n';
+	  }
+	  p += format_double(p, data[i - i0], dec);
+     }
+     return p - buf;
+}
+
+
+/* update *min and *max with the range [min1, max1] of some data
+   (NaN if they are all NaN) */
+static void update_range(double min1, double max1, int *have_range,
+			 double *min, double *max)
+{
+     if (min1 != min1)
+	  return;
+     if (!*have_range || min1 < *min)
+	  *min = min1;
+     if (!*have_range || max1 > *max)
+	  *max = max1;
+     *have_range = 1;
+}
+
 int main(int argc, char **argv)
 {
-     arrayh5 a;
      char *txt_fname = NULL, *data_name = NULL;
      extern char *optarg;
      extern int optind;
@@ -68,12 +122,20 @@ int main(int argc, char **argv)
      int dec = 16;
      int verbose = 0;
      int transpose = 0;
+     int stream = 0;
      char *sep;
      int ifile;
+     int nthreads = 1;
+     char **bufs;
+     size_t *lens;
+     double *data = NULL, *vals; /* data is reused for all of the files */
+     int data_size = 0;
+     arrayh5_buffer abuf; /* for whole slices (possibly mmap()ed) */
 
      sep = my_strdup(",");
+     arrayh5_buffer_init(&abuf);
 
-     while ((c = getopt(argc, argv, "ho:x:y:z:t:0ad:vTs:.:V")) != -1)
+     while ((c = getopt(argc, argv, "ho:x:y:z:t:0ad:vTs:.:Vj:S")) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -91,6 +153,9 @@ int main(int argc, char **argv)
 	      case 'T':
 		   transpose = 1;
 		   break;
+	      case 'S':
+		   stream = 1;
+		   break;
 	      case 'o':
 		   free(txt_fname);
                    txt_fname = my_strdup(optarg);
@@ -106,6 +171,10 @@ int main(int argc, char **argv)
 	      case '.':
 		   dec = atoi(optarg);
 		   break;
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
 	      case 'x':
 		   islice[0] = atoi(optarg);
 		   slicedim[0] = 0;
@@ -136,14 +205,29 @@ int main(int argc, char **argv)
 	  return EXIT_FAILURE;
      }
 
+#ifndef _OPENMP
+     if (nthreads > 1)
+	  fprintf(stderr, "h5totxt: compiled without OpenMP; ignoring -j\n");
+#endif
+     arrayh5_stats_init("h5totxt", verbose);
+     argv = expand_fname_args(&argc, argv, optind);
+
+     bufs = (char **) malloc(sizeof(char *) * nthreads);
+     lens = (size_t *) malloc(sizeof(size_t) * nthreads);
+     CHECK(bufs && lens, "out of memory");
+
      for (ifile = optind; ifile < argc; ++ifile) {
 	  char *dname, *h5_fname;
+	  arrayh5_handle *h;
+	  int rank, *dims, N, nrows, rowN, nbrows, i;
+	  double a_min = 0, a_max = 0;
+	  int have_range = 0;
+
 	  h5_fname = split_fname(argv[ifile], &dname);
 	  if (!dname[0])
 	       dname = data_name;
 
 	  if (verbose) {
-	       int i;
 	       printf("reading from \"%s\"", h5_fname);
 	       for (i = 0; i < 4; ++i)
 		    if (slicedim[i] != NO_SLICE_DIM)
@@ -152,33 +236,86 @@ int main(int argc, char **argv)
 				: slicedim[i] + 'x');
 	       printf(".\n");
 	  }
-	  
-	  err = arrayh5_read(&a, h5_fname, dname, NULL,
-			     4, slicedim, islice, center_slice);
-	  CHECK(!err, arrayh5_read_strerror[err]);
 
+	  err = arrayh5_open(&h, h5_fname, dname);
+	  CHECK(!err, arrayh5_read_strerror[err]);
+	  dims = (int *) malloc(sizeof(int) * (arrayh5_handle_rank(h) + 1));
+	  CHECK(dims, "out of memory");
+	  err = arrayh5_slice_dims(h, 4, slicedim, islice, center_slice,
+				   &rank, dims);
+	  CHECK(!err, arrayh5_read_strerror[err]);
 	  if (transpose)
-	       arrayh5_transpose(&a);
+	       for (i = 0; i < rank / 2; ++i) {
+		    int d = dims[i];
+		    dims[i] = dims[rank - 1 - i];
+		    dims[rank - 1 - i] = d;
+	       }
+	  for (N = 1, i = 0; i < rank; ++i)
+	       N *= dims[i];
 
-	  {
-	       double a_min, a_max;
-	       arrayh5_getrange(a, &a_min, &a_max);
-	       if (verbose)
+	  /* the (transposed) slice is read nbrows rows of its first
+	     dimension at a time: all of it, unless we are streaming */
+	  nrows = rank > 0 ? dims[0] : 1;
+	  rowN = nrows > 0 ? N / nrows : 0;
+	  nbrows = nrows;
+	  if (stream && rowN > 0) {
+	       nbrows = STREAM_BYTES / (sizeof(double) * rowN);
+	       if (!transpose) {
+		    int chunk = arrayh5_slice_chunk_rows(h, 4, slicedim,
+							 islice, center_slice);
+		    if (nbrows > chunk)
+			 nbrows -= nbrows % chunk;
+	       }
+	       if (nbrows < 1)
+		    nbrows = 1;
+	       if (nbrows > nrows)
+		    nbrows = nrows;
+	  }
+	  if ((transpose || nbrows < nrows) && nbrows * rowN + 1 > data_size) {
+	       free(data);
+	       data_size = nbrows * rowN + 1;
+	       data = (double *) malloc(sizeof(double) * data_size);
+	       CHECK(data, "out of memory");
+	  }
+
+	  vals = data;
+	  if (nbrows == nrows) {
+	       if (transpose)
+		    err = arrayh5_read_transposed_rows(h, 4, slicedim, islice,
+						       center_slice, 0, nrows,
+						       data);
+	       else {
+		    err = arrayh5_read_buffer(&abuf, h, 4, slicedim, islice,
+					      center_slice);
+		    vals = abuf.a.data;
+	       }
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       CHECK(N > 0, "no elements in array");
+	       if (verbose) { /* the range is only needed for printing */
+		    double min1, max1;
+		    if (transpose)
+			 arrayh5_range(vals, N, nthreads, &min1, &max1);
+		    else /* (possibly known from the file) */
+			 arrayh5_getrange_threads(abuf.a, nthreads,
+						  &min1, &max1);
+		    update_range(min1, max1, &have_range, &a_min, &a_max);
 		    printf("data ranges from %.*g to %.*g.\n",
 			   dec, a_min, dec, a_max);
+	       }
 	  }
 	  
-	  nx = a.rank < 1 ? 1 : a.dims[0];
-	  ny = a.rank < 2 ? 1 : a.dims[1];
-	  nz = a.rank < 3 ? 1 : a.dims[2];
+	  nx = rank < 1 ? 1 : dims[0];
+	  ny = rank < 2 ? 1 : dims[1];
+	  nz = rank < 3 ? 1 : dims[2];
 	  
-	  if (verbose && a.rank <= 3)
+	  if (verbose && rank <= 3)
 	       printf("writing %s from %dx%dx%d input data.\n",
 		      txt_fname ? txt_fname : "to stdout", nx, ny, nz);
 
 	  {
 	       FILE *f;
-	       int i, j, k;
+	       int nline, nblank, r0;
+	       size_t seplen, maxlen;
 
 	       if (txt_fname) {
 		    f = fopen(txt_fname, "w");
@@ -187,49 +324,110 @@ int main(int argc, char **argv)
 	       else
 		    f = stdout;
 	       
-	       if (a.rank < 3)
-		    for (i = 0; i < nx; ++i) {
-			 if (ny > 0)
-			      fprintf(f, "%.*g", dec, a.data[i*ny + 0]);
-			 for (j = 1; j < ny; ++j)
-			      fprintf(f, "%s%.*g", sep, dec, a.data[i*ny + j]);
-			 fprintf(f, "\n");
-		    }
-	       else if (a.rank == 3)
-		    for (i = 0; i < nx; ++i) {
-			 if (i > 0)
-			      fprintf(f, "\n");
-			 for (j = 0; j < ny; ++j) {
-			      int ij = nz * (ny * i + j);
-			      if (nz > 0)
-				   fprintf(f, "%.*g", dec, a.data[ij + 0]);
-			      for (k = 1; k < nz; ++k)
-				   fprintf(f, "%s%.*g",
-					   sep, dec, a.data[ij + k]);
-			      fprintf(f, "\n");
+	       /* lines of ny (rank < 3) or nz (rank 3) numbers, with a
+		  blank line between each of the nx groups of ny lines
+		  for rank 3, and all on one line (after an extra copy
+		  of the first number) for rank > 3 */
+	       nline = rank < 3 ? ny : nz;
+	       nblank = ny * nz;
+	       seplen = strlen(sep);
+	       maxlen = FORMAT_DOUBLE_MAXLEN(dec) + (seplen > 2 ? seplen : 2);
+	       for (i = 0; i < nthreads; ++i) {
+		    bufs[i] = (char *) malloc(maxlen * TXT_BLOCK);
+		    CHECK(bufs[i], "out of memory");
+	       }
+
+	       for (r0 = 0; r0 < nrows; r0 += nbrows) {
+		    int nr = r0 + nbrows <= nrows ? nbrows : nrows - r0;
+		    int base = r0 * rowN, end = base + nr * rowN;
+		    double t0, write_time = 0, write_bytes = 0;
+
+		    if (nbrows < nrows) {
+			 if (transpose)
+			      err = arrayh5_read_transposed_rows(
+				   h, 4, slicedim, islice, center_slice,
+				   r0, nr, data);
+			 else
+			      err = arrayh5_read_rows(h, 4, slicedim, islice,
+						      center_slice, r0, nr,
+						      data);
+			 CHECK(!err, arrayh5_read_strerror[err]);
+			 if (verbose && nr * rowN > 0) {
+			      double min1, max1;
+			      arrayh5_range(data, nr * rowN, nthreads,
+					    &min1, &max1);
+			      update_range(min1, max1, &have_range,
+					   &a_min, &a_max);
 			 }
 		    }
-	       else {
-		    if (a.N > 0)
-			 fprintf(f, "%.*g", dec, a.data[0]);
-		    for (i = 0; i < a.N; ++i) {
-			 fprintf(f, "%s%.*g", sep, dec, a.data[i]);
+
+		    t0 = arrayh5_stats_start();
+		    if (rank > 3 && r0 == 0 && end > 0)
+			 fwrite(bufs[0], 1,
+				format_double(bufs[0], vals[0], dec), f);
+#ifdef _OPENMP
+#    pragma omp parallel num_threads(nthreads) private(i)
+#endif
+		    for (i = base; i < end; i += TXT_BLOCK * nthreads) {
+			 int t;
+#ifdef _OPENMP
+#    pragma omp for schedule(static, 1)
+#endif
+			 for (t = 0; t < nthreads; ++t) {
+			      int i0 = i + t * TXT_BLOCK;
+			      int i1 = i0 + TXT_BLOCK < end
+				   ? i0 + TXT_BLOCK : end;
+			      lens[t] = i0 < i1
+				   ? format_block(bufs[t], vals + (i0 - base),
+						  i0, i1, rank, nline, nblank,
+						  sep, seplen, dec)
+				   : 0;
+			 }
+#ifdef _OPENMP
+#    pragma omp single
+#endif
+			 {
+			      double tw = arrayh5_stats_start();
+			      for (t = 0; t < nthreads; ++t) {
+				   fwrite(bufs[t], 1, lens[t], f);
+				   write_bytes += lens[t];
+			      }
+			      write_time += arrayh5_stats_start() - tw;
+			 }
 		    }
-		    fprintf(f, "\n");
+		    arrayh5_stats_add(ARRAYH5_STAGE_CONVERT,
+				      arrayh5_stats_start() - t0 - write_time,
+				      sizeof(double) * (double) (end - base));
+		    arrayh5_stats_add(ARRAYH5_STAGE_WRITE, write_time,
+				      write_bytes);
 	       }
+	       fprintf(f, "\n");
 
+	       for (i = 0; i < nthreads; ++i)
+		    free(bufs[i]);
 	       if (txt_fname)
 		    fclose(f);
 	  }
 
-	  arrayh5_destroy(a);
+	  /* when streaming, we only know the range at the end */
+	  if (nbrows < nrows && verbose)
+	       printf("data ranges from %.*g to %.*g.\n",
+		      dec, a_min, dec, a_max);
+
+	  free(dims);
+	  arrayh5_close(h);
 	  if (txt_fname)
 	       free(txt_fname);
 	  txt_fname = NULL;
 	  free(h5_fname);
      }
+     free(data);
+     arrayh5_buffer_destroy(&abuf);
+     free(lens);
+     free(bufs);
      free(sep);
      free(data_name);
+     free_fname_args(argc, argv, optind);
 
      return EXIT_SUCCESS;
 }
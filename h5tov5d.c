@@ -61,6 +61,201 @@ void usage(FILE *f)
 	  );
 }
 
+/* Each file (or each variable of a 5d file) is read a few time steps
+   at a time, in reads of at most this many bytes, rather than all at
+   once. */
+#define READ_BYTES (64*1024*1024)
+
+/* block size for the cache-friendly transpose in grid_to_float */
+#define TRANSPOSE_BLOCK 32
+
+/* A dataset to be written to Vis5D, read via the rows of its
+   transposed slice: for rank >= 4, each row is one time step of the
+   (column-major) nv x n[0] x n[1] x n[2] grids. */
+typedef struct {
+     arrayh5_handle *h;
+     int nv;               /* number of variables (1 unless 5d) */
+     int n[3];             /* dimensions of each grid */
+     int rows_per_step;    /* rows of the transposed slice per time step */
+     int steps_per_read;   /* time steps per read */
+} v5d_source;
+
+/* Get the dimensions etc. of the slice of h, returning the number of
+   time steps; the other parameters are as for output_v5d. */
+static int init_v5d_source(v5d_source *src, arrayh5_handle *h,
+			   int nslicedim, const int *slicedim,
+			   const int *islice, const int *center_slice)
+{
+     int err, rank, *dims, fdim, rgrid, k, numTimes, G;
+
+     dims = (int *) malloc(sizeof(int) * (arrayh5_handle_rank(h) + 1));
+     CHECK(dims, "out of memory");
+     err = arrayh5_slice_dims(h, nslicedim, slicedim, islice, center_slice,
+			      &rank, dims);
+     CHECK(!err, arrayh5_read_strerror[err]);
+     CHECK(rank >= 1, "data must have at least one dimension");
+     CHECK(rank <= 5, "data cannot have more than 5 dimensions");
+
+     /* if the data is 4 dimensional, express that by using different
+	times; if it is 5 dimensional, also use different variables */
+     numTimes = rank < 4 ? 1 : dims[rank - 1];
+     fdim = rank <= 4 ? 0 : rank - 4;
+     rgrid = rank < 4 ? rank : rank - 1;
+     src->h = h;
+     src->nv = rank < 5 ? 1 : dims[0];
+     for (k = 0; k < 3; ++k)
+	  src->n[k] = fdim + k < rgrid ? dims[fdim + k] : 1;
+     src->rows_per_step = rank < 4 ? dims[rank - 1] : 1;
+
+     G = src->nv * src->n[0] * src->n[1] * src->n[2];
+     src->steps_per_read = READ_BYTES / (sizeof(double) * (G > 0 ? G : 1));
+     if (src->steps_per_read < 1)
+	  src->steps_per_read = 1;
+     if (src->steps_per_read > numTimes)
+	  src->steps_per_read = numTimes;
+
+     free(dims);
+     return numTimes;
+}
+
+/* Convert variable iv of the nv interleaved, column-major n[0] x n[1]
+   x n[2] grids in d to the float grid g that Vis5D expects: the same
+   (column-major) order, or the transposed (row-major) order if
+   transpose is true. */
+static void grid_to_float(float *g, const double *d, int iv, int nv,
+			  const int *n, int transpose)
+{
+     int n0 = n[0], n1 = n[1], n2 = n[2];
+
+     d += iv;
+     if (!transpose) {
+	  int j, G = n0 * n1 * n2;
+	  for (j = 0; j < G; ++j)
+	       g[j] = d[j * nv];
+     }
+     else {
+	  int i0, i1, i2, b0, b2;
+	  for (b2 = 0; b2 < n2; b2 += TRANSPOSE_BLOCK) {
+	       int e2 = b2 + TRANSPOSE_BLOCK < n2 ? b2 + TRANSPOSE_BLOCK : n2;
+	       for (b0 = 0; b0 < n0; b0 += TRANSPOSE_BLOCK) {
+		    int e0 = b0 + TRANSPOSE_BLOCK < n0
+			 ? b0 + TRANSPOSE_BLOCK : n0;
+		    for (i1 = 0; i1 < n1; ++i1)
+			 for (i2 = b2; i2 < e2; ++i2)
+			      for (i0 = b0; i0 < e0; ++i0)
+				   g[i2 + n2 * (i1 + n1 * i0)] =
+					d[(i0 + n0 * (i1 + n1 * i2)) * nv];
+	       }
+	  }
+     }
+}
+
+/* Read the time steps it0 to it0+nt-1 of src into buf. */
+static int read_v5d_steps(v5d_source *src,
+			  int nslicedim, const int *slicedim,
+			  const int *islice, const int *center_slice,
+			  int it0, int nt, double *buf)
+{
+     return arrayh5_read_transposed_rows(src->h, nslicedim, slicedim,
+					 islice, center_slice,
+					 it0 * src->rows_per_step,
+					 nt * src->rows_per_step, buf);
+}
+
+/* Write the data of the sources (whose variables are numbered
+   consecutively) to the current v5d file.  The next block of time
+   steps is read (on another thread, if OpenMP is available) while the
+   previous one is converted and passed to v5dWrite. */
+static void write_v5d_sources(v5d_source *src, int nsrc, int NumTimes,
+			      int nslicedim, const int *slicedim,
+			      const int *islice, const int *center_slice,
+			      int transpose)
+{
+     double *buf[2];
+     float *g;
+     int is, k, max_read = 0, max_grid = 0;
+     int cur_s = 0, cur_t = 0, cur_nt, cur_v0 = 0, err = 0;
+
+     for (is = 0; is < nsrc; ++is) {
+	  int G = src[is].n[0] * src[is].n[1] * src[is].n[2];
+	  if (G > max_grid)
+	       max_grid = G;
+	  if (G * src[is].nv * src[is].steps_per_read > max_read)
+	       max_read = G * src[is].nv * src[is].steps_per_read;
+     }
+     for (k = 0; k < 2; ++k) {
+	  buf[k] = (double *) malloc(sizeof(double) * (max_read + 1));
+	  CHECK(buf[k], "out of memory");
+     }
+     g = (float *) malloc(sizeof(float) * (max_grid + 1));
+     CHECK(g, "out of memory");
+
+     cur_nt = src[0].steps_per_read;
+     err = read_v5d_steps(&src[0], nslicedim, slicedim, islice,
+			  center_slice, 0, cur_nt, buf[0]);
+     CHECK(!err, arrayh5_read_strerror[err]);
+
+     for (k = 0; cur_s < nsrc; k = 1 - k) {
+	  int next_s = cur_s, next_t = cur_t + cur_nt, next_nt = 0;
+	  int next_v0 = cur_v0, read_err = 0, write_ok = 1;
+
+	  if (next_t >= NumTimes) {
+	       next_v0 += src[cur_s].nv;
+	       next_s = cur_s + 1;
+	       next_t = 0;
+	  }
+	  if (next_s < nsrc) {
+	       next_nt = src[next_s].steps_per_read;
+	       if (next_nt > NumTimes - next_t)
+		    next_nt = NumTimes - next_t;
+	  }
+
+#ifdef _OPENMP
+#    pragma omp parallel sections num_threads(2)
+#endif
+	  {
+#ifdef _OPENMP
+#    pragma omp section
+#endif
+	       if (next_s < nsrc)
+		    read_err = read_v5d_steps(&src[next_s], nslicedim,
+					      slicedim, islice, center_slice,
+					      next_t, next_nt, buf[1 - k]);
+#ifdef _OPENMP
+#    pragma omp section
+#endif
+	       {
+		    v5d_source *s = &src[cur_s];
+		    int G = s->n[0] * s->n[1] * s->n[2], it, iv;
+		    for (it = 0; it < cur_nt && write_ok; ++it)
+			 for (iv = 0; iv < s->nv && write_ok; ++iv) {
+			      double t0 = arrayh5_stats_start();
+			      grid_to_float(g, buf[k] + it * s->nv * G,
+					    iv, s->nv, s->n, transpose);
+			      arrayh5_stats_stop(ARRAYH5_STAGE_CONVERT, t0,
+						 sizeof(double) * (double) G);
+			      t0 = arrayh5_stats_start();
+			      write_ok = v5dWrite(cur_t + it + 1,
+						  cur_v0 + iv + 1, g);
+			      arrayh5_stats_stop(ARRAYH5_STAGE_WRITE, t0,
+						 sizeof(float) * (double) G);
+			 }
+	       }
+	  }
+	  CHECK(!read_err, arrayh5_read_strerror[read_err]);
+	  CHECK(write_ok, "error writing v5d output");
+
+	  cur_s = next_s;
+	  cur_t = next_t;
+	  cur_nt = next_nt;
+	  cur_v0 = next_v0;
+     }
+
+     free(g);
+     free(buf[1]);
+     free(buf[0]);
+}
+
 /* The following routine was adapted from convert/foo2_to_v5d.c from
    Vis5D 4.2, which is Copyright (C) 1990-1997 Bill Hibbard, Johan
    Kellum, Brian Paul, Dave Santek, and Andre Battaiola, and is
@@ -73,9 +268,9 @@ void output_v5d(char *v5d_fname, char *data_label,
 {
      char *data_name;
      char *fname;
-     arrayh5 a;
-     int it, iv, firstdim, ifile;
-     float *g = 0;
+     arrayh5_handle **h = 0;
+     v5d_source *src;
+     int it, iv, ifile, nsrc;
 
      /** Parameters to v5dCreate: */
      int NumTimes;                      /* number of time steps */
@@ -93,49 +288,52 @@ void output_v5d(char *v5d_fname, char *data_label,
      if (num_h5 <= 0)
 	  return;
 
-     for (ifile = 0; ifile < num_h5; ++ifile) {
-	  int err;
-	  fname = split_fname(h5_fnames[ifile], &data_name);
-	  if (!data_name[0]) data_name = data_label;
-	  err = arrayh5_read(&a, fname, data_name, NULL, 
-			     nslicedim, slicedim, islice, center_slice);
-	  free(fname);
-	  CHECK(!err, arrayh5_read_strerror[err]);
-	  CHECK(a.rank >= 1, "data must have at least one dimension");
-	  CHECK(a.rank <= 5, "data cannot have more than 5 dimensions");
-
-
-	  /* if the data is 4 dimensional, express that by using
-	     different times and/or variables */
-	  NumTimes = a.rank < 4 ? 1 : a.dims[a.rank - 1];
+     /* the datasets are opened before reading them, so that their
+	dimensions can be checked up front; when joining, one v5d file
+	is written for all of them, so they are all opened at once */
+     h = (arrayh5_handle **) malloc(sizeof(arrayh5_handle *) * num_h5);
+     CHECK(h, "out of memory");
+     src = (v5d_source *) malloc(sizeof(v5d_source) * num_h5);
+     CHECK(src, "out of memory");
+     for (ifile = 0; ifile < num_h5; ifile += nsrc) {
+	  nsrc = join ? num_h5 : 1;
+	  for (iv = ifile; iv < ifile + nsrc; ++iv) {
+	       int err;
+	       fname = split_fname(h5_fnames[iv], &data_name);
+	       if (!data_name[0]) data_name = data_label;
+	       err = arrayh5_open(&h[iv], fname, data_name);
+	       free(fname);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	  }
+
+	  NumTimes = init_v5d_source(&src[ifile], h[ifile], nslicedim,
+				     slicedim, islice, center_slice);
 	  CHECK(NumTimes <= MAXTIMES, "too many time steps");
-	  firstdim = a.rank <= 4 ? 0 : a.rank - 4;
 
 	  /* If the data is 5 dimensional, express that by using different
 	     variables.  Alternatively, if we are joining, the different
 	     variables are the different files; in that case, the data
 	     cannot be 5d. */
-	  NumVars = a.rank < 5 ? 1 : a.dims[0];
+	  NumVars = src[ifile].nv;
 	  if (join) {
 	       CHECK(NumVars == 1, "cannot join 5d datasets");
 	       NumVars = num_h5;
 	  }
 	  CHECK(NumVars <= MAXVARS, "too many vars");
 
+	  /* HDF5 gives us the data in row-major order, while Vis5D
+	     expects it in column-major order, so we read the transposed
+	     data (we could avoid physically transposing the data by
+	     passing Vis5d transposed dimensions, but that seems ugly). */
 	  if (!transpose) {
-	       /* we will need to transpose the data, since HDF5 gives
-		  us the data in row-major order, while Vis5D expects
-		  it in column-major order (we could avoid physically
-		  transposing the data by passing Vis5d transposed
-		  dimensions, but that seems ugly). */
-	       Nr = firstdim >= a.rank ? 1 : a.dims[firstdim];
-	       Nc = firstdim+1 >= a.rank ? 1 : a.dims[firstdim+1];
-	       Nl[0] = firstdim+2 >= a.rank ? 1 : a.dims[firstdim+2];
+	       Nr = src[ifile].n[0];
+	       Nc = src[ifile].n[1];
+	       Nl[0] = src[ifile].n[2];
 	  }
 	  else {
-	       Nr = firstdim+2 >= a.rank ? 1 : a.dims[firstdim+2];
-	       Nc = firstdim+1 >= a.rank ? 1 : a.dims[firstdim+1];
-	       Nl[0] = firstdim >= a.rank ? 1 : a.dims[firstdim];
+	       Nr = src[ifile].n[2];
+	       Nc = src[ifile].n[1];
+	       Nl[0] = src[ifile].n[0];
 	  }
 
 	  if (!v5d_fname) {
@@ -144,60 +342,41 @@ void output_v5d(char *v5d_fname, char *data_label,
 	       free(fname);
 	  }
 
-	  if (join && ifile == 0) {
-	       arrayh5_destroy(a); /* destroy while we check other datasets */
-
+	  if (join) {
 	       /* loop to assign VarName[] and Nl[] arrays: */
 	       for (iv = 0; iv < NumVars; ++iv) {
 		    char *name;
-		    int numTimes, nr, nc, fdim;
+		    int numTimes, nr, nc;
 
 		    fname = split_fname(h5_fnames[iv], &data_name);
 		    name =  replace_suffix(fname, ".h5", 
 					   data_name[0] ? data_name - 1 : "");
-		    if (!data_name[0]) data_name = data_label;
+		    free(fname);
 
 		    for (it = 0; it < 9 && name[it]; ++it)
 			 VarName[iv][it] = name[it];
 		    VarName[iv][it] = 0;
 		    free(name);
 
-		    /* we don't really have to read the whole array;
-		       if we called HDF5 routines directly, we could just
-		       get the dimensions...oh well */
-		    err = arrayh5_read(&a, fname, data_name, NULL, 
-				       nslicedim, slicedim,
-				       islice, center_slice);
-		    CHECK(!err, arrayh5_read_strerror[err]);
-		    free(fname);
-		    
-		    numTimes = a.rank < 4 ? 1 : a.dims[a.rank - 1];
-		    fdim = a.rank <= 4 ? 0 : a.rank - 4;
+		    numTimes = init_v5d_source(&src[iv], h[iv], nslicedim,
+					       slicedim, islice,
+					       center_slice);
+		    CHECK(src[iv].nv == 1, "cannot join 5d datasets");
 		    if (!transpose) {
-			 nr = fdim >= a.rank ? 1 : a.dims[fdim];
-			 nc = fdim+1 >= a.rank ? 1 : a.dims[fdim+1];
-			 Nl[iv] = fdim+2 >= a.rank ? 1 : a.dims[fdim+2];
+			 nr = src[iv].n[0];
+			 nc = src[iv].n[1];
+			 Nl[iv] = src[iv].n[2];
 		    }
 		    else {
-			 nr = fdim+2 >= a.rank ? 1 : a.dims[fdim+2];
-			 nc = fdim+1 >= a.rank ? 1 : a.dims[fdim+1];
-			 Nl[iv] = fdim >= a.rank ? 1 : a.dims[fdim];
+			 nr = src[iv].n[2];
+			 nc = src[iv].n[1];
+			 Nl[iv] = src[iv].n[0];
 		    }
 		    CHECK(numTimes == NumTimes && nr == Nr && nc == Nc, 
 			  "datasets to be joined must have same dimensions");
-
-		    arrayh5_destroy(a);
 	       }
-
-	       /* read first array back in */
-	       fname = split_fname(h5_fnames[ifile], &data_name);
-	       if (!data_name[0]) data_name = data_label;
-	       err = arrayh5_read(&a, fname, data_name, NULL,
-				  nslicedim, slicedim, islice, center_slice);
-	       CHECK(!err, arrayh5_read_strerror[err]);
-	       free(fname);
 	  }
-	  else if (!join) {
+	  else {
 	       if (data_label) {
 		    for (it = 0; it < 9 && data_label[it]; ++it)
 			 VarName[0][it] = data_label[it];
@@ -240,52 +419,28 @@ void output_v5d(char *v5d_fname, char *data_label,
 	  VertArgs[1] = 1.0;  /* spacing between levels */
 
 	  /* use v5dCreate call to create the v5d file and write the header */
-	  if (!join || ifile == 0) {
-	       CHECK(v5dCreate(v5d_fname, NumTimes, NumVars, Nr, Nc, Nl,
-			       VarName, TimeStamp, DateStamp, CompressMode,
-			       Projection, ProjArgs, Vertical, VertArgs),
-		     "couldn't create v5d file");
-	  }
+	  CHECK(v5dCreate(v5d_fname, NumTimes, NumVars, Nr, Nc, Nl,
+			  VarName, TimeStamp, DateStamp, CompressMode,
+			  Projection, ProjArgs, Vertical, VertArgs),
+		"couldn't create v5d file");
 	  
 	  /* may call v5dSetLowLev() or v5dSetUnits() here; see Vis5d README */
 
-	  /* allocate array for copying transpose of data: */
-	  g = (float *) malloc(sizeof(float) * Nr * Nc * Nl[0]);
-	  CHECK(g, "out of memory!");
-
-	  for (iv = join ? ifile : 0; iv < (join ? ifile + 1 : NumVars); ++iv)
-	       for (it = 0; it < NumTimes; ++it) {
-		    double *d = a.data + it +
-			 (join ? 0 : iv) * NumTimes * Nr * Nc * Nl[0];
-
-		    if (!transpose) {
-			 int ir, ic, il;
-			 for (ir = 0; ir < Nr; ++ir)
-			      for (ic = 0; ic < Nc; ++ic)
-				   for (il = 0; il < Nl[0]; ++il)
-					g[ir + Nr * (ic + Nc * il)] =
-					     d[(il + Nl[0] * (ic + Nc * ir))
-					       * NumTimes];
-		    }
-		    else {
-			 int id;
-			 for (id = 0; id < Nr * Nc * Nl[0]; ++id)
-			      g[id] = d[id * NumTimes];
-		    }
-		    CHECK(v5dWrite(it + 1, iv + 1, g),
-			  "error writing v5d output"); 
-	       }
+	  write_v5d_sources(&src[ifile], nsrc, NumTimes,
+			    nslicedim, slicedim, islice, center_slice,
+			    transpose);
 	  
-	  free(g);
-	  
-	  if (!join || ifile == num_h5 - 1)
-	       v5dClose();
+	  v5dClose();
+	  for (iv = ifile; iv < ifile + nsrc; ++iv)
+	       arrayh5_close(h[iv]);
 
-	  arrayh5_destroy(a);
 	  if (v5d_fname)
 	       free(v5d_fname);
 	  v5d_fname = NULL;
      }
+
+     free(src);
+     free(h);
 }
 
 int main(int argc, char **argv)
@@ -369,6 +524,9 @@ int main(int argc, char **argv)
 	  return EXIT_FAILURE;
      }
 
+     arrayh5_stats_init("h5tov5d", verbose);
+     argv = expand_fname_args(&argc, argv, optind);
+
      output_v5d(v5d_fname, data_name, 
 		4, slicedim, islice, center_slice,
 		store_bytes, transpose,
@@ -376,6 +534,7 @@ int main(int argc, char **argv)
 
      if (data_name)
 	  free(data_name);
+     free_fname_args(argc, argv, optind);
 
      return EXIT_SUCCESS;
 }
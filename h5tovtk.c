@@ -85,6 +85,12 @@ void usage(FILE *f)
 	     "         -0 : use dataset center as origin for -x/-y/-z\n"
 	     "  -d <name> : use dataset <name> in the input files (default: first dataset)\n"
 	     "              -- you can also specify a dataset via <filename>:<name>\n"
+	     "     -j <n> : convert the data using <n> threads in parallel [default: 1]\n"
+	     "         -X : VTK XML ImageData (.vti) output\n"
+	     "         -c : zlib-compress the data of XML output\n"
+	     "     -P <n> : parallel XML output (.pvti) split into <n> pieces\n"
+	     "         -S : stream the data a slab at a time, rather than reading\n"
+	     "              it all into memory first\n"
 	  );
 }
 
@@ -97,6 +103,9 @@ static void whitespace_to_underscores(char *s)
      }
 }
 
+/* size of the output buffer for the converted data */
+#define VTK_BUFSIZE (1<<20)
+
 static const char vtk_datatype[][20] = { 
      "float", "unsigned_char", "unsigned_short", "none", "float"
 };
@@ -119,61 +128,667 @@ static void write_vtk_header(FILE *f, int is_binary,
 	     ox, oy, oz, sx, sy, sz);
 }
 
-static void write_vtk_value(FILE *f, double v, int store_bytes, int fix_bytes,
-			    double min, double max, int invert)
+typedef struct {
+     int store_bytes, fix_bytes, invert;
+     double min, max;
+} vtk_format;
+
+/* maximum bytes that convert_vtk_values outputs per value */
+static size_t vtk_value_size(int store_bytes)
+{
+     return store_bytes ? store_bytes : FORMAT_DOUBLE_MAXLEN(6) + 1;
+}
+
+static my_uint16_t fix_uint16(my_uint16_t i)
+{
+#if defined(HAVE_HTONS)
+     i = htons(i);
+#elif ! defined(WORDS_BIGENDIAN)
+     unsigned char swap, *bytes;
+     bytes = (unsigned char *) &i;
+     swap = bytes[0]; bytes[0] = bytes[1]; bytes[1] = swap;
+#endif
+     return i;
+}
+
+static float fix_float(float fv)
+{
+#if defined(HAVE_HTONL) && (SIZEOF_FLOAT == 4)
+     my_uint32_t *i = (my_uint32_t *) &fv;
+     *i = htonl(*i);
+#elif ! defined(WORDS_BIGENDIAN)
+     unsigned char swap, *bytes;
+     bytes = (unsigned char *) &fv;
+     swap = bytes[0]; bytes[0] = bytes[3]; bytes[3] = swap;
+     swap = bytes[1]; bytes[1] = bytes[2]; bytes[2] = swap;
+#endif
+     return fv;
+}
+
+/* Convert the n values a[ia].data[i0 + j*stride], for j = 0..n-1 and
+   (interleaved) ia = 0..na-1, to the output format in buf, returning
+   a pointer to the end of the converted data. */
+static char *convert_vtk_values(char *buf, const arrayh5 *a, int na,
+				int i0, int stride, int n,
+				const vtk_format *fmt)
 {
-     if (invert)
-	  v = max - (v - min);
-     switch (store_bytes) {
+     double min = fmt->min, max = fmt->max;
+     int j, ia, invert = fmt->invert;
+     char *p = buf;
+
+#define VTK_VALUE (invert ? max - (a[ia].data[i0 + j*stride] - min) \
+		      : a[ia].data[i0 + j*stride])
+
+     switch (fmt->store_bytes) {
 	 case 0:
-	      fprintf(f, "%g ", v);
+	      for (j = 0; j < n; ++j)
+		   for (ia = 0; ia < na; ++ia) {
+			p += format_double(p, VTK_VALUE, 6);
+			*p++ = ' ';
+		   }
 	      break;
 	 case 1:
-	 {
-	      unsigned char c;
-	      c = floor((v - min) * 255.0 / (max - min) + 0.5);
-	      fwrite(&c, 1, 1, f);
+	      for (j = 0; j < n; ++j)
+		   for (ia = 0; ia < na; ++ia) {
+			double v = VTK_VALUE;
+			unsigned char c;
+			c = floor((v - min) * 255.0 / (max - min) + 0.5);
+			*p++ = c;
+		   }
 	      break;
-	 }
 	 case 2:
-	 {
-	      my_uint16_t i;
-	      i = floor((v - min) * 65535.0 / (max - min) + 0.5);
-	      if (fix_bytes) {
-#if defined(HAVE_HTONS)
-		   i = htons(i);
-#elif ! defined(WORDS_BIGENDIAN)
-		   unsigned char swap, *bytes;
-		   bytes = (unsigned char *) &i;
-		   swap = bytes[0]; bytes[0] = bytes[1]; bytes[1] = swap;
-#endif
-	      }
-	      fwrite(&i, 2, 1, f);
+	      for (j = 0; j < n; ++j)
+		   for (ia = 0; ia < na; ++ia) {
+			double v = VTK_VALUE;
+			my_uint16_t i;
+			i = floor((v - min) * 65535.0 / (max - min) + 0.5);
+			if (fmt->fix_bytes)
+			     i = fix_uint16(i);
+			memcpy(p, &i, 2);
+			p += 2;
+		   }
 	      break;
-	 }
 	 case 4:
-	 {
-	      float fv = v;
-	      if (fix_bytes) {
-#if defined(HAVE_HTONL) && (SIZEOF_FLOAT == 4)
-		   my_uint32_t *i = (my_uint32_t *) &fv;
-		   *i = htonl(*i);
-#elif ! defined(WORDS_BIGENDIAN)
-		   unsigned char swap, *bytes;
-		   bytes = (unsigned char *) &fv;
-		   swap = bytes[0]; bytes[0] = bytes[3]; bytes[3] = swap;
-		   swap = bytes[1]; bytes[1] = bytes[2]; bytes[2] = swap;
-#endif
-	      }
-	      fwrite(&fv, 4, 1, f);
+	      for (j = 0; j < n; ++j)
+		   for (ia = 0; ia < na; ++ia) {
+			float fv = VTK_VALUE;
+			if (fmt->fix_bytes)
+			     fv = fix_float(fv);
+			memcpy(p, &fv, 4);
+			p += 4;
+		   }
 	      break;
-	 }
      }
+#undef VTK_VALUE
+     return p;
+}
+
+/* With -S, the data are read in slabs of about STREAM_BYTES, so that
+   the memory use is bounded regardless of the size of the datasets. */
+#define STREAM_BYTES (64 * 1024 * 1024)
+
+/* Data kept in memory in a narrower type than double are widened in
+   (smaller) slabs of about this many bytes. */
+#define TYPED_SLAB_BYTES (8 * 1024 * 1024)
+
+/* The data to be written: na conformant arrays, stored with x varying
+   fastest (i.e. transposed), either read entirely into a (h == t ==
+   NULL), or loaded into a as needed, slab_rows rows of the
+   slowest-varying dimension at a time, from the open datasets h (when
+   streaming) or from the untransposed arrays t (data read in their
+   own, narrower, types, which are only widened to double a slab at a
+   time). */
+typedef struct {
+     arrayh5 *a;
+     int na, N;
+     arrayh5_handle **h;
+     arrayh5_typed *t;
+     const int *slicedim, *islice, *center_slice;
+     int rowN, nrows, slab_rows;
+     int r0, nr; /* rows currently in a */
+} vtk_source;
+
+/* whether src is loaded into src->a a slab at a time, which must be
+   done serially */
+static int vtk_source_slabs(const vtk_source *src)
+{
+     return src->h || src->t;
+}
+
+/* make sure that point i of src is in src->a, returning the index of
+   the first point in src->a and setting *end to the index after the
+   last one */
+static int load_vtk_source(vtk_source *src, int i, int *end)
+{
+     int row, ia;
+
+     if (!vtk_source_slabs(src)) {
+	  *end = src->N;
+	  return 0;
+     }
+     row = i / src->rowN;
+     if (row < src->r0 || row >= src->r0 + src->nr) {
+	  src->r0 = row;
+	  src->nr = row + src->slab_rows <= src->nrows
+	       ? src->slab_rows : src->nrows - row;
+	  for (ia = 0; ia < src->na; ++ia) {
+	       int err;
+	       if (src->t) {
+		    arrayh5_typed_transposed_rows(src->t[ia], src->r0,
+						  src->nr, src->a[ia].data);
+		    continue;
+	       }
+	       err = arrayh5_read_transposed_rows(src->h[ia], 4,
+						      src->slicedim,
+						      src->islice,
+						      src->center_slice,
+						      src->r0, src->nr,
+						      src->a[ia].data);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	  }
+     }
+     *end = (src->r0 + src->nr) * src->rowN;
+     return src->r0 * src->rowN;
+}
+
+/* convert points i0..i1-1 of src, like convert_vtk_values */
+static char *convert_vtk_source(char *buf, vtk_source *src, int i0, int i1,
+				const vtk_format *fmt)
+{
+     while (i0 < i1) {
+	  int end, off = load_vtk_source(src, i0, &end);
+	  if (end > i1)
+	       end = i1;
+	  buf = convert_vtk_values(buf, src->a, src->na, i0 - off, 1,
+				   end - i0, fmt);
+	  i0 = end;
+     }
+     return buf;
+}
+
+/* write points i0..i1-1 of src in order.  Blocks of the data are
+   converted into per-thread buffers in parallel, and are then
+   written in order, one fwrite per block. */
+static void write_vtk_values(FILE *f, vtk_source *src, int i0, int i1,
+			     int nthreads, const vtk_format *fmt)
+{
+     const arrayh5 *a = src->a;
+     int na = src->na;
+     size_t vsize = vtk_value_size(fmt->store_bytes) * na;
+     int nblock = VTK_BUFSIZE / vsize > 0 ? VTK_BUFSIZE / vsize : 1;
+     char **bufs;
+     size_t *lens;
+     int i, t;
+
+     bufs = (char **) malloc(sizeof(char *) * nthreads);
+     lens = (size_t *) malloc(sizeof(size_t) * nthreads);
+     CHECK(bufs && lens, "out of memory");
+     for (t = 0; t < nthreads; ++t) {
+	  bufs[t] = (char *) malloc(vsize * nblock);
+	  CHECK(bufs[t], "out of memory");
+     }
+
+     while (i0 < i1) {
+	  int end, off = load_vtk_source(src, i0, &end);
+	  double t0, write_time = 0, write_bytes = 0;
+	  if (end > i1)
+	       end = i1;
+	  t0 = arrayh5_stats_start();
+#ifdef _OPENMP
+#    pragma omp parallel num_threads(nthreads) private(i, t)
+#endif
+	  for (i = i0; i < end; i += nblock * nthreads) {
+#ifdef _OPENMP
+#    pragma omp for schedule(static, 1)
+#endif
+	       for (t = 0; t < nthreads; ++t) {
+		    int j0 = i + t * nblock;
+		    int n = j0 + nblock < end ? nblock : end - j0;
+		    lens[t] = n > 0 ? convert_vtk_values(bufs[t], a, na,
+							 j0 - off, 1, n, fmt)
+			 - bufs[t] : 0;
+	       }
+#ifdef _OPENMP
+#    pragma omp single
+#endif
+	       {
+		    double tw = arrayh5_stats_start();
+		    for (t = 0; t < nthreads; ++t) {
+			 fwrite(bufs[t], 1, lens[t], f);
+			 write_bytes += lens[t];
+		    }
+		    write_time += arrayh5_stats_start() - tw;
+	       }
+	  }
+	  arrayh5_stats_add(ARRAYH5_STAGE_CONVERT,
+			    arrayh5_stats_start() - t0 - write_time,
+			    sizeof(double) * na * (double) (end - i0));
+	  arrayh5_stats_add(ARRAYH5_STAGE_WRITE, write_time, write_bytes);
+	  i0 = end;
+     }
+
+     for (t = 0; t < nthreads; ++t)
+	  free(bufs[t]);
+     free(lens);
+     free(bufs);
+}
+
+/***********************************************************************/
+/* VTK XML ImageData (.vti) output, with the data in an appended raw
+   binary section (or inline, for ASCII output), optionally compressed
+   by zlib in independent blocks (as for vtkZLibDataCompressor), and
+   parallel ImageData (.pvti) output, in which the data are split
+   into pieces along the slowest-varying dimension, each written to
+   its own .vti file. */
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#  include <zlib.h>
+#  define HAVE_ZLIB 1
+#endif
+
+typedef struct {
+     int n[3]; /* whole dimensions */
+     double origin[3], spacing[3];
+     const char *name; /* name of the (possibly multi-component) array */
+     int compress, nthreads;
+} vtk_xml_info;
+
+static const char vtk_xml_datatype[][8] = {
+     "Float32", "UInt8", "UInt16", "none", "Float32"
+};
+
+static const char *vtk_xml_byte_order(void)
+{
+#ifdef WORDS_BIGENDIAN
+     return "BigEndian";
+#else
+     return "LittleEndian";
+#endif
+}
+
+static void write_vtk_xml_extent(FILE *f, const char *attr, const int *ext)
+{
+     fprintf(f, " %s=\"%d %d %d %d %d %d\"", attr,
+	     ext[0], ext[1], ext[2], ext[3], ext[4], ext[5]);
+}
+
+/* the attribute of PointData naming the array, if any */
+static const char *vtk_xml_attribute(int na)
+{
+     return na == 1 ? " Scalars" : (na == 3 ? " Vectors" : NULL);
+}
+
+#ifdef HAVE_ZLIB
+/* write the points i0..i1-1 of src as independently zlib-compressed
+   blocks of (up to) VTK_BUFSIZE bytes, compressed nthreads at a time
+   in parallel, preceded by the UInt64 header of block counts and
+   sizes.  If f is seekable, the blocks are written as they are
+   compressed and the header is filled in afterwards; otherwise, all
+   of the compressed blocks are kept until the header is written. */
+static void write_vtk_compressed(FILE *f, vtk_source *src,
+				 int i0, int i1, int nthreads,
+				 const vtk_format *fmt)
+{
+     size_t vsize = vtk_value_size(fmt->store_bytes) * src->na;
+     int nblock = VTK_BUFSIZE / vsize > 0 ? VTK_BUFSIZE / vsize : 1;
+     int nb = (i1 - i0 + nblock - 1) / nblock, b, b0, t;
+     long hpos = ftell(f);
+     unsigned char **cbufs;
+     unsigned long long *header;
+     char **bufs;
+     uLong *lens;
+
+     cbufs = (unsigned char **) malloc(sizeof(unsigned char *) * nb);
+     header = (unsigned long long *)
+	  calloc(nb + 3, sizeof(unsigned long long));
+     bufs = (char **) malloc(sizeof(char *) * nthreads);
+     lens = (uLong *) malloc(sizeof(uLong) * nthreads);
+     CHECK(cbufs && header && bufs && lens, "out of memory");
+     for (t = 0; t < nthreads; ++t) {
+	  bufs[t] = (char *) malloc(vsize * nblock);
+	  CHECK(bufs[t], "out of memory");
+     }
+     header[0] = nb;
+     header[1] = nblock * vsize;
+     header[2] = ((i1 - i0) % nblock) * vsize;
+     if (hpos >= 0) /* placeholder, rewritten below */
+	  fwrite(header, sizeof(unsigned long long), nb + 3, f);
+
+     for (b0 = 0; b0 < nb; b0 += nthreads) {
+	  int nt = nb - b0 < nthreads ? nb - b0 : nthreads;
+	  double t0, raw_bytes = 0;
+
+	  /* data loaded a slab at a time must be loaded serially */
+	  if (vtk_source_slabs(src))
+	       for (t = 0; t < nt; ++t) {
+		    int j0 = i0 + (b0 + t) * nblock;
+		    int j1 = j0 + nblock < i1 ? j0 + nblock : i1;
+		    lens[t] = convert_vtk_source(bufs[t], src, j0, j1, fmt)
+			 - bufs[t];
+	       }
+	  t0 = arrayh5_stats_start();
+#ifdef _OPENMP
+#    pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+#endif
+	  for (t = 0; t < nt; ++t) {
+	       int bt = b0 + t;
+	       uLongf clen;
+	       if (!vtk_source_slabs(src)) {
+		    int j0 = i0 + bt * nblock;
+		    int j1 = j0 + nblock < i1 ? j0 + nblock : i1;
+		    lens[t] = convert_vtk_source(bufs[t], src, j0, j1, fmt)
+			 - bufs[t];
+	       }
+	       clen = compressBound(lens[t]);
+	       cbufs[bt] = (unsigned char *) malloc(clen);
+	       CHECK(cbufs[bt], "out of memory");
+	       CHECK(compress(cbufs[bt], &clen, (Bytef *) bufs[t], lens[t])
+		     == Z_OK, "zlib compression failed");
+	       header[3 + bt] = clen;
+	  }
+	  for (t = 0; t < nt; ++t)
+	       raw_bytes += lens[t];
+	  arrayh5_stats_stop(ARRAYH5_STAGE_ENCODE, t0, raw_bytes);
+	  t0 = arrayh5_stats_start();
+
+	  if (hpos >= 0) {
+	       double nw = 0;
+	       for (b = b0; b < b0 + nt; ++b) {
+		    fwrite(cbufs[b], 1, header[3 + b], f);
+		    nw += header[3 + b];
+		    free(cbufs[b]);
+	       }
+	       arrayh5_stats_stop(ARRAYH5_STAGE_WRITE, t0, nw);
+	  }
+     }
+
+     if (hpos >= 0) {
+	  CHECK(!fseek(f, hpos, SEEK_SET)
+		&& fwrite(header, sizeof(unsigned long long), nb + 3, f)
+		== (size_t) (nb + 3)
+		&& !fseek(f, 0, SEEK_END), "error writing compressed header");
+     }
+     else {
+	  fwrite(header, sizeof(unsigned long long), nb + 3, f);
+	  for (b = 0; b < nb; ++b) {
+	       fwrite(cbufs[b], 1, header[3 + b], f);
+	       free(cbufs[b]);
+	  }
+     }
+
+     for (t = 0; t < nthreads; ++t)
+	  free(bufs[t]);
+     free(lens);
+     free(bufs);
+     free(header);
+     free(cbufs);
+}
+#endif /* HAVE_ZLIB */
+
+/* write the piece of the data with extent ext (which must be a
+   contiguous range of points) as a .vti file */
+static void write_vti(const char *fname, vtk_source *src,
+		      const int *ext, const vtk_xml_info *info,
+		      const vtk_format *fmt)
+{
+     int na = src->na, whole[6], i0, i1;
+     const char *attr = vtk_xml_attribute(na);
+     FILE *f;
+
+     whole[0] = whole[2] = whole[4] = 0;
+     whole[1] = info->n[0] - 1;
+     whole[3] = info->n[1] - 1;
+     whole[5] = info->n[2] - 1;
+     i0 = (ext[4] * info->n[1] + ext[2]) * info->n[0] + ext[0];
+     i1 = (ext[5] * info->n[1] + ext[3]) * info->n[0] + ext[1] + 1;
+
+     if (strcmp(fname, "-")) {
+	  f = fopen(fname, "wb");
+	  CHECK(f, "error creating file");
+     }
+     else
+	  f = stdout;
+
+     fprintf(f, "<?xml version=\"1.0\"?>\n"
+	     "<VTKFile type=\"ImageData\" version=\"1.0\""
+	     " byte_order=\"%s\" header_type=\"UInt64\"%s>\n",
+	     vtk_xml_byte_order(),
+	     info->compress && fmt->store_bytes
+	     ? " compressor=\"vtkZLibDataCompressor\"" : "");
+     fprintf(f, "<ImageData");
+     write_vtk_xml_extent(f, "WholeExtent", whole);
+     fprintf(f, " Origin=\"%g %g %g\" Spacing=\"%g %g %g\">\n",
+	     info->origin[0], info->origin[1], info->origin[2],
+	     info->spacing[0], info->spacing[1], info->spacing[2]);
+     fprintf(f, "<Piece");
+     write_vtk_xml_extent(f, "Extent", ext);
+     fprintf(f, ">\n<PointData");
+     if (attr)
+	  fprintf(f, "%s=\"%s\"", attr, info->name);
+     fprintf(f, ">\n<DataArray type=\"%s\" Name=\"%s\""
+	     " NumberOfComponents=\"%d\"",
+	     vtk_xml_datatype[fmt->store_bytes], info->name, na);
+     if (fmt->store_bytes) {
+	  fprintf(f, " format=\"appended\" offset=\"0\"/>\n"
+		  "</PointData>\n</Piece>\n</ImageData>\n"
+		  "<AppendedData encoding=\"raw\">\n_");
+#ifdef HAVE_ZLIB
+	  if (info->compress)
+	       write_vtk_compressed(f, src, i0, i1, info->nthreads, fmt);
+	  else
+#endif
+	  {
+	       unsigned long long nbytes = (unsigned long long) (i1 - i0)
+		    * na * fmt->store_bytes;
+	       fwrite(&nbytes, sizeof(unsigned long long), 1, f);
+	       write_vtk_values(f, src, i0, i1, info->nthreads, fmt);
+	  }
+	  fprintf(f, "\n</AppendedData>\n");
+     }
+     else {
+	  fprintf(f, " format=\"ascii\">\n");
+	  write_vtk_values(f, src, i0, i1, info->nthreads, fmt);
+	  fprintf(f, "\n</DataArray>\n"
+		  "</PointData>\n</Piece>\n</ImageData>\n");
+     }
+     fprintf(f, "</VTKFile>\n");
+
+     if (f != stdout)
+	  fclose(f);
+}
+
+/* write npieces .vti files, named <base>_<i>.vti where fname is
+   <base>.pvti, in parallel (unless src is streamed), along with the
+   .pvti file for them; with MPI, each process writes a contiguous
+   block of the pieces and process 0 writes the .pvti file */
+static void write_pvti(const char *fname, vtk_source *src,
+		       int npieces, const vtk_xml_info *info,
+		       const vtk_format *fmt)
+{
+     int na = src->na, d, k, k0, k1, *cut, whole[6];
+     char *base, **pnames;
+     const char *attr = vtk_xml_attribute(na);
+     vtk_xml_info pinfo = *info;
+     FILE *f;
+
+     CHECK(strcmp(fname, "-"), "can't write .pvti output to stdout");
+
+     whole[0] = whole[2] = whole[4] = 0;
+     whole[1] = info->n[0] - 1;
+     whole[3] = info->n[1] - 1;
+     whole[5] = info->n[2] - 1;
+
+     /* split along the slowest-varying dimension with more than one
+	point, so that each piece is contiguous in memory; neighboring
+	pieces share their boundary points */
+     for (d = 2; d > 0 && info->n[d] == 1; --d)
+	  ;
+     if (npieces > info->n[d] - 1)
+	  npieces = info->n[d] > 1 ? info->n[d] - 1 : 1;
+     cut = (int *) malloc(sizeof(int) * (npieces + 1));
+     pnames = (char **) malloc(sizeof(char *) * npieces);
+     CHECK(cut && pnames, "out of memory");
+     for (k = 0; k <= npieces; ++k)
+	  cut[k] = (int) (((long long) k * (info->n[d] - 1)) / npieces);
+
+     base = replace_suffix(fname, ".pvti", "");
+     for (k = 0; k < npieces; ++k) {
+	  pnames[k] = (char *) malloc(strlen(base) + 32);
+	  CHECK(pnames[k], "out of memory");
+	  sprintf(pnames[k], "%s_%d.vti", base, k);
+     }
+     free(base);
+     k0 = (int) (((long long) npieces * arrayh5_mpi_rank())
+		 / arrayh5_mpi_size());
+     k1 = (int) (((long long) npieces * (arrayh5_mpi_rank() + 1))
+		 / arrayh5_mpi_size());
+
+     if (arrayh5_mpi_rank() == 0) {
+	  f = fopen(fname, "w");
+	  CHECK(f, "error creating file");
+	  fprintf(f, "<?xml version=\"1.0\"?>\n"
+		  "<VTKFile type=\"PImageData\" version=\"1.0\""
+		  " byte_order=\"%s\" header_type=\"UInt64\"%s>\n",
+		  vtk_xml_byte_order(),
+		  info->compress && fmt->store_bytes
+		  ? " compressor=\"vtkZLibDataCompressor\"" : "");
+	  fprintf(f, "<PImageData");
+	  write_vtk_xml_extent(f, "WholeExtent", whole);
+	  fprintf(f, " GhostLevel=\"0\" Origin=\"%g %g %g\""
+		  " Spacing=\"%g %g %g\">\n",
+		  info->origin[0], info->origin[1], info->origin[2],
+		  info->spacing[0], info->spacing[1], info->spacing[2]);
+	  fprintf(f, "<PPointData");
+	  if (attr)
+	       fprintf(f, "%s=\"%s\"", attr, info->name);
+	  fprintf(f, ">\n<PDataArray type=\"%s\" Name=\"%s\""
+		  " NumberOfComponents=\"%d\"/>\n</PPointData>\n",
+		  vtk_xml_datatype[fmt->store_bytes], info->name, na);
+	  for (k = 0; k < npieces; ++k) {
+	       int ext[6];
+	       const char *slash = strrchr(pnames[k], '/');
+	       memcpy(ext, whole, sizeof(ext));
+	       ext[2*d] = cut[k];
+	       ext[2*d + 1] = cut[k + 1];
+	       fprintf(f, "<Piece");
+	       write_vtk_xml_extent(f, "Extent", ext);
+	       fprintf(f, " Source=\"%s\"/>\n",
+		       slash ? slash + 1 : pnames[k]);
+	  }
+	  fprintf(f, "</PImageData>\n</VTKFile>\n");
+	  fclose(f);
+     }
+
+     /* each thread writes whole pieces, except that the pieces of
+	data loaded a slab at a time are written one at a time (in
+	order, so that each slab is loaded once), each by all of the
+	threads */
+     if (!vtk_source_slabs(src))
+	  pinfo.nthreads = 1;
+#ifdef _OPENMP
+#    pragma omp parallel for num_threads(vtk_source_slabs(src) ? 1 \
+					 : info->nthreads) \
+                             schedule(dynamic)
+#endif
+     for (k = k0; k < k1; ++k) {
+	  int ext[6];
+	  memcpy(ext, whole, sizeof(ext));
+	  ext[2*d] = cut[k];
+	  ext[2*d + 1] = cut[k + 1];
+	  write_vti(pnames[k], src, ext, &pinfo, fmt);
+     }
+
+     for (k = 0; k < npieces; ++k)
+	  free(pnames[k]);
+     free(pnames);
+     free(cut);
+}
+
+/* write a .vti or (if npieces > 0) .pvti file for the whole data */
+static void write_vtk_xml(const char *fname, vtk_source *src,
+			  int npieces, const vtk_xml_info *info,
+			  const vtk_format *fmt)
+{
+     if (npieces > 0)
+	  write_pvti(fname, src, npieces, info, fmt);
+     else {
+	  int ext[6];
+	  ext[0] = ext[2] = ext[4] = 0;
+	  ext[1] = info->n[0] - 1;
+	  ext[3] = info->n[1] - 1;
+	  ext[5] = info->n[2] - 1;
+	  write_vti(fname, src, ext, info, fmt);
+     }
+}
+
+/***********************************************************************/
+
+/* compute the range of the given slice of h (unless it is known from
+   the file), reading it a slab at a time (not transposed, which is
+   faster); with MPI, each process reads a contiguous block of the
+   rows, and the ranges are then combined */
+static void stream_range(arrayh5_handle *h, const int *slicedim,
+			 const int *islice, const int *center_slice,
+			 int nthreads, double *min, double *max)
+{
+     int rank, *dims, N, rowN, nbrows, r0, rlo, rhi, i, err;
+     double *data;
+
+     if (arrayh5_slice_range(h, 4, slicedim, islice, center_slice,
+			     min, max))
+	  return;
+     dims = (int *) malloc(sizeof(int) * (arrayh5_handle_rank(h) + 1));
+     CHECK(dims, "out of memory");
+     err = arrayh5_slice_dims(h, 4, slicedim, islice, center_slice,
+			      &rank, dims);
+     CHECK(!err, arrayh5_read_strerror[err]);
+     for (N = 1, i = 0; i < rank; ++i)
+	  N *= dims[i];
+     CHECK(N > 0, "no elements in array");
+     rowN = N / dims[0];
+     rlo = (int) (((long long) dims[0] * arrayh5_mpi_rank())
+		  / arrayh5_mpi_size());
+     rhi = (int) (((long long) dims[0] * (arrayh5_mpi_rank() + 1))
+		  / arrayh5_mpi_size());
+     nbrows = STREAM_BYTES / (sizeof(double) * rowN);
+     i = arrayh5_slice_chunk_rows(h, 4, slicedim, islice, center_slice);
+     if (nbrows > i)
+	  nbrows -= nbrows % i;
+     if (nbrows < 1)
+	  nbrows = 1;
+     if (nbrows > rhi - rlo)
+	  nbrows = rhi - rlo > 0 ? rhi - rlo : 1;
+     data = (double *) malloc(sizeof(double) * nbrows * rowN);
+     CHECK(data, "out of memory");
+
+     *min = HUGE_VAL;
+     *max = -HUGE_VAL;
+     for (r0 = rlo; r0 < rhi; r0 += nbrows) {
+	  int nr = r0 + nbrows <= rhi ? nbrows : rhi - r0;
+	  err = arrayh5_read_rows(h, 4, slicedim, islice, center_slice,
+				  r0, nr, data);
+	  CHECK(!err, arrayh5_read_strerror[err]);
+	  if (r0 == rlo)
+	       arrayh5_range(data, nr * rowN, nthreads, min, max);
+	  else {
+	       double min1, max1;
+	       arrayh5_range(data, nr * rowN, nthreads, &min1, &max1);
+	       if (min1 < *min || *min != *min)
+		    *min = min1;
+	       if (max1 > *max || *max != *max)
+		    *max = max1;
+	  }
+     }
+     arrayh5_mpi_range(min, max);
+
+     free(data);
+     free(dims);
 }
 
 int main(int argc, char **argv)
 {
      arrayh5 *a = NULL;
+     arrayh5_handle **h = NULL;
      char *vtk_fname = NULL, *data_name = NULL;
      extern char *optarg;
      extern int optind;
@@ -188,8 +803,16 @@ int main(int argc, char **argv)
      int islice[4], center_slice[4] = {0,0,0,0};
      int nx = 0, ny = 0, nz = 0, na;
      int store_bytes = 4, fix_byte_order = 1;
+     vtk_format fmt;
+     int nthreads = 1;
+     int xml = 0, compress = 0, npieces = 0;
+     vtk_xml_info info;
+     int stream = 0, need_range, typed = 0;
+     arrayh5_typed *t;
+     vtk_source src;
 
-     while ((c = getopt(argc, argv, "ho:d:vV124mMZranx:y:z:t:0")) != -1)
+     arrayh5_mpi_init(&argc, &argv);
+     while ((c = getopt(argc, argv, "ho:d:vV124mMZranx:y:z:t:0j:XcP:S")) != -1)
 	  switch (c) {
 	      case 'h':
 		   usage(stdout);
@@ -255,7 +878,25 @@ int main(int argc, char **argv)
 		   break;
 	      case 'd':
 		   data_name = my_strdup(optarg);
+		   break;
+	      case 'j':
+		   nthreads = atoi(optarg);
+		   CHECK(nthreads > 0, "invalid argument to -j");
+		   break;
+	      case 'X':
+		   xml = 1;
+		   break;
+	      case 'c':
+		   compress = 1;
+		   break;
+	      case 'P':
+		   npieces = atoi(optarg);
+		   CHECK(npieces > 0, "invalid argument to -P");
+		   xml = 1;
 		   break;		   
+	      case 'S':
+		   stream = 1;
+		   break;
 	      default:
 		   fprintf(stderr, "Invalid argument -%c\n", c);
 		   usage(stderr);
@@ -266,6 +907,13 @@ int main(int argc, char **argv)
 	  return EXIT_FAILURE;
      }
 
+#ifndef _OPENMP
+     if (nthreads > 1)
+	  fprintf(stderr, "h5tovtk: compiled without OpenMP; ignoring -j\n");
+#endif
+     arrayh5_stats_init("h5tovtk", verbose);
+     argv = expand_fname_args(&argc, argv, optind);
+
      CHECK(store_bytes != 4 || sizeof(float) == 4, 
 	   "'float' is wrong size for -4");
      CHECK(store_bytes != 4 || sizeof(my_uint32_t) == 4, 
@@ -273,11 +921,45 @@ int main(int argc, char **argv)
      CHECK(store_bytes != 2 || sizeof(my_uint16_t) == 2, 
 	   "missing 2-byte integer type for -2");
      
+#ifndef HAVE_ZLIB
+     if (compress) {
+	  fprintf(stderr, "h5tovtk: compiled without zlib; ignoring -c\n");
+	  compress = 0;
+     }
+#endif
+     CHECK(!compress || xml, "-c requires XML output (-X or -P)");
+     CHECK(npieces || arrayh5_mpi_size() == 1,
+	   "with MPI, use -P to divide the output into pieces");
+
+     fmt.store_bytes = store_bytes;
+     /* XML output declares its byte order, so it is left native */
+     fmt.fix_bytes = fix_byte_order && !xml;
+
+     info.origin[0] = ox; info.origin[1] = oy; info.origin[2] = oz;
+     info.spacing[0] = sx; info.spacing[1] = sy; info.spacing[2] = sz;
+     info.compress = compress;
+     info.nthreads = nthreads;
+
      a = (arrayh5*) malloc(sizeof(arrayh5) * (na = argc - optind));
      CHECK(a, "out of memory");
+     h = (arrayh5_handle **) malloc(sizeof(arrayh5_handle *) * na);
+     t = (arrayh5_typed *) malloc(sizeof(arrayh5_typed) * na);
+     CHECK(h && t, "out of memory");
+     for (ifile = 0; ifile < na; ++ifile) {
+	  h[ifile] = NULL;
+	  t[ifile].dims = NULL;
+	  t[ifile].data = NULL;
+     }
 
      combine = combine && (na > 1);
 
+     /* when streaming, the range of the data requires an extra pass
+	through the data, so we only compute it if it is used */
+     need_range = verbose || invert || store_bytes == 1 || store_bytes == 2;
+     src.slicedim = slicedim;
+     src.islice = islice;
+     src.center_slice = center_slice;
+
      for (ifile = optind; ifile < argc; ++ifile) {
           char *dname, *found_dname, *h5_fname;
 	  int err, ia = ifile - optind;
@@ -285,21 +967,95 @@ int main(int argc, char **argv)
           if (!dname[0])
                dname = data_name;
 
-	  err = arrayh5_read(&a[ia], h5_fname, dname, &found_dname,
-			     4, slicedim, islice, center_slice);
+	  err = arrayh5_open(&h[ia], h5_fname, dname);
 	  CHECK(!err, arrayh5_read_strerror[err]);
-	  CHECK(a[ia].rank >= 1, "data must have at least one dimension");
-	  CHECK(a[ia].rank <= 3, "data can have at most 3 dimensions (try taking a slice");
+	  found_dname = my_strdup(arrayh5_handle_name(h[ia]));
+
+	  /* Data stored in a narrower type than double (e.g. float) are
+	     read in that type, and only widened (and transposed) a slab
+	     at a time as they are written.  (Combined arrays must all be
+	     loaded the same way, so this is decided by the first.) */
+	  if (!stream && (!combine || !ia))
+	       typed = arrayh5_type_size(arrayh5_handle_type(h[ia]))
+		    < sizeof(double);
+
+	  /* read the data transposed, so that x varies fastest in
+	     memory, as in the VTK output */
+	  if (stream || typed) {
+	       /* a[ia] has the dimensions of the whole (transposed)
+		  data, but only room for a slab of it */
+	       int rank, *dims, i, N, rowN, slab_rows;
+	       double *data;
+	       dims = (int *) malloc(sizeof(int)
+				     * (arrayh5_handle_rank(h[ia]) + 1));
+	       CHECK(dims, "out of memory");
+	       err = arrayh5_slice_dims(h[ia], 4, slicedim, islice,
+					center_slice, &rank, dims);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       CHECK(rank >= 1, "data must have at least one dimension");
+	       CHECK(rank <= 3, "data can have at most 3 dimensions (try taking a slice");
+	       for (i = 0; i < rank / 2; ++i) {
+		    int d = dims[i];
+		    dims[i] = dims[rank - 1 - i];
+		    dims[rank - 1 - i] = d;
+	       }
+	       for (N = 1, i = 0; i < rank; ++i)
+		    N *= dims[i];
+	       CHECK(N > 0, "no elements in array");
+	       rowN = N / dims[0];
+	       slab_rows = (typed ? TYPED_SLAB_BYTES : STREAM_BYTES)
+		    / (sizeof(double) * rowN * (combine ? na : 1));
+	       if (slab_rows < 1)
+		    slab_rows = 1;
+	       if (slab_rows > dims[0])
+		    slab_rows = dims[0];
+	       data = (double *) malloc(sizeof(double) * slab_rows * rowN);
+	       CHECK(data, "out of memory");
+	       a[ia] = arrayh5_create_withdata(rank, dims, data);
+	       src.slab_rows = slab_rows;
+	       free(dims);
+	       if (typed) {
+		    err = arrayh5_read_typed_slice(&t[ia], h[ia],
+						   ARRAYH5_NATIVE, 4, slicedim,
+						   islice, center_slice);
+		    CHECK(!err, arrayh5_read_strerror[err]);
+	       }
+	  }
+	  else {
+	       err = arrayh5_read_transposed_handle(&a[ia], h[ia], 4,
+						    slicedim, islice,
+						    center_slice);
+	       CHECK(!err, arrayh5_read_strerror[err]);
+	       CHECK(a[ia].rank >= 1, "data must have at least one dimension");
+	       CHECK(a[ia].rank <= 3, "data can have at most 3 dimensions (try taking a slice");
+	  }
 	  
 	  CHECK(!combine || !ia || arrayh5_conformant(a[ia], a[0]),
 		"all arrays must be conformant to combine them");
 	  
-	  if (!vtk_fname)
-	       vtk_fname = replace_suffix(h5_fname, ".h5", ".vtk");
+	  if (!vtk_fname) {
+	       const char *suff = npieces ? ".pvti" : (xml ? ".vti" : ".vtk");
+	       /* combined datasets go to a single file */
+	       vtk_fname = combine ? replace_suffix(h5_fname, ".h5", suff)
+		    : output_fname(argv[ifile], ".h5", suff);
+	  }
 
 	  {
-	       double a_min, a_max;
-	       arrayh5_getrange(a[ia], &a_min, &a_max);
+	       double a_min = 0, a_max = 0;
+	       if (typed) {
+		    if (!arrayh5_slice_range(h[ia], 4, slicedim, islice,
+					     center_slice, &a_min, &a_max))
+			 arrayh5_typed_getrange(t[ia], &a_min, &a_max);
+	       }
+	       else if (!stream)
+		    arrayh5_getrange_threads(a[ia], nthreads, &a_min, &a_max);
+	       else if (need_range)
+		    stream_range(h[ia], slicedim, islice, center_slice,
+				 nthreads, &a_min, &a_max);
+	       if (!stream) {
+		    arrayh5_close(h[ia]);
+		    h[ia] = NULL;
+	       }
 	       if (verbose)
 		    printf("data in %s ranges from %g to %g.\n", 
 			   h5_fname, a_min, a_max);
@@ -319,44 +1075,58 @@ int main(int argc, char **argv)
 	       }
 	  }
 	  
-	  nx = a[ia].dims[0];
-	  ny = a[ia].rank < 2 ? 1 : a[ia].dims[1];
-	  nz = a[ia].rank < 3 ? 1 : a[ia].dims[2];
+	  nx = a[ia].dims[a[ia].rank - 1];
+	  ny = a[ia].rank < 2 ? 1 : a[ia].dims[a[ia].rank - 2];
+	  nz = a[ia].rank < 3 ? 1 : a[ia].dims[0];
+
+	  src.N = nx * ny * nz;
+	  src.nrows = a[ia].dims[0];
+	  src.rowN = src.N / src.nrows;
+	  src.r0 = src.nr = 0;
 	  
 	  if (!combine) {
 	       FILE *f;
-	       int ix, iy, iz, N = nx * ny * nz;
+	       int N = nx * ny * nz;
 
 	       if (verbose)
 		    printf("writing \"%s\" from %dx%dx%d input data.\n",
 			   vtk_fname, nx, ny, nz);
 	       
-	       if (strcmp(vtk_fname, "-")) {
-		    f = fopen(vtk_fname, "w");
-		    CHECK(f, "error creating file");
+	       whitespace_to_underscores(found_dname);
+	       fmt.min = min; fmt.max = max; fmt.invert = invert;
+	       if (xml) {
+		    info.n[0] = nx; info.n[1] = ny; info.n[2] = nz;
+		    info.name = found_dname;
+		    src.a = &a[ia]; src.na = 1; src.h = stream ? &h[ia] : NULL;
+		    src.t = typed ? &t[ia] : NULL;
+		    write_vtk_xml(vtk_fname, &src, npieces, &info, &fmt);
 	       }
-	       else
-		    f = stdout;
+	       else {
+		    if (strcmp(vtk_fname, "-")) {
+			 f = fopen(vtk_fname, "w");
+			 CHECK(f, "error creating file");
+		    }
+		    else
+			 f = stdout;
 
-	       write_vtk_header(f, store_bytes, 
-				nx, ny, nz, ox, oy, oz, sx, sy, sz);
-	       whitespace_to_underscores(found_dname);
-	       fprintf(f, "POINT_DATA %d\n"
-		       "SCALARS %s %s 1\n"
-		       "LOOKUP_TABLE default\n",
-		       N, found_dname, vtk_datatype[store_bytes]);
+		    write_vtk_header(f, store_bytes, 
+				     nx, ny, nz, ox, oy, oz, sx, sy, sz);
+		    fprintf(f, "POINT_DATA %d\n"
+			    "SCALARS %s %s 1\n"
+			    "LOOKUP_TABLE default\n",
+			    N, found_dname, vtk_datatype[store_bytes]);
 	       
-	       for (iz = 0; iz < nz; ++iz)
-	       for (iy = 0; iy < ny; ++iy)
-	       for (ix = 0; ix < nx; ++ix) {
-		    int i = (ix*ny + iy)*nz + iz;
-		    write_vtk_value(f, a[ia].data[i], store_bytes,
-				    fix_byte_order, min, max, invert);
-	       }
+		    src.a = &a[ia]; src.na = 1; src.h = stream ? &h[ia] : NULL;
+		    src.t = typed ? &t[ia] : NULL;
+		    write_vtk_values(f, &src, 0, N, nthreads, &fmt);
 	  
-	       if (f != stdout)
-		    fclose(f);
+		    if (f != stdout)
+			 fclose(f);
+	       }
 	       arrayh5_destroy(a[ia]);
+	       arrayh5_typed_destroy(t[ia]);
+	       if (stream)
+		    arrayh5_close(h[ia]);
 	       free(vtk_fname); vtk_fname = NULL;
 	  }
 	  free(found_dname);
@@ -365,57 +1135,69 @@ int main(int argc, char **argv)
 
      if (combine) {
 	  FILE *f;
-	  int ix, iy, iz, N = nx * ny * nz;
+	  int N = nx * ny * nz;
 
 	  if (verbose)
 	       printf("writing \"%s\" from %dx%dx%d input data.\n",
 		      vtk_fname, nx, ny, nz);
 	  
-	  if (strcmp(vtk_fname, "-")) {
-	       f = fopen(vtk_fname, "w");
-	       CHECK(f, "error creating file");
+	  fmt.min = min; fmt.max = max; fmt.invert = invert;
+	  src.a = a; src.na = na; src.h = stream ? h : NULL;
+	  src.t = typed ? t : NULL;
+	  if (xml) {
+	       info.n[0] = nx; info.n[1] = ny; info.n[2] = nz;
+	       info.name = na == 1 ? "scalars" : (na == 3 ? "vectors"
+						  : "fields");
+	       write_vtk_xml(vtk_fname, &src, npieces, &info, &fmt);
 	  }
-	  else
-	       f = stdout;
+	  else {
+	       if (strcmp(vtk_fname, "-")) {
+		    f = fopen(vtk_fname, "w");
+		    CHECK(f, "error creating file");
+	       }
+	       else
+		    f = stdout;
 	  
-	  write_vtk_header(f, store_bytes, 
-			   nx, ny, nz, ox, oy, oz, sx, sy, sz);
-	  fprintf(f, "POINT_DATA %d\n", N);
-	  switch (na) {
-	      case 1:
-		   fprintf(f, "SCALARS scalars %s 1\nLOOKUP_TABLE default\n", 
-			   vtk_datatype[store_bytes]);
-		   break;
-	      case 3:
-		   fprintf(f, "VECTORS vectors %s\n", 
-			   vtk_datatype[store_bytes]);
-		   break;
-	      default:
-		   fprintf(f, "FIELD fields 1\narray %d %d %s\n", 
-			   na, N, vtk_datatype[store_bytes]);
-	  }
+	       write_vtk_header(f, store_bytes, 
+				nx, ny, nz, ox, oy, oz, sx, sy, sz);
+	       fprintf(f, "POINT_DATA %d\n", N);
+	       switch (na) {
+		   case 1:
+			fprintf(f, "SCALARS scalars %s 1\n"
+				"LOOKUP_TABLE default\n", 
+				vtk_datatype[store_bytes]);
+			break;
+		   case 3:
+			fprintf(f, "VECTORS vectors %s\n", 
+				vtk_datatype[store_bytes]);
+			break;
+		   default:
+			fprintf(f, "FIELD fields 1\narray %d %d %s\n", 
+				na, N, vtk_datatype[store_bytes]);
+	       }
 	  
-	  for (iz = 0; iz < nz; ++iz)
-	  for (iy = 0; iy < ny; ++iy)
-	  for (ix = 0; ix < nx; ++ix) {
-               int ia, i = (ix*ny + iy)*nz + iz;
-	       for (ia = 0; ia < na; ++ia)
-		    write_vtk_value(f, a[ia].data[i], store_bytes, 
-				    fix_byte_order, min, max, invert);
+	       write_vtk_values(f, &src, 0, N, nthreads, &fmt);
+	       if (f != stdout)
+		    fclose(f);
 	  }
-	  if (f != stdout)
-	       fclose(f);
 	  {
 	       int ia;
-	       for (ia = 0; ia < na; ++ia)
+	       for (ia = 0; ia < na; ++ia) {
 		    arrayh5_destroy(a[ia]);
+		    arrayh5_typed_destroy(t[ia]);
+		    if (stream)
+			 arrayh5_close(h[ia]);
+	       }
 	  }
      }
 
+     free(t);
+     free(h);
      free(a);
 
      if (data_name)
 	  free(data_name);
+     free_fname_args(argc, argv, optind);
 
      return EXIT_SUCCESS;
 }
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
 
 #include "config.h"
 #include "h5utils.h"
@@ -85,3 +87,377 @@ char *split_fname(char *fname, char **data_name)
      return filename;
 }
 
+/* append s to the array *args of *n strings */
+static void add_arg(char ***args, int *n, char *s)
+{
+     char **a = (char **) realloc(*args, sizeof(char *) * (*n + 1));
+     CHECK(a, "out of memory");
+     a[(*n)++] = s;
+     *args = a;
+}
+
+/* Append to *args the (newly-allocated) brace expansions of s, in
+   which each {a,b,...} group, possibly nested, is replaced by each of
+   its comma-separated alternatives in turn: e.g. e{x,y}.r gives ex.r
+   and ey.r.  An unmatched { is taken literally. */
+static void expand_braces(const char *s, char ***args, int *n)
+{
+     const char *open = strchr(s, '{'), *close, *alt;
+     int depth = 0;
+
+     if (open)
+	  for (close = open + 1; *close && (*close != '}' || depth > 0);
+	       ++close)
+	       depth += (*close == '{') - (*close == '}');
+     if (!open || !*close) {
+	  add_arg(args, n, my_strdup(s));
+	  return;
+     }
+     for (alt = open + 1; alt <= close; ) {
+	  const char *end = alt;
+	  char *e;
+
+	  for (depth = 0; end < close && (*end != ',' || depth > 0); ++end)
+	       depth += (*end == '{') - (*end == '}');
+	  e = (char *) malloc(sizeof(char) * (strlen(s) + 1));
+	  CHECK(e, "out of memory");
+	  strncpy(e, s, open - s);
+	  strncpy(e + (open - s), alt, end - alt);
+	  strcpy(e + (open - s) + (end - alt), close + 1);
+	  expand_braces(e, args, n);
+	  free(e);
+	  alt = end + 1;
+     }
+}
+
+/* <fname>:<dname>, newly allocated */
+static char *join_fname(const char *fname, const char *dname)
+{
+     char *s = (char *) malloc(sizeof(char)
+			       * (strlen(fname) + strlen(dname) + 2));
+     CHECK(s, "out of memory");
+     strcpy(s, fname);
+     strcat(s, ":");
+     strcat(s, dname);
+     return s;
+}
+
+/* the files held open by expand_fname_args */
+static char **held_files = NULL;
+static int nheld_files = 0;
+
+/* the arguments returned by expand_fname_args that are one of several
+   datasets expanded from a single argument (not separately allocated) */
+static char **multi_args = NULL;
+static int nmulti_args = 0;
+
+static void hold_file(const char *fname)
+{
+     int i, err;
+
+     for (i = 0; i < nheld_files; ++i)
+	  if (!strcmp(held_files[i], fname))
+	       return;
+     err = arrayh5_hold_file(fname);
+     CHECK(!err, arrayh5_read_strerror[err]);
+     add_arg(&held_files, &nheld_files, my_strdup(fname));
+}
+
+char **expand_fname_args(int *argc, char **argv, int first)
+{
+     char **args = NULL;
+     int n = 0, i, j;
+
+     for (i = 0; i < first; ++i)
+	  add_arg(&args, &n, argv[i]);
+     for (i = first; i < *argc; ++i) {
+	  char *dname, *fname = split_fname(argv[i], &dname);
+	  char **dnames = NULL;
+	  int nd = 0, n0;
+
+	  if (!strchr(dname, '{') && !strpbrk(dname, "*?[")) {
+	       add_arg(&args, &n, my_strdup(argv[i]));
+	       free(fname);
+	       continue;
+	  }
+	  hold_file(fname);
+	  n0 = n;
+	  expand_braces(dname, &dnames, &nd);
+	  for (j = 0; j < nd; ++j) {
+	       if (strpbrk(dnames[j], "*?[")) {
+		    char **found;
+		    int nfound, k, err;
+		    err = arrayh5_find_datasets(fname, dnames[j],
+						&found, &nfound);
+		    if (err) {
+			 fprintf(stderr, "h5utils error: no datasets "
+				 "matching \"%s\" in %s\n", dnames[j], fname);
+			 exit(EXIT_FAILURE);
+		    }
+		    for (k = 0; k < nfound; ++k) {
+			 add_arg(&args, &n, join_fname(fname, found[k]));
+			 free(found[k]);
+		    }
+		    free(found);
+	       }
+	       else
+		    add_arg(&args, &n, join_fname(fname, dnames[j]));
+	       free(dnames[j]);
+	  }
+	  free(dnames);
+	  free(fname);
+	  if (n - n0 > 1)
+	       for (j = n0; j < n; ++j)
+		    add_arg(&multi_args, &nmulti_args, args[j]);
+     }
+     add_arg(&args, &n, NULL);
+     *argc = n - 1;
+     return args;
+}
+
+void free_fname_args(int argc, char **argv, int first)
+{
+     int i;
+
+     for (i = first; i < argc; ++i)
+	  free(argv[i]);
+     free(argv);
+     for (i = 0; i < nheld_files; ++i) {
+	  arrayh5_release_file(held_files[i]);
+	  free(held_files[i]);
+     }
+     free(held_files);
+     held_files = NULL;
+     nheld_files = 0;
+     free(multi_args);
+     multi_args = NULL;
+     nmulti_args = 0;
+}
+
+char *output_fname(char *arg, const char *old_suff, const char *new_suff)
+{
+     char *dname, *fname = split_fname(arg, &dname), *suff, *out, *c;
+     int i;
+
+     for (i = 0; i < nmulti_args && multi_args[i] != arg; ++i)
+	  ;
+     if (i == nmulti_args) {
+	  out = replace_suffix(fname, old_suff, new_suff);
+	  free(fname);
+	  return out;
+     }
+     suff = (char *) malloc(sizeof(char)
+			    * (strlen(dname) + strlen(new_suff) + 2));
+     CHECK(suff, "out of memory");
+     strcpy(suff, ".");
+     strcat(suff, dname[0] == '/' ? dname + 1 : dname);
+     for (c = suff; *c; ++c)
+	  if (*c == '/')
+	       *c = '.';
+     strcat(suff, new_suff);
+     out = replace_suffix(fname, old_suff, suff);
+     free(suff);
+     free(fname);
+     return out;
+}
+
+/* Set opts according to the getopt option c (one of WRITE_OPTIONS)
+   with argument arg, returning 0 if the argument is invalid. */
+int parse_write_option(int c, const char *arg, arrayh5_write_options *opts)
+{
+     switch (c) {
+	 case 'c': {
+	      char *end;
+	      opts->chunk_rank = 0;
+	      do {
+		   if (opts->chunk_rank == ARRAYH5_MAX_RANK)
+			return 0;
+		   opts->chunk[opts->chunk_rank] = (int) strtol(arg, &end, 10);
+		   if (end == arg || opts->chunk[opts->chunk_rank++] <= 0)
+			return 0;
+		   arg = end + 1;
+	      } while (*end == 'x' || *end == 'X' || *end == '*');
+	      return !*end;
+	 }
+	 case 'G':
+	      opts->deflate = atoi(arg);
+	      return opts->deflate >= 1 && opts->deflate <= 9;
+	 case 's':
+	      opts->shuffle = 1;
+	      return 1;
+	 case 'Z':
+	      opts->szip = 16; /* pixels per block: a typical choice */
+	      return 1;
+	 case 'F':
+	      opts->single_precision = 1;
+	      return 1;
+	 default:
+	      return 0;
+     }
+}
+
+/***********************************************************************/
+/* Fast formatting of doubles as by printf's "%.*g" format.  Numbers
+   whose decimal rounding to prec digits can be computed exactly in
+   double precision (which includes all integers below 2^53 and, for
+   prec <= 15 or so, nearly everything else) are formatted directly,
+   without going through the locale and format-string machinery of
+   printf; the rest are handed off to snprintf.  Either way, the
+   output is identical to that of sprintf(s, "%.*g", prec, x). */
+
+#ifndef FP_FAST_FMA
+/* the error x*y - fl(x*y), computed exactly by Dekker's algorithm
+   (assuming no overflow or underflow).  This is only used when there
+   is no hardware fma, so that the compiler cannot contract the
+   products and sums below into fma's. */
+static double product_error(double x, double y, double xy)
+{
+     const double split = 134217729.0; /* 2^27 + 1 */
+     double t, xh, xl, yh, yl;
+     t = split * x; xh = t - (t - x); xl = x - xh;
+     t = split * y; yh = t - (t - y); yl = y - yh;
+     return ((xh * yh - xy) + xh * yl + xl * yh) + xl * yl;
+}
+#endif
+
+static const double exact_pow10[] = {
+     1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAX_EXACT_POW10 22
+#define MAX_FAST_PREC 17
+
+/* the rounding arguments below assume that double arithmetic is
+   not carried out in extended precision (as on the x87) */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#  define EXACT_DOUBLE_ARITHMETIC 1
+#else
+#  define EXACT_DOUBLE_ARITHMETIC 0
+#endif
+
+/* write the decimal digits of u to s, returning the number of digits */
+static int format_digits(char *s, unsigned long long u)
+{
+     char d[24];
+     int n = 0, i;
+     do {
+	  d[n++] = '0' + u % 10;
+	  u /= 10;
+     } while (u);
+     for (i = 0; i < n; ++i)
+	  s[i] = d[n - 1 - i];
+     return n;
+}
+
+int format_double(char *s, double x, int prec)
+{
+     char digits[24];
+     char *p = s;
+     double ax = fabs(x), y = 0;
+     int ndigits, X, k, i, try;
+
+     if (prec < 0)
+	  prec = 6;
+     else if (prec == 0)
+	  prec = 1;
+
+     if (x == 0) {
+	  if (signbit(x))
+	       *p++ = '-';
+	  *p++ = '0';
+	  *p = 0;
+	  return p - s;
+     }
+     if (prec > MAX_FAST_PREC || !(ax < 1e300))
+	  goto slow;  /* too many digits, inf/nan, or risk of overflow */
+
+     /* integers that fit in prec digits are printed without a
+	decimal point or exponent */
+     if (ax < 9007199254740992.0 && ax < exact_pow10[prec]
+	 && ax == (double) (long long) ax) {
+	  if (x < 0)
+	       *p++ = '-';
+	  p += format_digits(p, (unsigned long long) ax);
+	  *p = 0;
+	  return p - s;
+     }
+
+     if (!EXACT_DOUBLE_ARITHMETIC)
+	  goto slow;
+
+     /* Otherwise, find the integer y = x * 10^k, rounded, with prec
+	digits, where 10^k must be exact and the rounding must be
+	provably correct (the error |x*10^k - y| < 1/2, which is computed
+	exactly or, with an fma, rounded only once, which preserves the
+	comparison).  X, the
+	decimal exponent of x, is first estimated from its binary
+	exponent (possibly one too low). */
+     frexp(ax, &X);
+     y = floor((X - 1) * 0.30102999566398119521);
+     X = (int) y;
+     for (try = 0; try < 2; ++try, ++X) {
+	  double xk, r;
+	  k = prec - 1 - X;
+	  if (k < 0 || k > MAX_EXACT_POW10)
+	       goto slow;
+	  xk = ax * exact_pow10[k];
+	  y = floor(xk + 0.5);
+#ifdef FP_FAST_FMA
+	  r = fma(ax, exact_pow10[k], -y);
+#else
+	  r = (xk - y) + product_error(ax, exact_pow10[k], xk);
+#endif
+	  if (!(fabs(r) < 0.5))
+	       goto slow;
+	  if (y < exact_pow10[prec])
+	       break;
+     }
+     if (try == 2 || y < exact_pow10[prec - 1])
+	  goto slow;
+
+     /* the prec significant digits, minus trailing zeros */
+     ndigits = format_digits(digits, (unsigned long long) y);
+     while (ndigits > 1 && digits[ndigits - 1] == '0')
+	  --ndigits;
+
+     if (x < 0)
+	  *p++ = '-';
+     if (X < -4 || X >= prec) { /* exponential notation */
+	  *p++ = digits[0];
+	  if (ndigits > 1) {
+	       *p++ = '.';
+	       for (i = 1; i < ndigits; ++i)
+		    *p++ = digits[i];
+	  }
+	  *p++ = 'e';
+	  *p++ = X < 0 ? '-' : '+';
+	  if (X < 0)
+	       X = -X;
+	  if (X < 10)
+	       *p++ = '0';
+	  p += format_digits(p, X);
+     }
+     else if (X >= 0) {
+	  for (i = 0; i <= X; ++i)
+	       *p++ = i < ndigits ? digits[i] : '0';
+	  if (ndigits > X + 1) {
+	       *p++ = '.';
+	       for (; i < ndigits; ++i)
+		    *p++ = digits[i];
+	  }
+     }
+     else {
+	  *p++ = '0';
+	  *p++ = '.';
+	  for (i = -1; i > X; --i)
+	       *p++ = '0';
+	  for (i = 0; i < ndigits; ++i)
+	       *p++ = digits[i];
+     }
+     *p = 0;
+     return p - s;
+
+ slow:
+     return sprintf(s, "%.*g", prec, x);
+}
@@ -23,9 +23,48 @@
 #ifndef H5UTILS_H
 #define H5UTILS_H
 
+#include "arrayh5.h"
+
 extern char *my_strdup(const char *s);
 extern char *replace_suffix(const char *s,
 			    const char *old_suff, const char *new_suff);
 extern char *split_fname(char *fname, char **data_name);
 
+/* Expand the arguments argv[first..*argc-1] of the form
+   <filename>:<datasets>, where <datasets> contains a {a,b,...} list of
+   alternatives (e.g. file.h5:{ex,ey,ez} or file.h5:e{x,y,z}.r) and/or
+   the wildcards of arrayh5_find_datasets (e.g. file.h5:fields/e?), into
+   one <filename>:<dataset> argument per dataset, returning a new argv
+   (with *argc updated); other arguments are copied unchanged.  The
+   files of expanded arguments are held open until free_fname_args, so
+   that each is opened only once while its datasets are read. */
+extern char **expand_fname_args(int *argc, char **argv, int first);
+extern void free_fname_args(int argc, char **argv, int first);
+
+/* The default output file name for the input argument arg (one of
+   those returned by expand_fname_args): its file name with old_suff
+   replaced by new_suff, except that if arg is one of several datasets
+   expanded from a single argument, .<dataset> (with any / replaced by
+   .) is inserted before new_suff, so that the outputs don't overwrite
+   one another: e.g. v.a.png and v.b.png for v.h5:{a,b}. */
+extern char *output_fname(char *arg, const char *old_suff,
+			  const char *new_suff);
+
+/* an upper bound on the length (including the terminating NUL) written
+   by format_double(s, x, prec), with the given prec */
+#define FORMAT_DOUBLE_MAXLEN(prec) (((prec) > 17 ? (prec) : 17) + 16)
+extern int format_double(char *s, double x, int prec);
+
+/* getopt letters and usage text for the options, shared by the tools
+   that write HDF5 datasets, that are parsed by parse_write_option */
+#define WRITE_OPTIONS "c:G:sZF"
+#define WRITE_OPTIONS_USAGE \
+"  -c <size> : store the output in chunks of <size>, e.g. 32x32x32\n" \
+"   -G <lvl> : deflate (gzip) compress the output at level <lvl> (1-9)\n" \
+"         -s : byte-shuffle the output, so that it compresses better\n" \
+"         -Z : szip compress the output\n" \
+"         -F : store the output in single precision (32-bit floats)\n"
+extern int parse_write_option(int c, const char *arg,
+			      arrayh5_write_options *opts);
+
 #endif /* H5UTILS_H */
@@ -0,0 +1,572 @@
+/* Copyright (c) 1999-2017 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* The expression is parsed (with the same grammar, functions, and
+   constants as libmatheval) into a tree, constant subexpressions are
+   folded, and the tree is then compiled into a list of instructions
+   for a simple register machine.  Each register holds MATHEXPR_BLOCK
+   values, and each instruction is a loop over a block, so the cost of
+   interpreting the expression is amortized over many points and the
+   common arithmetic operations compile into vectorizable loops. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "mathexpr.h"
+
+typedef enum {
+     OP_CONST, OP_VAR,
+     OP_NEG, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_SQR,
+     OP_EXP, OP_LOG, OP_SQRT, OP_SIN, OP_COS, OP_TAN, OP_COT, OP_SEC,
+     OP_CSC, OP_ASIN, OP_ACOS, OP_ATAN, OP_ACOT, OP_ASEC, OP_ACSC,
+     OP_SINH, OP_COSH, OP_TANH, OP_COTH, OP_SECH, OP_CSCH,
+     OP_ASINH, OP_ACOSH, OP_ATANH, OP_ACOTH, OP_ASECH, OP_ACSCH,
+     OP_ABS, OP_STEP, OP_DELTA, OP_NANDELTA, OP_ERF
+} opcode;
+
+static const struct {
+     const char *name;
+     opcode op;
+} functions[] = {
+     { "exp", OP_EXP }, { "log", OP_LOG }, { "sqrt", OP_SQRT },
+     { "sin", OP_SIN }, { "cos", OP_COS }, { "tan", OP_TAN },
+     { "cot", OP_COT }, { "sec", OP_SEC }, { "csc", OP_CSC },
+     { "asin", OP_ASIN }, { "acos", OP_ACOS }, { "atan", OP_ATAN },
+     { "acot", OP_ACOT }, { "asec", OP_ASEC }, { "acsc", OP_ACSC },
+     { "sinh", OP_SINH }, { "cosh", OP_COSH }, { "tanh", OP_TANH },
+     { "coth", OP_COTH }, { "sech", OP_SECH }, { "csch", OP_CSCH },
+     { "asinh", OP_ASINH }, { "acosh", OP_ACOSH }, { "atanh", OP_ATANH },
+     { "acoth", OP_ACOTH }, { "asech", OP_ASECH }, { "acsch", OP_ACSCH },
+     { "abs", OP_ABS }, { "step", OP_STEP }, { "delta", OP_DELTA },
+     { "nandelta", OP_NANDELTA }, { "erf", OP_ERF }
+};
+
+static const struct {
+     const char *name;
+     double val;
+} constants[] = {
+     { "e", 2.7182818284590452354 },
+     { "log2e", 1.4426950408889634074 },
+     { "log10e", 0.43429448190325182765 },
+     { "ln2", 0.69314718055994530942 },
+     { "ln10", 2.30258509299404568402 },
+     { "pi", 3.14159265358979323846 },
+     { "pi_2", 1.57079632679489661923 },
+     { "pi_4", 0.78539816339744830962 },
+     { "sqrt2", 1.41421356237309504880 },
+     { "sqrt1_2", 0.70710678118654752440 }
+};
+
+#define NELEMS(x) ((int) (sizeof(x) / sizeof((x)[0])))
+
+/* the unary functions, with the same definitions as in libmatheval */
+static double apply1(opcode op, double x)
+{
+     switch (op) {
+	 case OP_NEG: return -x;
+	 case OP_SQR: return x * x;
+	 case OP_EXP: return exp(x);
+	 case OP_LOG: return log(x);
+	 case OP_SQRT: return sqrt(x);
+	 case OP_SIN: return sin(x);
+	 case OP_COS: return cos(x);
+	 case OP_TAN: return tan(x);
+	 case OP_COT: return 1 / tan(x);
+	 case OP_SEC: return 1 / cos(x);
+	 case OP_CSC: return 1 / sin(x);
+	 case OP_ASIN: return asin(x);
+	 case OP_ACOS: return acos(x);
+	 case OP_ATAN: return atan(x);
+	 case OP_ACOT: return atan(1 / x);
+	 case OP_ASEC: return acos(1 / x);
+	 case OP_ACSC: return asin(1 / x);
+	 case OP_SINH: return sinh(x);
+	 case OP_COSH: return cosh(x);
+	 case OP_TANH: return tanh(x);
+	 case OP_COTH: return 1 / tanh(x);
+	 case OP_SECH: return 1 / cosh(x);
+	 case OP_CSCH: return 1 / sinh(x);
+	 case OP_ASINH: return log(x + sqrt(x * x + 1));
+	 case OP_ACOSH: return log(x + sqrt(x * x - 1));
+	 case OP_ATANH: return 0.5 * log((1 + x) / (1 - x));
+	 case OP_ACOTH: return 0.5 * log((x + 1) / (x - 1));
+	 case OP_ASECH: return log((1 + sqrt(1 - x * x)) / x);
+	 case OP_ACSCH: return log((1 + sqrt(1 + x * x)) / x);
+	 case OP_ABS: return fabs(x);
+	 case OP_STEP: return x < 0 ? 0 : 1;
+	 case OP_DELTA: return x == 0 ? HUGE_VAL : 0;
+	 case OP_NANDELTA: return x == 0 ? sqrt(-1.0) : 0;
+	 case OP_ERF: return erf(x);
+	 default: return 0;
+     }
+}
+
+static double apply2(opcode op, double x, double y)
+{
+     switch (op) {
+	 case OP_ADD: return x + y;
+	 case OP_SUB: return x - y;
+	 case OP_MUL: return x * y;
+	 case OP_DIV: return x / y;
+	 case OP_POW: return pow(x, y);
+	 default: return 0;
+     }
+}
+
+/***********************************************************************/
+/* parsing */
+
+typedef struct node_s {
+     opcode op;
+     double val; /* for OP_CONST */
+     int var; /* for OP_VAR */
+     struct node_s *a, *b; /* operands (b is NULL for unary functions) */
+} node;
+
+typedef struct {
+     const char *s;
+     int nvars;
+     char **vars;
+     int err;
+} parser;
+
+static void destroy_node(node *n)
+{
+     if (n) {
+	  destroy_node(n->a);
+	  destroy_node(n->b);
+	  free(n);
+     }
+}
+
+static node *new_node(parser *p, opcode op, node *a, node *b)
+{
+     node *n;
+
+     if (p->err || (op > OP_VAR && !a) || (op >= OP_ADD && op <= OP_POW && !b)
+	 || !(n = (node *) malloc(sizeof(node)))) {
+	  p->err = 1;
+	  destroy_node(a);
+	  destroy_node(b);
+	  return NULL;
+     }
+     n->op = op;
+     n->val = 0;
+     n->var = -1;
+     n->a = a;
+     n->b = b;
+
+     /* fold constant subexpressions */
+     if (a && a->op == OP_CONST && (!b || b->op == OP_CONST)) {
+	  n->val = b ? apply2(op, a->val, b->val) : apply1(op, a->val);
+	  n->op = OP_CONST;
+	  destroy_node(a);
+	  destroy_node(b);
+	  n->a = n->b = NULL;
+     }
+     else if (op == OP_POW && b->op == OP_CONST && b->val == 2) {
+	  n->op = OP_SQR; /* x^2 = x*x exactly, and is much cheaper */
+	  destroy_node(b);
+	  n->b = NULL;
+     }
+     return n;
+}
+
+static void skip_space(parser *p)
+{
+     while (isspace(*p->s))
+	  ++p->s;
+}
+
+static node *parse_sum(parser *p);
+
+static node *parse_primary(parser *p)
+{
+     node *n;
+
+     skip_space(p);
+     if (isdigit(*p->s) || (*p->s == '.' && isdigit(p->s[1]))) {
+	  /* same number syntax as matheval: digits[.digits][e[+-]digits] */
+	  const char *s = p->s;
+	  char *end;
+	  while (isdigit(*s)) ++s;
+	  if (*s == '.') { ++s; while (isdigit(*s)) ++s; }
+	  if ((*s == 'e' || *s == 'E')
+	      && (isdigit(s[1]) || ((s[1] == '+' || s[1] == '-')
+				    && isdigit(s[2])))) {
+	       s += 2;
+	       while (isdigit(*s)) ++s;
+	  }
+	  if (!(n = new_node(p, OP_CONST, NULL, NULL)))
+	       return NULL;
+	  n->val = strtod(p->s, &end);
+	  if (end != s)
+	       p->err = 1;
+	  p->s = s;
+	  return n;
+     }
+     else if (isalpha(*p->s) || *p->s == '_') {
+	  const char *name = p->s;
+	  int len, i;
+	  while (isalnum(*p->s) || *p->s == '_')
+	       ++p->s;
+	  len = p->s - name;
+	  skip_space(p);
+	  if (*p->s == '(') {
+	       for (i = 0; i < NELEMS(functions); ++i)
+		    if (!strncmp(functions[i].name, name, len)
+			&& !functions[i].name[len])
+			 break;
+	       if (i == NELEMS(functions)) {
+		    p->err = 1;
+		    return NULL;
+	       }
+	       return new_node(p, functions[i].op, parse_primary(p), NULL);
+	  }
+	  for (i = 0; i < NELEMS(constants); ++i)
+	       if (!strncmp(constants[i].name, name, len)
+		   && !constants[i].name[len]) {
+		    if ((n = new_node(p, OP_CONST, NULL, NULL)))
+			 n->val = constants[i].val;
+		    return n;
+	       }
+	  for (i = 0; i < p->nvars; ++i)
+	       if (!strncmp(p->vars[i], name, len) && !p->vars[i][len]) {
+		    if ((n = new_node(p, OP_VAR, NULL, NULL)))
+			 n->var = i;
+		    return n;
+	       }
+	  p->err = 1;
+	  return NULL;
+     }
+     else if (*p->s == '(') {
+	  ++p->s;
+	  n = parse_sum(p);
+	  skip_space(p);
+	  if (*p->s != ')') {
+	       p->err = 1;
+	       destroy_node(n);
+	       return NULL;
+	  }
+	  ++p->s;
+	  return n;
+     }
+     p->err = 1;
+     return NULL;
+}
+
+/* the exponent of ^: a primary expression, possibly negated */
+static node *parse_exponent(parser *p)
+{
+     skip_space(p);
+     if (*p->s == '-') {
+	  ++p->s;
+	  return new_node(p, OP_NEG, parse_exponent(p), NULL);
+     }
+     return parse_primary(p);
+}
+
+/* ^ binds more tightly than unary minus (so -x^2 is -(x^2)), as in
+   libmatheval.  Chained powers like x^2^3 depend on the associativity
+   of libmatheval's grammar, so rather than risk evaluating them
+   differently we reject them (i.e. leave them to libmatheval); an
+   explicitly parenthesized x^(2^3) or (x^2)^3 is fine. */
+static node *parse_power(parser *p)
+{
+     node *n = parse_primary(p);
+     skip_space(p);
+     if (*p->s == '^') {
+	  ++p->s;
+	  n = new_node(p, OP_POW, n, parse_exponent(p));
+	  skip_space(p);
+	  if (*p->s == '^') {
+	       p->err = 1;
+	       destroy_node(n);
+	       return NULL;
+	  }
+     }
+     return n;
+}
+
+static node *parse_unary(parser *p)
+{
+     skip_space(p);
+     if (*p->s == '-') {
+	  ++p->s;
+	  return new_node(p, OP_NEG, parse_unary(p), NULL);
+     }
+     return parse_power(p);
+}
+
+static node *parse_product(parser *p)
+{
+     node *n = parse_unary(p);
+     for (;;) {
+	  skip_space(p);
+	  if (*p->s == '*') {
+	       ++p->s;
+	       n = new_node(p, OP_MUL, n, parse_unary(p));
+	  }
+	  else if (*p->s == '/') {
+	       ++p->s;
+	       n = new_node(p, OP_DIV, n, parse_unary(p));
+	  }
+	  else
+	       return n;
+     }
+}
+
+static node *parse_sum(parser *p)
+{
+     node *n = parse_product(p);
+     for (;;) {
+	  skip_space(p);
+	  if (*p->s == '+') {
+	       ++p->s;
+	       n = new_node(p, OP_ADD, n, parse_product(p));
+	  }
+	  else if (*p->s == '-') {
+	       ++p->s;
+	       n = new_node(p, OP_SUB, n, parse_product(p));
+	  }
+	  else
+	       return n;
+     }
+}
+
+/***********************************************************************/
+/* compilation */
+
+/* an operand of an instruction is a constant (kept in its own block of
+   the mathexpr), a variable, or a register in the work array */
+typedef enum { ARG_CONST, ARG_VAR, ARG_REG } argkind;
+
+typedef struct {
+     argkind kind;
+     int index;
+} arg;
+
+typedef struct {
+     opcode op;
+     int dst; /* register */
+     arg a, b;
+} instr;
+
+struct mathexpr_s {
+     int nvars, *uses_var;
+     int ninstr;
+     instr *code;
+     arg result;
+     int nconst;
+     double *consts; /* nconst blocks of MATHEXPR_BLOCK copies */
+     int nregs;
+};
+
+static int add_instr(mathexpr *e, instr in)
+{
+     instr *code = (instr *) realloc(e->code,
+				     sizeof(instr) * (e->ninstr + 1));
+     if (!code)
+	  return 0;
+     e->code = code;
+     e->code[e->ninstr++] = in;
+     return 1;
+}
+
+/* compile n; registers are allocated in stack order, with *top being
+   the number currently in use.  Returns 0 if out of memory. */
+static int compile(mathexpr *e, const node *n, int *top, arg *result)
+{
+     instr in;
+
+     if (n->op == OP_CONST) {
+	  double *consts;
+	  int i;
+	  consts = (double *) realloc(e->consts, sizeof(double)
+				      * MATHEXPR_BLOCK * (e->nconst + 1));
+	  if (!consts)
+	       return 0;
+	  e->consts = consts;
+	  for (i = 0; i < MATHEXPR_BLOCK; ++i)
+	       e->consts[e->nconst * MATHEXPR_BLOCK + i] = n->val;
+	  result->kind = ARG_CONST;
+	  result->index = e->nconst++;
+	  return 1;
+     }
+     if (n->op == OP_VAR) {
+	  e->uses_var[n->var] = 1;
+	  result->kind = ARG_VAR;
+	  result->index = n->var;
+	  return 1;
+     }
+
+     in.op = n->op;
+     if (!compile(e, n->a, top, &in.a))
+	  return 0;
+     if (n->b) {
+	  if (!compile(e, n->b, top, &in.b))
+	       return 0;
+	  if (in.b.kind == ARG_REG)
+	       --*top;
+     }
+     else
+	  in.b = in.a;
+     if (in.a.kind == ARG_REG)
+	  --*top;
+     in.dst = (*top)++;
+     if (*top > e->nregs)
+	  e->nregs = *top;
+     result->kind = ARG_REG;
+     result->index = in.dst;
+     return add_instr(e, in);
+}
+
+void mathexpr_destroy(mathexpr *e)
+{
+     if (e) {
+	  free(e->uses_var);
+	  free(e->code);
+	  free(e->consts);
+	  free(e);
+     }
+}
+
+mathexpr *mathexpr_create(const char *s, int nvars, char **vars)
+{
+     parser p;
+     node *n;
+     mathexpr *e;
+     int top = 0, i;
+
+     p.s = s;
+     p.nvars = nvars;
+     p.vars = vars;
+     p.err = 0;
+     n = parse_sum(&p);
+     skip_space(&p);
+     if (p.err || !n || *p.s) {
+	  destroy_node(n);
+	  return NULL;
+     }
+
+     e = (mathexpr *) malloc(sizeof(mathexpr));
+     if (e) {
+	  e->nvars = nvars;
+	  e->ninstr = e->nconst = e->nregs = 0;
+	  e->code = NULL;
+	  e->consts = NULL;
+	  e->uses_var = (int *) malloc(sizeof(int) * (nvars > 0 ? nvars : 1));
+	  if (e->uses_var)
+	       for (i = 0; i < nvars; ++i)
+		    e->uses_var[i] = 0;
+	  if (!e->uses_var || !compile(e, n, &top, &e->result)) {
+	       mathexpr_destroy(e);
+	       e = NULL;
+	  }
+     }
+     destroy_node(n);
+     return e;
+}
+
+int mathexpr_uses_var(const mathexpr *e, int ivar)
+{
+     return e->uses_var[ivar];
+}
+
+/* number of doubles of workspace needed by mathexpr_evaluate; each
+   thread evaluating e at the same time needs its own workspace */
+int mathexpr_work_size(const mathexpr *e)
+{
+     return (e->nregs > 0 ? e->nregs : 1) * MATHEXPR_BLOCK;
+}
+
+/***********************************************************************/
+/* evaluation */
+
+static const double *arg_ptr(const mathexpr *e, arg a,
+			     const double * const *vals, int offset,
+			     const double *work)
+{
+     switch (a.kind) {
+	 case ARG_CONST: return e->consts + a.index * MATHEXPR_BLOCK;
+	 case ARG_VAR: return vals[a.index] + offset;
+	 default: return work + a.index * MATHEXPR_BLOCK;
+     }
+}
+
+/* set result[i] to the value of e for variable values vals[...][i],
+   for 0 <= i < n; vals[j] may be NULL if !mathexpr_uses_var(e, j) */
+void mathexpr_evaluate(const mathexpr *e, int n,
+		       const double * const *vals,
+		       double *result, double *work)
+{
+     int offset, i, j;
+
+     for (offset = 0; offset < n; offset += MATHEXPR_BLOCK) {
+	  int m = n - offset < MATHEXPR_BLOCK ? n - offset : MATHEXPR_BLOCK;
+	  const double *r;
+
+	  for (i = 0; i < e->ninstr; ++i) {
+	       const instr *in = e->code + i;
+	       const double *a = arg_ptr(e, in->a, vals, offset, work);
+	       const double *b = arg_ptr(e, in->b, vals, offset, work);
+	       double *d = work + in->dst * MATHEXPR_BLOCK;
+
+	       switch (in->op) {
+		   case OP_NEG:
+			for (j = 0; j < m; ++j) d[j] = -a[j];
+			break;
+		   case OP_ADD:
+			for (j = 0; j < m; ++j) d[j] = a[j] + b[j];
+			break;
+		   case OP_SUB:
+			for (j = 0; j < m; ++j) d[j] = a[j] - b[j];
+			break;
+		   case OP_MUL:
+			for (j = 0; j < m; ++j) d[j] = a[j] * b[j];
+			break;
+		   case OP_DIV:
+			for (j = 0; j < m; ++j) d[j] = a[j] / b[j];
+			break;
+		   case OP_SQR:
+			for (j = 0; j < m; ++j) d[j] = a[j] * a[j];
+			break;
+		   case OP_SQRT:
+			for (j = 0; j < m; ++j) d[j] = sqrt(a[j]);
+			break;
+		   case OP_ABS:
+			for (j = 0; j < m; ++j) d[j] = fabs(a[j]);
+			break;
+		   case OP_POW:
+			for (j = 0; j < m; ++j) d[j] = pow(a[j], b[j]);
+			break;
+		   default:
+			for (j = 0; j < m; ++j) d[j] = apply1(in->op, a[j]);
+	       }
+	  }
+
+	  r = arg_ptr(e, e->result, vals, offset, work);
+	  memcpy(result + offset, r, sizeof(double) * m);
+     }
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) 1999-2017 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MATHEXPR_H
+#define MATHEXPR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/***********************************************************************/
+
+/* A compiled form of the expressions accepted by libmatheval, which is
+   evaluated for a whole array of variable values at a time (in blocks
+   of MATHEXPR_BLOCK elements) rather than one point at a time.
+   mathexpr_create returns NULL if the expression uses anything that
+   the compiler doesn't handle (or doesn't parse), in which case the
+   caller should fall back on libmatheval. */
+
+#define MATHEXPR_BLOCK 256
+
+typedef struct mathexpr_s mathexpr;
+
+extern mathexpr *mathexpr_create(const char *s, int nvars, char **vars);
+extern void mathexpr_destroy(mathexpr *e);
+extern int mathexpr_uses_var(const mathexpr *e, int ivar);
+extern int mathexpr_work_size(const mathexpr *e);
+extern void mathexpr_evaluate(const mathexpr *e, int n,
+			      const double * const *vals,
+			      double *result, double *work);
+
+/***********************************************************************/
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* MATHEXPR_H */
@@ -26,6 +26,14 @@
 #include <string.h>
 
 #include <png.h>
+#include <zlib.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+#endif
+#include <time.h>
 
 #include "writepng.h"
 
@@ -49,18 +57,178 @@ static void cmap_lookup(REAL val, colormap_t cmap,
      *a = cmap.rgba[i].a * (1 - w) + cmap.rgba[i+1].a * w;
 }
 
+/* Rather than calling cmap_lookup for every pixel, we tabulate the
+   colormap at LUT_SIZE equally spaced values, and the pixels are then
+   colored by a table lookup.  Colors are stored in 8.8 fixed point, so
+   that overlays can be blended in integer arithmetic, and the alpha in
+   [0,256].  An extra entry at index LUT_SIZE holds the mask color (with
+   zero alpha, so that masked pixels are never overlaid). */
+
+#define LUT_SIZE 4096
+
+typedef struct {
+     int r, g, b, a;
+} lut_entry;
+
+static void fill_lut(lut_entry *lut, colormap_t cmap, png_byte mask_byte)
+{
+     int k;
+
+     for (k = 0; k < LUT_SIZE; ++k) {
+	  float r, g, b, a;
+	  cmap_lookup(k * (1.0 / (LUT_SIZE - 1)), cmap, &r, &g, &b, &a);
+	  lut[k].r = r * (255 * 256) + 0.5;
+	  lut[k].g = g * (255 * 256) + 0.5;
+	  lut[k].b = b * (255 * 256) + 0.5;
+	  lut[k].a = a * 256 + 0.5;
+     }
+     lut[LUT_SIZE].r = lut[LUT_SIZE].g = lut[LUT_SIZE].b = mask_byte << 8;
+     lut[LUT_SIZE].a = 0;
+}
+
+/***********************************************************************/
+/* The scratch arrays of writepng (row buffers, LUTs, etcetera) are
+   kept in a writepng_workspace, so that a caller writing many images
+   can reuse them rather than allocating them for every image; they
+   are only reallocated when an image needs more room, and the LUTs
+   are only recomputed when the colormap changes. */
+
+struct writepng_workspace_s {
+     void *buf[6];
+     size_t size[6];
+     lut_entry *lut[2];
+     colormap_t lut_cmap[2]; /* copies of the colormaps of lut */
+     png_byte lut_mask[2];
+     writepng_stats stats;
+};
+
+/* indices of the scratch arrays in buf */
+enum { WS_ROW, WS_MASK_PREV, WS_IDX, WS_INTERP, WS_COLBUF, WS_IMAGE };
+
+writepng_workspace *writepng_workspace_create(void)
+{
+     writepng_workspace *ws;
+     ws = (writepng_workspace *) calloc(1, sizeof(writepng_workspace));
+     return ws;
+}
+
+void writepng_workspace_destroy(writepng_workspace *ws)
+{
+     int i;
+     if (!ws)
+	  return;
+     for (i = 0; i < 6; ++i)
+	  free(ws->buf[i]);
+     for (i = 0; i < 2; ++i) {
+	  free(ws->lut[i]);
+	  free(ws->lut_cmap[i].rgba);
+     }
+     free(ws);
+}
+
+const writepng_stats *writepng_workspace_stats(const writepng_workspace *ws)
+{
+     return &ws->stats;
+}
+
+static double wall_time(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+     struct timeval tv;
+     gettimeofday(&tv, NULL);
+     return tv.tv_sec + 1e-6 * tv.tv_usec;
+#else
+     return (double) time(NULL);
+#endif
+}
+
+/* return scratch array i of ws, with room for at least size bytes,
+   or NULL if we are out of memory */
+static void *ws_buf(writepng_workspace *ws, int i, size_t size)
+{
+     if (size > ws->size[i]) {
+	  free(ws->buf[i]);
+	  ws->buf[i] = malloc(size);
+	  ws->size[i] = ws->buf[i] ? size : 0;
+     }
+     return ws->buf[i];
+}
+
+/* return LUT i of ws for the given colormap, or NULL if we are out
+   of memory */
+static lut_entry *ws_lut(writepng_workspace *ws, int i,
+			 colormap_t cmap, png_byte mask_byte)
+{
+     colormap_t *c = &ws->lut_cmap[i];
+     if (ws->lut[i] && c->n == cmap.n && ws->lut_mask[i] == mask_byte
+	 && !memcmp(c->rgba, cmap.rgba, sizeof(rgba_t) * cmap.n))
+	  return ws->lut[i];
+     if (!ws->lut[i]) {
+	  ws->lut[i] = (lut_entry *) malloc(sizeof(lut_entry) * (LUT_SIZE+1));
+	  if (!ws->lut[i])
+	       return NULL;
+     }
+     free(c->rgba);
+     c->rgba = (rgba_t *) malloc(sizeof(rgba_t) * cmap.n);
+     if (!c->rgba) {
+	  free(ws->lut[i]);
+	  ws->lut[i] = NULL;
+	  return NULL;
+     }
+     memcpy(c->rgba, cmap.rgba, sizeof(rgba_t) * cmap.n);
+     c->n = cmap.n;
+     ws->lut_mask[i] = mask_byte;
+     fill_lut(ws->lut[i], cmap, mask_byte);
+     return ws->lut[i];
+}
+
+/***********************************************************************/
+
+/* convert a value val in [minval, maxval] to an index into a LUT, where
+   lutscale = (LUT_SIZE - 1) / (maxval - minval); values out of range (or
+   NaN) are pinned to the ends of the table. */
+static int lut_index(REAL val, REAL minval, REAL lutscale)
+{
+     REAL k = (val - minval) * lutscale + 0.5;
+     return (k >= 0.0 ? (k < LUT_SIZE - 1 ? (int) k : LUT_SIZE - 1) : 0);
+}
+
+/* set the RGB pixels in row_pointer from the LUT indices idx (and the
+   overlay indices oidx, if olut is not NULL) computed by convert_row */
+static void colorize_row(int png_width, const int *idx, const lut_entry *lut,
+			 const int *oidx, const lut_entry *olut,
+			 png_byte *row_pointer)
+{
+     int i;
+
+     if (olut)
+	  for (i = 0; i < png_width; ++i) {
+	       const lut_entry *c = lut + idx[i], *o = olut + oidx[i];
+	       int ca = 256 - o->a;
+	       row_pointer[3*i    ] = (c->r * ca + o->r * o->a + 32768) >> 16;
+	       row_pointer[3*i + 1] = (c->g * ca + o->g * o->a + 32768) >> 16;
+	       row_pointer[3*i + 2] = (c->b * ca + o->b * o->a + 32768) >> 16;
+	  }
+     else
+	  for (i = 0; i < png_width; ++i) {
+	       const lut_entry *c = lut + idx[i];
+	       row_pointer[3*i    ] = (c->r + 128) >> 8;
+	       row_pointer[3*i + 1] = (c->g + 128) >> 8;
+	       row_pointer[3*i + 2] = (c->b + 128) >> 8;
+	  }
+}
+
 static void convert_row(int png_width, int data_width,
 			REAL scaley, REAL offsety,
 			REAL *datarow, REAL *datarow2, REAL weightrow,
 			int stride, REAL *maskrow, REAL *maskrow2,
 			REAL mask_thresh, REAL *mask_prev, int init_mask_prev,
-			png_byte mask_byte,
 			int mny, int mstride,
 			int overlay, REAL *olayrow, REAL *olayrow2,
-			colormap_t olay_cmap, REAL olaymin, REAL olaymax,
+			REAL olaymin, REAL olayscale,
 			int ony, int ostride,
-			colormap_t cmap,
 			REAL minrange, REAL maxrange, REAL scale,
+			int *idx, int *oidx,
 			png_byte * row_pointer, int eight_bit)
 {
      int i;
@@ -75,9 +243,7 @@ static void convert_row(int png_width, int data_width,
 	       if (eight_bit)
 		    row_pointer[i] = 255;
 	       else
-		    row_pointer[3*i]
-			 = row_pointer[3*i + 1]
-			 = row_pointer[3*i + 2] = mask_byte;
+		    idx[i] = oidx[i] = LUT_SIZE;
 	       continue;
 	  }
 
@@ -133,9 +299,7 @@ static void convert_row(int png_width, int data_width,
 		    if (eight_bit)
 			 row_pointer[i] = 255;
 		    else
-			 row_pointer[3*i]
-			      = row_pointer[3*i + 1]
-			      = row_pointer[3*i + 2] = mask_byte;
+			 idx[i] = oidx[i] = LUT_SIZE;
 		    continue;
 	       }
 	  }
@@ -147,28 +311,104 @@ static void convert_row(int png_width, int data_width,
 
 	  if (eight_bit)
 	       row_pointer[i] = (val - minrange) * scale;
-	  else if (overlay) {
-	       float r, g, b, a, ro, go, bo, ao;
-	       cmap_lookup((val - minrange) / (maxrange - minrange),
-			   cmap, &r, &g, &b, &a);
-	       cmap_lookup((olayval - olaymin) / (olaymax - olaymin),
-			   olay_cmap, &ro, &go, &bo, &ao);
-	       r = r * (1 - ao) + ro * ao;
-	       g = g * (1 - ao) + go * ao;
-	       b = b * (1 - ao) + bo * ao;
-	       row_pointer[3*i    ] = r * 255 + 0.5;
-	       row_pointer[3*i + 1] = g * 255 + 0.5;
-	       row_pointer[3*i + 2] = b * 255 + 0.5;
+	  else {
+	       /* scale is (LUT_SIZE - 1) / (maxrange - minrange) here */
+	       idx[i] = lut_index(val, minrange, scale);
+	       if (overlay)
+		    oidx[i] = lut_index(olayval, olaymin, olayscale);
+	  }
+     }
+}
+
+/* In the common case of no skew, mask, or overlay, the interpolation
+   in convert_row depends only on the column i, so we precompute the
+   data indices n1[i] <= n2[i] and weights w[i] of each pixel once per
+   image; convert_row_fast then interpolates contiguous data rows
+   (copied into scratch buffers by fetch_row, for transposed data)
+   in a simple loop that the compiler can vectorize.  The arithmetic
+   is the same as in convert_row, so the images are identical. */
+
+typedef struct {
+     int *n1, *n2;
+     REAL *w;
+} row_interp;
+
+static int init_row_interp(row_interp *ri, int png_width, int data_width,
+			   REAL scaley, writepng_workspace *ws)
+{
+     int i;
+     char *buf = (char *) ws_buf(ws, WS_INTERP, (sizeof(int) * 2 +
+						 sizeof(REAL)) * png_width);
+
+     if (!buf)
+	  return 0;
+     ri->w = (REAL *) buf;
+     ri->n1 = (int *) (buf + sizeof(REAL) * png_width);
+     ri->n2 = ri->n1 + png_width;
+     for (i = 0; i < png_width; ++i) {
+	  REAL y = i * scaley;
+	  int n = PIN(0, (int) (y + 0.5), data_width-1);
+	  double delta = y - n;
+	  ri->n1[i] = n;
+	  if (delta == 0.0) {
+	       ri->n2[i] = n;
+	       ri->w[i] = 0.0;
 	  }
 	  else {
-	       float r, g, b, a;
-	       cmap_lookup((val - minrange) / (maxrange - minrange),
-			   cmap, &r, &g, &b, &a);
-	       row_pointer[3*i    ] = r * 255 + 0.5;
-	       row_pointer[3*i + 1] = g * 255 + 0.5;
-	       row_pointer[3*i + 2] = b * 255 + 0.5;
+	       ri->n2[i] = PIN(0, n + (delta < 0.0 ? -1 : 1), data_width-1);
+	       ri->w[i] = fabs(delta);
 	  }
      }
+     return 1;
+}
+
+static void convert_row_fast(int png_width, const row_interp *ri,
+			     const REAL *datarow, const REAL *datarow2,
+			     REAL weightrow,
+			     REAL minrange, REAL maxrange, REAL scale,
+			     int *idx, png_byte *row_pointer, int eight_bit)
+{
+     const int *n1 = ri->n1, *n2 = ri->n2;
+     const REAL *w = ri->w;
+     REAL weightrow2 = 1 - weightrow;
+     int i;
+
+     for (i = 0; i < png_width; ++i) {
+	  REAL val =
+	       (datarow[n1[i]] * (1 - w[i]) + datarow[n2[i]] * w[i])
+	       * weightrow +
+	       (datarow2[n1[i]] * (1 - w[i]) + datarow2[n2[i]] * w[i])
+	       * weightrow2;
+	  if (val > maxrange)
+	       val = maxrange;
+	  else if (val < minrange)
+	       val = minrange;
+	  if (eight_bit)
+	       row_pointer[i] = (val - minrange) * scale;
+	  else
+	       idx[i] = lut_index(val, minrange, scale);
+     }
+}
+
+/* return a contiguous copy of column n of the data_height x data_width
+   transposed data, keeping the two most recently used columns in buf
+   (and their indices in bufn) since successive png rows mostly reuse
+   them; the column in "keep" is not evicted. */
+static const REAL *fetch_row(const REAL *data, int n,
+			     int data_height, int data_width,
+			     REAL *buf[2], int bufn[2], const REAL *keep)
+{
+     int j, b;
+
+     if (bufn[0] == n)
+	  return buf[0];
+     if (bufn[1] == n)
+	  return buf[1];
+     b = buf[0] == keep ? 1 : 0;
+     for (j = 0; j < data_width; ++j)
+	  buf[b][j] = data[n + j * data_height];
+     bufn[b] = n;
+     return buf[b];
 }
 
 static void init_palette(png_colorp palette, colormap_t colormap,
@@ -222,102 +462,300 @@ static void init_alpha(png_structp png_ptr, png_infop info_ptr,
 }
 #endif
 
-void writepng(char *filename,
-	      int nx, int ny, int transpose,
-	      REAL skew, REAL scalex, REAL scaley,
-	      REAL * data,
-	      REAL *mask, REAL mask_thresh,
-	      int mnx, int mny,
-	      REAL *overlay, colormap_t overlay_cmap,
-	      int onx, int ony,
-	      REAL minrange, REAL maxrange,
-	      colormap_t colormap, int eight_bit)
+/***********************************************************************/
+
+int writepng_parse_filters(const char *s)
 {
-     FILE *fp;
-     png_structp png_ptr;
-     png_infop info_ptr;
-     int height, width;
-     double skewsin = sin(skew), skewcos = cos(skew);
-     REAL minoverlay = 0, maxoverlay = 0;
-     png_byte mask_byte;
+     static const struct { const char *name; int mask; } f[] = {
+	  { "none", PNG_FILTER_NONE }, { "sub", PNG_FILTER_SUB },
+	  { "up", PNG_FILTER_UP }, { "avg", PNG_FILTER_AVG },
+	  { "paeth", PNG_FILTER_PAETH }, { "all", PNG_ALL_FILTERS }
+     };
+     int nf = sizeof(f) / sizeof(f[0]), mask = 0;
 
-     /* we must use direct color for translucent overlays */
-     if (overlay)
-	  eight_bit = 0;
+     while (*s) {
+	  size_t len = strcspn(s, ",");
+	  int i;
+	  for (i = 0; i < nf; ++i)
+	       if (strlen(f[i].name) == len && !strncmp(s, f[i].name, len))
+		    break;
+	  if (i == nf)
+	       return -1;
+	  mask |= f[i].mask;
+	  s += len;
+	  if (*s)
+	       ++s;
+     }
+     return mask ? mask : -1;
+}
 
-     /* compute png size from scaled (and possibly transposed) data size,
-      * and reverse the meaning of the scale factors; now they are what we
-      * multiply png coordinates by to get data coordinates: */
+/* Large images can be compressed by several threads: the image is
+   rendered into memory, and then bands of rows are filtered and
+   deflated independently.  As in pigz, each band is primed with the
+   last 32k of the preceding filtered rows as its dictionary and ends
+   with a sync flush, so that the raw deflate streams can simply be
+   concatenated (with a zlib header and the combined adler32 checksum)
+   into the IDAT data. */
 
-     if (transpose) {
-	  height = MAX(1, ny * scalex * skewcos);
-	  width = MAX(1, nx * scaley * (1.0 + fabs(skewsin)));
-	  scalex = height==1 ? 0 : (1.0 * (ny-1)) / (height-1);
-	  scaley = width==1 ? 0 : ((1.0 + fabs(skewsin)) * (nx-1)) / (width-1);
-     } else {
-	  height = MAX(1, nx * scalex * skewcos);
-	  width = MAX(1, ny * scaley * (1.0 + fabs(skewsin)));
-	  scalex = height==1 ? 0 : (1.0 * (nx-1)) / (height-1);
-	  scaley = width==1 ? 0 : ((1.0 + fabs(skewsin)) * (ny-1)) / (width-1);
+#define BAND_BYTES (256 * 1024) /* uncompressed bytes per band */
+#define DICT_BYTES 32768
+#define PARALLEL_MIN_BYTES (2 * BAND_BYTES)
+
+static int paeth(int a, int b, int c)
+{
+     int p = a + b - c;
+     int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+     return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+/* apply the PNG filter type (0-4) to row, given the previous row prev
+   (all zeros for the first row), storing the type byte and the
+   filtered bytes in out */
+static void filter_row(int type, size_t bpp, size_t rowbytes,
+		       const png_byte *row, const png_byte *prev,
+		       png_byte *out)
+{
+     size_t i;
+
+     *out++ = type;
+     switch (type) {
+	 case 1:
+	      for (i = 0; i < rowbytes; ++i)
+		   out[i] = row[i] - (i < bpp ? 0 : row[i - bpp]);
+	      break;
+	 case 2:
+	      for (i = 0; i < rowbytes; ++i)
+		   out[i] = row[i] - prev[i];
+	      break;
+	 case 3:
+	      for (i = 0; i < rowbytes; ++i)
+		   out[i] = row[i] - (((i < bpp ? 0 : row[i - bpp])
+				       + prev[i]) >> 1);
+	      break;
+	 case 4:
+	      for (i = 0; i < rowbytes; ++i)
+		   out[i] = row[i] - (i < bpp ? prev[i] :
+				      paeth(row[i - bpp], prev[i],
+					    prev[i - bpp]));
+	      break;
+	 default:
+	      memcpy(out, row, rowbytes);
      }
+}
 
-     if (overlay) {
-	  int i;
-	  minoverlay = maxoverlay = overlay[0];
-	  for (i = 1; i < onx * ony; ++i) {
-	       if (minoverlay > overlay[i])
-		    minoverlay = overlay[i];
-	       if (maxoverlay < overlay[i])
-		    maxoverlay = overlay[i];
+/* choose among the filters (a mask of PNG_FILTER_*) by the same
+   heuristic as libpng, the smallest sum of absolute (signed) values,
+   using tmp as scratch space for the candidates */
+static void filter_best(int filters, size_t bpp, size_t rowbytes,
+			const png_byte *row, const png_byte *prev,
+			png_byte *out, png_byte *tmp)
+{
+     unsigned long best = 0;
+     int type, nbest = 0;
+
+     for (type = 0; type < 5; ++type)
+	  if (filters & (PNG_FILTER_NONE << type)) {
+	       png_byte *f = nbest ? tmp : out;
+	       unsigned long sum = 0;
+	       size_t i;
+	       filter_row(type, bpp, rowbytes, row, prev, f);
+	       if (filters == (PNG_FILTER_NONE << type))
+		    return; /* only one choice */
+	       for (i = 1; i <= rowbytes; ++i)
+		    sum += f[i] < 128 ? f[i] : 256 - f[i];
+	       if (!nbest++ || sum < best) {
+		    best = sum;
+		    if (f != out)
+			 memcpy(out, f, rowbytes + 1);
+	       }
 	  }
-     }
+}
 
-     /* determine mask color by middle of colormap (FIXME: use
-	median color of the data or some such thing instead?) */
-     {
-	  float r,g,b,a;
-	  cmap_lookup(0.5, colormap, &r, &g, &b, &a);
-	  if ((r + g + b) / 3.0 > 0.5)
-	       mask_byte = 0; /* black */
-	  else
-	       mask_byte = 255; /* white */
-     }
+typedef struct {
+     png_byte *out; /* raw deflate data */
+     size_t nout;
+     uLong adler, len; /* adler32 and length of the uncompressed data */
+} png_band;
 
-     fp = fopen(filename, "wb");
-     if (fp == NULL) {
-	  perror("Error creating file to write PNG in");
-	  return;
-     }
-     /* Create and initialize the png_struct with the desired error
-      * handler * functions.  If you want to use the default stderr and
-      * longjump method, * you can supply NULL for the last three
-      * parameters.  We also check that * the library version is
-      * compatible with the one used at compile time, * in case we are
-      * using dynamically linked libraries.  REQUIRED. */
-     png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,NULL);
+/* filter and compress rows r0 to r1-1 of the image into b, returning
+   0 if we are out of memory */
+static int compress_band(const png_byte *img, size_t rowbytes, int bpp,
+			 int filters, int level, int strategy,
+			 int r0, int r1, int last, png_band *b)
+{
+     size_t frow = rowbytes + 1, ndict;
+     int d0 = r0 - (int) ((DICT_BYTES + frow - 1) / frow), r, ret;
+     png_byte *buf, *tmp, *zero;
+     z_stream z;
 
-     if (png_ptr == NULL) {
-	  fclose(fp);
-	  return;
+     if (d0 < 0)
+	  d0 = 0;
+     buf = (png_byte *) malloc(frow * (r1 - d0 + 1) + rowbytes);
+     if (!buf)
+	  return 0;
+     tmp = buf + frow * (r1 - d0);
+     zero = tmp + frow;
+     memset(zero, 0, rowbytes);
+     for (r = d0; r < r1; ++r)
+	  filter_best(filters, bpp, rowbytes, img + r * rowbytes,
+		      r ? img + (r - 1) * rowbytes : zero,
+		      buf + (r - d0) * frow, tmp);
+
+     memset(&z, 0, sizeof(z));
+     if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+	  free(buf);
+	  return 0;
      }
-     /* Allocate/initialize the image information data.  REQUIRED */
-     info_ptr = png_create_info_struct(png_ptr);
-     if (info_ptr == NULL) {
-	  fclose(fp);
-	  png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-	  return;
+     ndict = frow * (r0 - d0);
+     if (ndict > DICT_BYTES)
+	  ndict = DICT_BYTES;
+     if (ndict)
+	  deflateSetDictionary(&z, buf + frow * (r0 - d0) - ndict, ndict);
+
+     b->len = frow * (r1 - r0);
+     b->adler = adler32(adler32(0, Z_NULL, 0), buf + frow * (r0 - d0),
+			b->len);
+     b->nout = deflateBound(&z, b->len) + 16; /* + room for sync flush */
+     b->out = (png_byte *) malloc(b->nout);
+     if (!b->out) {
+	  deflateEnd(&z);
+	  free(buf);
+	  return 0;
      }
-     /* Set error handling.  REQUIRED if you aren't supplying your own *
-      * error hadnling functions in the png_create_write_struct() call. */
-     if (setjmp(png_jmpbuf(png_ptr))) {
-	  /* If we get here, we had a problem reading the file */
-	  fclose(fp);
-	  png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-	  return;
+     z.next_in = buf + frow * (r0 - d0);
+     z.avail_in = b->len;
+     z.next_out = b->out;
+     z.avail_out = b->nout;
+     ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+     b->nout = z.total_out;
+     deflateEnd(&z);
+     free(buf);
+     return (last ? ret == Z_STREAM_END : ret == Z_OK && z.avail_out > 0)
+	  && z.avail_in == 0;
+}
+
+/* write the image img (height rows of rowbytes bytes) to png_ptr as
+   IDAT chunks compressed by nthreads threads, returning 0 (having
+   written nothing) if we ran out of memory */
+static int write_idat_parallel(png_structp png_ptr, const png_byte *img,
+			       int height, size_t rowbytes, int bpp,
+			       int filters, int level, int strategy,
+			       int nthreads)
+{
+     int band_rows = MAX(1, BAND_BYTES / (rowbytes + 1));
+     int nbands = (height + band_rows - 1) / band_rows, ib, ok = 1;
+     png_band *bands = (png_band *) calloc(nbands, sizeof(png_band));
+     static png_byte idat[5] = "IDAT";
+
+     if (!bands)
+	  return 0;
+     (void) nthreads;
+#ifdef _OPENMP
+#    pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) reduction(&&: ok)
+#endif
+     for (ib = 0; ib < nbands; ++ib)
+	  ok = compress_band(img, rowbytes, bpp, filters, level, strategy,
+			     ib * band_rows,
+			     MIN(height, (ib + 1) * band_rows),
+			     ib == nbands - 1, bands + ib) && ok;
+
+     if (ok) {
+	  int flevel = level < 0 ? 2 : (level < 2 ? 0 : level < 6 ? 1
+					: level == 6 ? 2 : 3);
+	  png_byte header[2], trailer[4];
+	  uLong adler = adler32(0, Z_NULL, 0);
+
+	  header[0] = 0x78; /* deflate, 32k window */
+	  header[1] = flevel << 6;
+	  header[1] += (31 - (header[0] * 256 + header[1]) % 31) % 31;
+	  for (ib = 0; ib < nbands; ++ib)
+	       adler = adler32_combine(adler, bands[ib].adler, bands[ib].len);
+	  trailer[0] = adler >> 24;
+	  trailer[1] = adler >> 16;
+	  trailer[2] = adler >> 8;
+	  trailer[3] = adler;
+
+	  for (ib = 0; ib < nbands; ++ib) {
+	       int first = ib == 0, final = ib == nbands - 1;
+	       png_write_chunk_start(png_ptr, idat,
+				     bands[ib].nout + (first ? 2 : 0)
+				     + (final ? 4 : 0));
+	       if (first)
+		    png_write_chunk_data(png_ptr, header, 2);
+	       png_write_chunk_data(png_ptr, bands[ib].out, bands[ib].nout);
+	       if (final)
+		    png_write_chunk_data(png_ptr, trailer, 4);
+	       png_write_chunk_end(png_ptr);
+	  }
      }
+
+     for (ib = 0; ib < nbands; ++ib)
+	  free(bands[ib].out);
+     free(bands);
+     return ok;
+}
+
+/* The image to be written by writepng, with its png dimensions and
+   the scale factors (now png coordinates to data coordinates) computed.
+   These are passed to write_png_image by pointer, rather than being
+   local variables of writepng, so that nothing that changes is live
+   across the setjmp of write_png_guarded. */
+typedef struct {
+     FILE *fp;
+     int nx, ny, transpose;
+     REAL skewsin, scalex, scaley;
+     REAL *data, *mask, mask_thresh;
+     int mnx, mny;
+     REAL *overlay;
+     colormap_t overlay_cmap;
+     int onx, ony;
+     REAL minrange, maxrange, minoverlay, maxoverlay;
+     colormap_t colormap;
+     int eight_bit;
+     png_byte mask_byte;
+     int width, height, level, filters, nthreads;
+     writepng_workspace *ws;
+} png_image_job;
+
+/* write_png_image must not be inlined into write_png_guarded, which
+   would put its local variables back across the setjmp */
+#ifdef __GNUC__
+#  define NOINLINE __attribute__((noinline))
+#else
+#  define NOINLINE
+#endif
+
+/* write the png image of j, returning 0 if we are out of memory */
+static NOINLINE int write_png_image(png_structp png_ptr, png_infop info_ptr,
+			   const png_image_job *j)
+{
+     FILE *fp = j->fp;
+     int nx = j->nx, ny = j->ny, transpose = j->transpose;
+     REAL skewsin = j->skewsin, scalex = j->scalex, scaley = j->scaley;
+     REAL *data = j->data, *mask = j->mask, mask_thresh = j->mask_thresh;
+     int mnx = j->mnx, mny = j->mny;
+     REAL *overlay = j->overlay;
+     colormap_t overlay_cmap = j->overlay_cmap;
+     int onx = j->onx, ony = j->ony;
+     REAL minrange = j->minrange, maxrange = j->maxrange;
+     REAL minoverlay = j->minoverlay, maxoverlay = j->maxoverlay;
+     colormap_t colormap = j->colormap;
+     int eight_bit = j->eight_bit;
+     png_byte mask_byte = j->mask_byte;
+     int width = j->width, height = j->height;
+     int level = j->level, filters = j->filters, nthreads = j->nthreads;
+     writepng_workspace *ws = j->ws;
+     int idat_written = 0;
+     double t, t1, render_time = 0, encode_time = 0;
+
      /* set up the output control if you are using standard C streams */
      png_init_io(png_ptr, fp);
 
+     if (level != Z_DEFAULT_COMPRESSION)
+	  png_set_compression_level(png_ptr, level);
+     if (filters)
+	  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+
      /* Set the image information here.  Width and height are up to
        2^31, bit_depth is one of 1, 2, 4, 8, or 16, but valid values
        also depend on the color_type selected. color_type is one of
@@ -357,31 +795,57 @@ void writepng(char *filename,
 
      /* Write out data, one row at a time: */
      {
-	  REAL scale, *mask_prev = NULL;
-	  png_byte *row_pointer;
+	  REAL scale, olayscale = 0.0, *mask_prev = NULL;
+	  png_byte *row_pointer, *img = NULL;
+	  size_t rowbytes = width * sizeof(png_byte) * (eight_bit ? 1 : 3);
+	  int *idx = NULL, *oidx = NULL;
+	  lut_entry *lut = NULL, *olut = NULL;
+	  row_interp ri = { NULL, NULL, NULL };
+	  int fast = 0;
+	  REAL *colbuf[2] = { NULL, NULL };
+	  int colbufn[2] = { -1, -1 };
 	  int row;
 	  int data_height = transpose ? ny : nx;
 	  int data_width = transpose ? nx : ny;
 
 	  if (maxrange > minrange)
-	       scale = 254.0 / (maxrange - minrange);
+	       scale = (eight_bit ? 254.0 : LUT_SIZE - 1.0)
+		    / (maxrange - minrange);
 	  else
 	       scale = 0.0;
+	  if (maxoverlay > minoverlay)
+	       olayscale = (LUT_SIZE - 1.0) / (maxoverlay - minoverlay);
 
-	  row_pointer = (png_byte *) malloc(width * sizeof(png_byte) *
-					    (eight_bit ? 1 : 3));
-	  if (row_pointer == NULL) {
-	       fclose(fp);
-	       return;
+	  row_pointer = (png_byte *) ws_buf(ws, WS_ROW, rowbytes);
+	  /* for parallel compression, render the whole image first */
+	  if (nthreads > 1 && rowbytes * height >= PARALLEL_MIN_BYTES)
+	       img = (png_byte *) ws_buf(ws, WS_IMAGE, rowbytes * height);
+	  if (mask)
+	       mask_prev = (REAL *) ws_buf(ws, WS_MASK_PREV,
+					   width * sizeof(REAL));
+	  if (!eight_bit) {
+	       idx = (int *) ws_buf(ws, WS_IDX, width * sizeof(int) * 2);
+	       oidx = idx + width;
+	       lut = ws_lut(ws, 0, colormap, mask_byte);
+	       if (overlay)
+		    olut = ws_lut(ws, 1, overlay_cmap, mask_byte);
 	  }
-	  if (mask) {
-	       mask_prev = (REAL *) malloc(width * sizeof(REAL));
-	       if (mask_prev == NULL) {
-		    free(row_pointer);
-		    fclose(fp);
-		    return;
+	  if (!row_pointer || (mask && !mask_prev)
+	      || (!eight_bit && (!idx || !lut || (overlay && !olut))))
+	       return 0;
+	  if (skewsin == 0.0 && !mask && !overlay
+	      && init_row_interp(&ri, width, data_width, scaley, ws)) {
+	       fast = 1;
+	       if (transpose) {
+		    colbuf[0] = (REAL *) ws_buf(ws, WS_COLBUF, sizeof(REAL)
+						* data_width * 2);
+		    if (colbuf[0])
+			 colbuf[1] = colbuf[0] + data_width;
+		    else
+			 fast = 0;
 	       }
 	  }
+	  t = wall_time();
 	  for (row = height-1; row >= 0; --row) {
 	       REAL x = row * scalex;
 	       int n = PIN(0,(int) (x + 0.5), data_height-1);
@@ -394,18 +858,36 @@ void writepng(char *filename,
 		    offset = x*skewsin;
 	       else
 		    offset = (x - (height-1)*scalex) * skewsin;
-	       if (transpose)
+	       if (img)
+		    row_pointer = img + (size_t) (height-1 - row) * rowbytes;
+	       if (fast) {
+		    const REAL *r1, *r2;
+		    if (transpose) {
+			 r1 = fetch_row(data, n, data_height, data_width,
+					colbuf, colbufn, NULL);
+			 r2 = fetch_row(data, n2, data_height, data_width,
+					colbuf, colbufn, r1);
+		    }
+		    else {
+			 r1 = data + n * data_width;
+			 r2 = data + n2 * data_width;
+		    }
+		    convert_row_fast(width, &ri, r1, r2, 1 - fabs(delta),
+				     minrange, maxrange, scale,
+				     idx, row_pointer, eight_bit);
+	       }
+	       else if (transpose)
 		    convert_row(width, data_width, scaley, offset,
 				data + n, data + n2, 1 - fabs(delta),
 				data_height,
 				mask ? mask + (n%mny) : NULL,
 				mask ? mask + (n3%mny) : NULL,
 				mask_thresh, mask_prev, row == height-1,
-				mask_byte, mnx, mny,
+				mnx, mny,
 				overlay != 0,
 				overlay + (n%ony), overlay + (n2%ony),
-				overlay_cmap, minoverlay, maxoverlay, onx, ony,
-				colormap, minrange, maxrange, scale,
+				minoverlay, olayscale, onx, ony,
+				minrange, maxrange, scale, idx, oidx,
 				row_pointer, eight_bit);
 	       else
 		    convert_row(width, data_width, scaley, offset,
@@ -415,22 +897,49 @@ void writepng(char *filename,
 				mask ? mask + (n%mnx) * mny : NULL,
 				mask ? mask + (n3%mnx) * mny : NULL,
 				mask_thresh, mask_prev, row == height-1,
-				mask_byte, mny, 1,
+				mny, 1,
 				overlay != 0,
 				overlay + (n%onx) * ony,
 				overlay + (n2%onx) * ony,
-				overlay_cmap, minoverlay, maxoverlay, ony, 1,
-				colormap, minrange, maxrange, scale,
+				minoverlay, olayscale, ony, 1,
+				minrange, maxrange, scale, idx, oidx,
 				row_pointer, eight_bit);
-	       png_write_rows(png_ptr, &row_pointer, 1);
+	       if (!eight_bit)
+		    colorize_row(width, idx, lut, oidx, olut, row_pointer);
+	       t1 = wall_time();
+	       render_time += t1 - t;
+	       if (!img)
+		    png_write_rows(png_ptr, &row_pointer, 1);
+	       t = img ? t1 : wall_time();
+	       encode_time += t - t1;
 	  }
 
-	  free(row_pointer);
-	  free(mask_prev);
+	  if (img) {
+	       /* libpng's defaults: filters (and Z_FILTERED) except for
+		  palette images */
+	       int pfilters = filters ? filters : eight_bit ?
+		    PNG_FILTER_NONE : PNG_ALL_FILTERS;
+	       int pstrategy = pfilters != PNG_FILTER_NONE ? Z_FILTERED
+		    : Z_DEFAULT_STRATEGY;
+	       if (write_idat_parallel(png_ptr, img, height, rowbytes,
+				       eight_bit ? 1 : 3, pfilters, level,
+				       pstrategy, nthreads)) {
+		    /* png_write_end needs libpng to have written the IDAT */
+		    static png_byte iend[5] = "IEND";
+		    png_write_chunk(png_ptr, iend, NULL, 0);
+		    idat_written = 1;
+	       }
+	       else /* out of memory: compress serially instead */
+		    for (row = 0; row < height; ++row) {
+			 row_pointer = img + (size_t) row * rowbytes;
+			 png_write_rows(png_ptr, &row_pointer, 1);
+		    }
+	  }
      }
 
      /* It is REQUIRED to call this to finish writing the rest of the file */
-     png_write_end(png_ptr, info_ptr);
+     if (!idat_written)
+	  png_write_end(png_ptr, info_ptr);
 
      /* if you malloced the palette, free it here */
      {
@@ -439,13 +948,153 @@ void writepng(char *filename,
                png_free(png_ptr, palette);
      }
 
-     /* if you allocated any text comments, free them here */
+     ws->stats.render_time += render_time;
+     ws->stats.encode_time += encode_time + (wall_time() - t);
+     ws->stats.data_bytes += (double) nx * ny * sizeof(REAL);
+     ws->stats.image_bytes += (double) height * width * (eight_bit ? 1 : 3);
+     return 1;
+}
+
+/* write_png_image, returning 0 if it fails or if libpng reports an
+   error (by longjmp, for which this is the setjmp) */
+static int write_png_guarded(png_structp png_ptr, png_infop info_ptr,
+			     const png_image_job *j)
+{
+     if (setjmp(png_jmpbuf(png_ptr)))
+	  return 0;
+     return write_png_image(png_ptr, info_ptr, j);
+}
+
+void writepng(char *filename,
+	      int nx, int ny, int transpose,
+	      REAL skew, REAL scalex, REAL scaley,
+	      REAL * data,
+	      REAL *mask, REAL mask_thresh,
+	      int mnx, int mny,
+	      REAL *overlay, colormap_t overlay_cmap,
+	      int onx, int ony,
+	      REAL minrange, REAL maxrange,
+	      colormap_t colormap, int eight_bit,
+	      writepng_workspace *ws, const writepng_options *opts)
+{
+     writepng_options o = WRITEPNG_OPTIONS_DEFAULT;
+     int level, filters;
+     writepng_workspace *tmp_ws = NULL;
+     png_image_job job;
+     FILE *fp;
+     png_structp png_ptr;
+     png_infop info_ptr;
+     int height, width;
+     double skewsin = sin(skew), skewcos = cos(skew);
+     REAL minoverlay = 0, maxoverlay = 0;
+     png_byte mask_byte;
+
+     /* we must use direct color for translucent overlays */
+     if (overlay)
+	  eight_bit = 0;
+
+     if (opts)
+	  o = *opts;
+     level = o.level >= 0 ? o.level : (o.fast ? 1 : Z_DEFAULT_COMPRESSION);
+     filters = o.filters ? o.filters : (o.fast ? PNG_FILTER_UP : 0);
+
+     /* compute png size from scaled (and possibly transposed) data size,
+      * and reverse the meaning of the scale factors; now they are what we
+      * multiply png coordinates by to get data coordinates: */
+
+     if (transpose) {
+	  height = MAX(1, ny * scalex * skewcos);
+	  width = MAX(1, nx * scaley * (1.0 + fabs(skewsin)));
+	  scalex = height==1 ? 0 : (1.0 * (ny-1)) / (height-1);
+	  scaley = width==1 ? 0 : ((1.0 + fabs(skewsin)) * (nx-1)) / (width-1);
+     } else {
+	  height = MAX(1, nx * scalex * skewcos);
+	  width = MAX(1, ny * scaley * (1.0 + fabs(skewsin)));
+	  scalex = height==1 ? 0 : (1.0 * (nx-1)) / (height-1);
+	  scaley = width==1 ? 0 : ((1.0 + fabs(skewsin)) * (ny-1)) / (width-1);
+     }
+
+     if (overlay) {
+	  int i;
+	  minoverlay = maxoverlay = overlay[0];
+	  for (i = 1; i < onx * ony; ++i) {
+	       if (minoverlay > overlay[i])
+		    minoverlay = overlay[i];
+	       if (maxoverlay < overlay[i])
+		    maxoverlay = overlay[i];
+	  }
+     }
+
+     /* determine mask color by middle of colormap (FIXME: use
+	median color of the data or some such thing instead?) */
+     {
+	  float r,g,b,a;
+	  cmap_lookup(0.5, colormap, &r, &g, &b, &a);
+	  if ((r + g + b) / 3.0 > 0.5)
+	       mask_byte = 0; /* black */
+	  else
+	       mask_byte = 255; /* white */
+     }
+
+     if (!ws) {
+	  ws = tmp_ws = writepng_workspace_create();
+	  if (!ws)
+	       return;
+     }
+
+     fp = fopen(filename, "wb");
+     if (fp == NULL) {
+	  perror("Error creating file to write PNG in");
+	  writepng_workspace_destroy(tmp_ws);
+	  return;
+     }
+     /* Create and initialize the png_struct with the desired error
+      * handler * functions.  If you want to use the default stderr and
+      * longjump method, * you can supply NULL for the last three
+      * parameters.  We also check that * the library version is
+      * compatible with the one used at compile time, * in case we are
+      * using dynamically linked libraries.  REQUIRED. */
+     png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,NULL);
+
+     if (png_ptr == NULL) {
+	  fclose(fp);
+	  writepng_workspace_destroy(tmp_ws);
+	  return;
+     }
+     /* Allocate/initialize the image information data.  REQUIRED */
+     info_ptr = png_create_info_struct(png_ptr);
+     if (info_ptr == NULL) {
+	  fclose(fp);
+	  png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+	  writepng_workspace_destroy(tmp_ws);
+	  return;
+     }
+
+     job.fp = fp;
+     job.nx = nx; job.ny = ny; job.transpose = transpose;
+     job.skewsin = skewsin; job.scalex = scalex; job.scaley = scaley;
+     job.data = data; job.mask = mask; job.mask_thresh = mask_thresh;
+     job.mnx = mnx; job.mny = mny;
+     job.overlay = overlay; job.overlay_cmap = overlay_cmap;
+     job.onx = onx; job.ony = ony;
+     job.minrange = minrange; job.maxrange = maxrange;
+     job.minoverlay = minoverlay; job.maxoverlay = maxoverlay;
+     job.colormap = colormap;
+     job.eight_bit = eight_bit;
+     job.mask_byte = mask_byte;
+     job.width = width; job.height = height;
+     job.level = level; job.filters = filters; job.nthreads = o.nthreads;
+     job.ws = ws;
+     if (write_png_guarded(png_ptr, info_ptr, &job))
+	  ws->stats.png_bytes += ftell(fp);
+     /* else: we had a problem writing the file */
 
      /* clean up after the write, and free any memory allocated */
      png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
 
      /* close the file */
      fclose(fp);
+     writepng_workspace_destroy(tmp_ws);
 
      /* that's it */
 }
@@ -495,5 +1144,5 @@ void writepng_autorange(char *filename,
      }
      writepng(filename, nx, ny, transpose, skew, scalex, scaley,
 	      data, mask, mask_thresh, nx,ny, overlay, overlay_cmap, nx,ny,
-	      -range, range, colormap, eight_bit);
+	      -range, range, colormap, eight_bit, NULL, NULL);
 }
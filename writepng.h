@@ -44,6 +44,38 @@ typedef struct {
      rgba_t *rgba;
 } colormap_t;
 
+/* scratch storage for writepng, which can be reused for many images
+   (but only by one thread at a time); if NULL is passed to writepng,
+   a temporary workspace is used */
+typedef struct writepng_workspace_s writepng_workspace;
+
+writepng_workspace *writepng_workspace_create(void);
+void writepng_workspace_destroy(writepng_workspace *ws);
+/* statistics of the images written with a workspace: the total time
+   spent rendering them and encoding (compressing and writing) them,
+   the bytes of data rendered, and their size uncompressed and as PNG */
+typedef struct {
+     double render_time, encode_time;
+     double data_bytes, image_bytes, png_bytes;
+} writepng_stats;
+
+const writepng_stats *writepng_workspace_stats(const writepng_workspace *ws);
+
+/* PNG compression settings for writepng; passing NULL instead uses
+   WRITEPNG_OPTIONS_DEFAULT, i.e. the libpng defaults */
+typedef struct {
+     int level; /* zlib compression level 0-9, or -1 for the default */
+     int filters; /* mask of row filters to choose among (as returned
+		     by writepng_parse_filters), or 0 for the default */
+     int fast; /* fast compression: level 1 and the "up" filter,
+		  unless level/filters are given */
+     int nthreads; /* threads to compress each (large) image with */
+} writepng_options;
+
+#define WRITEPNG_OPTIONS_DEFAULT { -1, 0, 0, 1 }
+
+int writepng_parse_filters(const char *s);
+
 void writepng(char *filename,
 	      int nx, int ny, int transpose,
 	      REAL skew, REAL scalex, REAL scaley,
@@ -52,7 +84,8 @@ void writepng(char *filename,
 	      REAL *overlay, colormap_t overlay_cmap,
 	      int onx, int ony,
 	      REAL minrange, REAL maxrange,
-	      colormap_t colormap, int eight_bit);
+	      colormap_t colormap, int eight_bit,
+	      writepng_workspace *ws, const writepng_options *opts);
 
 void writepng_autorange(char *filename,
 			int nx, int ny, int transpose,